@@ -0,0 +1,200 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include "bt_mgmt.h"
+
+static void put_le16(uint8_t *p, uint16_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+}
+
+static uint16_t get_le16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static int socket_open(void *ctx)
+{
+    struct sockaddr_hci addr = {0};
+    int fd;
+
+    (void)ctx;
+    fd = socket(PF_BLUETOOTH, SOCK_RAW | SOCK_CLOEXEC, BTPROTO_HCI);
+    if (fd < 0)
+        return -1;
+
+    addr.hci_family = AF_BLUETOOTH;
+    addr.hci_dev = HCI_DEV_NONE;
+    addr.hci_channel = HCI_CHANNEL_CONTROL;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+static ssize_t socket_send(void *ctx, int fd, const void *buf, size_t len)
+{
+    ssize_t n;
+
+    (void)ctx;
+    do
+    {
+        n = write(fd, buf, len);
+    } while (n < 0 && errno == EINTR);
+    return n;
+}
+
+static ssize_t socket_recv(void *ctx, int fd, void *buf, size_t cap, int timeout_ms)
+{
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    int rc;
+    ssize_t n;
+
+    (void)ctx;
+    do
+    {
+        rc = poll(&pfd, 1, timeout_ms);
+    } while (rc < 0 && errno == EINTR);
+    if (rc <= 0)
+        return rc;
+
+    /* The control channel keeps message boundaries: one read, one event */
+    do
+    {
+        n = read(fd, buf, cap);
+    } while (n < 0 && errno == EINTR);
+    return n;
+}
+
+static void socket_close(void *ctx, int fd)
+{
+    (void)ctx;
+    close(fd);
+}
+
+const bt_mgmt_ops bt_mgmt_socket_ops = {
+    .open = socket_open,
+    .send = socket_send,
+    .recv = socket_recv,
+    .close = socket_close,
+};
+
+int bt_mgmt_open(bt_mgmt *m, uint16_t index, const bt_mgmt_ops *ops, void *ctx)
+{
+    m->ops = ops;
+    m->ctx = ctx;
+    m->index = index;
+    m->status = 0;
+    m->fd = ops->open(ctx);
+    return m->fd < 0 ? -1 : 0;
+}
+
+void bt_mgmt_close(bt_mgmt *m)
+{
+    if (m->fd >= 0)
+    {
+        m->ops->close(m->ctx, m->fd);
+        m->fd = -1;
+    }
+}
+
+int bt_mgmt_command(bt_mgmt *m, uint16_t opcode, const void *params, uint16_t len)
+{
+    uint8_t buf[BT_MGMT_HDR_LEN + 64];
+    ssize_t n;
+
+    m->status = 0;
+    if (len > sizeof(buf) - BT_MGMT_HDR_LEN)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    put_le16(buf, opcode);
+    put_le16(buf + 2, m->index);
+    put_le16(buf + 4, len);
+    if (len)
+        memcpy(buf + BT_MGMT_HDR_LEN, params, len);
+    if (m->ops->send(m->ctx, m->fd, buf, BT_MGMT_HDR_LEN + len) != BT_MGMT_HDR_LEN + len)
+        return -1;
+
+    /* Other listeners' commands and unsolicited events share the channel */
+    for (;;)
+    {
+        n = m->ops->recv(m->ctx, m->fd, buf, sizeof(buf), BT_MGMT_TIMEOUT_MS);
+        if (n == 0)
+        {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (n < 0)
+            return -1;
+        if (n < BT_MGMT_HDR_LEN + 3)
+            continue;
+
+        uint16_t event = get_le16(buf);
+        if (event != BT_MGMT_EV_CMD_COMPLETE && event != BT_MGMT_EV_CMD_STATUS)
+            continue;
+        if (get_le16(buf + 2) != m->index || get_le16(buf + BT_MGMT_HDR_LEN) != opcode)
+            continue;
+
+        m->status = buf[BT_MGMT_HDR_LEN + 2];
+        if (m->status != 0)
+        {
+            errno = EIO;
+            return -1;
+        }
+        return 0;
+    }
+}
+
+int bt_mgmt_set_mode(bt_mgmt *m, uint16_t opcode, uint8_t on)
+{
+    return bt_mgmt_command(m, opcode, &on, 1);
+}
+
+/* Run one step, naming it on failure */
+static int step(bt_mgmt *m, int rc, const char *what)
+{
+    if (rc == 0)
+        return 0;
+    if (m->status != 0)
+        fprintf(stderr, "%s failed: status 0x%02x\n", what, m->status);
+    else
+        perror(what);
+    return -1;
+}
+
+int bt_mgmt_setup_peripheral(bt_mgmt *m)
+{
+    /* General discoverable without timeout; the kernel requires connectable first */
+    uint8_t discoverable[3] = {0x01, 0x00, 0x00};
+
+    if (step(m, bt_mgmt_set_mode(m, BT_MGMT_OP_SET_POWERED, 1), "Power on") ||
+        step(m, bt_mgmt_set_mode(m, BT_MGMT_OP_SET_CONNECTABLE, 1), "Connectable on") ||
+        step(m, bt_mgmt_command(m, BT_MGMT_OP_SET_DISCOVERABLE, discoverable, sizeof(discoverable)),
+             "Discoverable on") ||
+        step(m, bt_mgmt_set_mode(m, BT_MGMT_OP_SET_BONDABLE, 1), "Pairable on"))
+        return -1;
+    return 0;
+}
+
+int bt_mgmt_secure_links(bt_mgmt *m)
+{
+    uint8_t io_capability = BT_MGMT_IO_KEYBOARD_DISPLAY;
+
+    if (step(m, bt_mgmt_command(m, BT_MGMT_OP_SET_IO_CAPABILITY, &io_capability, 1),
+             "Set IO capability") ||
+        step(m, bt_mgmt_set_mode(m, BT_MGMT_OP_SET_LINK_SECURITY, 1), "Link security on"))
+        return -1;
+    return 0;
+}
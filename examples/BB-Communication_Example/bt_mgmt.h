@@ -0,0 +1,130 @@
+#ifndef BT_MGMT_H
+#define BT_MGMT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Adapter setup through the kernel's Bluetooth management interface
+ *
+ * Commands go straight to the kernel over an HCI_CHANNEL_CONTROL socket,
+ * the same interface bluetoothd uses, instead of through bluetoothctl,
+ * D-Bus and bluetoothd. Every command is one write and one read:
+ *
+ *   command: [opcode][controller index][parameter length] parameters
+ *   event:   [event code][controller index][parameter length] parameters
+ *
+ * all header fields 2 bytes little-endian. A command is answered by a
+ * Command Complete or Command Status event carrying its opcode and a status.
+ */
+#define BT_MGMT_HDR_LEN 6
+
+// Commands used here
+#define BT_MGMT_OP_SET_POWERED 0x0005
+#define BT_MGMT_OP_SET_DISCOVERABLE 0x0006
+#define BT_MGMT_OP_SET_CONNECTABLE 0x0007
+#define BT_MGMT_OP_SET_BONDABLE 0x0009
+#define BT_MGMT_OP_SET_LINK_SECURITY 0x000A
+#define BT_MGMT_OP_SET_IO_CAPABILITY 0x0018
+
+// Events answering them
+#define BT_MGMT_EV_CMD_COMPLETE 0x0001
+#define BT_MGMT_EV_CMD_STATUS 0x0002
+
+// IO capability of a pairing agent that shows and takes passkeys
+#define BT_MGMT_IO_KEYBOARD_DISPLAY 0x04
+
+// Longest wait for the answer to one command
+#define BT_MGMT_TIMEOUT_MS 1000
+
+/*
+ * How management messages reach the kernel
+ * bt_mgmt_socket_ops is the real interface; tests pass their own to check
+ * the commands sent and to script the answers.
+ */
+typedef struct {
+    /**
+     * Open a management channel
+     *
+     * @return File descriptor, -1 on failure
+     */
+    int (*open)(void *ctx);
+
+    /**
+     * Write one complete command
+     *
+     * @return Bytes written, -1 on failure
+     */
+    ssize_t (*send)(void *ctx, int fd, const void *buf, size_t len);
+
+    /**
+     * Read one complete event
+     *
+     * @return Bytes read, 0 when nothing arrived within timeout_ms, -1 on failure
+     */
+    ssize_t (*recv)(void *ctx, int fd, void *buf, size_t cap, int timeout_ms);
+
+    void (*close)(void *ctx, int fd);
+} bt_mgmt_ops;
+
+// Kernel HCI_CHANNEL_CONTROL socket
+extern const bt_mgmt_ops bt_mgmt_socket_ops;
+
+// Management channel to one controller
+typedef struct {
+    const bt_mgmt_ops *ops;
+    void *ctx;                   // Passed to every op
+    int fd;
+    uint16_t index;              // Controller, 0 for hci0
+    uint8_t status;              // Status of the last answered command, 0 = success
+} bt_mgmt;
+
+/**
+ * Open the management channel of a controller
+ *
+ * @param index - Controller index, e.g. 0 for hci0
+ * @param ops - bt_mgmt_socket_ops, or a replacement in tests
+ * @return 0 on success, -1 on failure
+ */
+int bt_mgmt_open(bt_mgmt *m, uint16_t index, const bt_mgmt_ops *ops, void *ctx);
+
+/**
+ * Close the management channel
+ */
+void bt_mgmt_close(bt_mgmt *m);
+
+/**
+ * Send a command and wait for its answer
+ * Events about other commands or controllers are skipped
+ *
+ * @return 0 if the kernel completed the command, -1 if it failed
+ *         (m->status holds the kernel's status) or did not answer
+ */
+int bt_mgmt_command(bt_mgmt *m, uint16_t opcode, const void *params, uint16_t len);
+
+/**
+ * Switch a setting with a single on/off parameter, such as
+ * BT_MGMT_OP_SET_POWERED or BT_MGMT_OP_SET_BONDABLE
+ *
+ * @return 0 on success, -1 on failure
+ */
+int bt_mgmt_set_mode(bt_mgmt *m, uint16_t opcode, uint8_t on);
+
+/**
+ * Power the controller on and let centrals find, connect and pair with it,
+ * what "bluetoothctl power on", "discoverable on" and "pairable on" do
+ *
+ * @return 0 on success, -1 on failure with the step named on stderr
+ */
+int bt_mgmt_setup_peripheral(bt_mgmt *m);
+
+/**
+ * Require authenticated links ("hciconfig hci0 auth") and answer pairing
+ * requests with passkeys, the IO capability of bluetoothctl's default agent
+ *
+ * @return 0 on success, -1 on failure with the step named on stderr
+ */
+int bt_mgmt_secure_links(bt_mgmt *m);
+
+#endif
@@ -9,6 +9,7 @@
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/l2cap.h>
 #include "bbstate.h"
+#include "bt_mgmt.h"
 #include <bluetooth/hci.h>     // For HCI functions
 #include <bluetooth/hci_lib.h> // For HCI functions
 
@@ -29,6 +30,7 @@ static uint8_t remote_public_key[32] = {
     0xb9, 0xba, 0xd6, 0x3d, 0xa0, 0xec, 0xf7, 0x4f, 0x6f, 0x61};
 
 static bbstate state;
+static bt_mgmt mgmt;
 
 void print_buf(void *buf, size_t buf_len)
 {
@@ -75,29 +77,21 @@ int main(int argc, char **argv)
         }
     }
 
-    err = system("bluetoothctl power on");
-    if (err != 0)
+    /* hci0 unless a device was given */
+    if (bt_mgmt_open(&mgmt, dev_id >= 0 ? dev_id : 0, &bt_mgmt_socket_ops, NULL) < 0)
     {
-        perror("Failed to turn on Bluetooth power. Make sure you have permissions.");
+        perror("Failed to open the Bluetooth management socket. Make sure you have permissions.");
         exit(1);
     }
 
-    err = system("bluetoothctl discoverable on");
-    if (err != 0)
-    {
-        perror("Failed to make Bluetooth discoverable. Make sure you have permissions.");
-        exit(1);
-    }
-
-    err = system("bluetoothctl pairable on");
-    if (err != 0)
+    if (bt_mgmt_setup_peripheral(&mgmt) < 0)
     {
-        perror("Failed to make Bluetooth pairable. Make sure you have permissions.");
+        fprintf(stderr, "Failed to make Bluetooth discoverable and pairable. Make sure you have permissions.\n");
+        bt_mgmt_close(&mgmt);
         exit(1);
     }
 
     printf("Start Bluetooth L2CAP server...\n");
-    printf("IMPORTANT: Make sure adapter is discoverable via 'bluetoothctl'\n");
 
     /* allocate socket */
     server_socket = socket(AF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
@@ -232,8 +226,8 @@ int main(int argc, char **argv)
     close(client_socket);
     close(server_socket);
 
-    system("bluetoothctl default-agent");
-    system("hciconfig hci0 auth");
+    bt_mgmt_secure_links(&mgmt);
+    bt_mgmt_close(&mgmt);
 
     printf("Server finished.\n");
     return 0;
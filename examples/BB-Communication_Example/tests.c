@@ -0,0 +1,200 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bbstate.h"
+#ifdef BT_MGMT_TESTS
+#include "bt_mgmt.h"
+#endif
+
+static bbstate central, peripheral;
+
+static uint8_t pub_c[32];
+static uint8_t priv_c[32];
+
+static uint8_t pub_p[32];
+static uint8_t priv_p[32];
+
+void
+print_buf(void* buf, size_t buf_len)
+{
+    uint8_t* bufr = (uint8_t*)buf;
+    for (int i = 0; i < buf_len; i++) {
+        printf("%02x", bufr[i]);
+    }
+    printf("\n");
+}
+
+#ifdef BT_MGMT_TESTS
+/* Stand-in kernel: records commands and answers each one */
+struct mock_mgmt {
+    uint8_t sent[8][BT_MGMT_HDR_LEN + 8];
+    size_t sent_len[8];
+    int nsent;
+    uint16_t fail_opcode;        // Answered with status 0x0c (not supported)
+    bool silent;                 // Never answer
+    uint8_t events[4][BT_MGMT_HDR_LEN + 3];
+    int nevents, next_event;
+    bool closed;
+};
+
+static void
+mock_event(struct mock_mgmt* k, uint16_t event, uint16_t index,
+           uint16_t opcode, uint8_t status)
+{
+    uint8_t* e = k->events[k->nevents++];
+    e[0] = event & 0xff;
+    e[1] = event >> 8;
+    e[2] = index & 0xff;
+    e[3] = index >> 8;
+    e[4] = 3;
+    e[5] = 0;
+    e[6] = opcode & 0xff;
+    e[7] = opcode >> 8;
+    e[8] = status;
+}
+
+static int
+mock_open(void* ctx)
+{
+    return 42;
+}
+
+static ssize_t
+mock_send(void* ctx, int fd, const void* buf, size_t len)
+{
+    struct mock_mgmt* k = ctx;
+    const uint8_t* cmd = buf;
+    uint16_t opcode = cmd[0] | (cmd[1] << 8);
+    uint16_t index = cmd[2] | (cmd[3] << 8);
+
+    assert(fd == 42);
+    assert(k->nsent < 8 && len <= sizeof(k->sent[0]));
+    memcpy(k->sent[k->nsent], buf, len);
+    k->sent_len[k->nsent++] = len;
+
+    k->nevents = k->next_event = 0;
+    if (k->silent) return len;
+    /* Noise first: a settings event, then the same opcode on another controller */
+    mock_event(k, 0x0006, index, opcode, 0);
+    mock_event(k, BT_MGMT_EV_CMD_COMPLETE, index + 1, opcode, 0x0c);
+    if (opcode == k->fail_opcode)
+        mock_event(k, BT_MGMT_EV_CMD_STATUS, index, opcode, 0x0c);
+    else
+        mock_event(k, BT_MGMT_EV_CMD_COMPLETE, index, opcode, 0);
+    return len;
+}
+
+static ssize_t
+mock_recv(void* ctx, int fd, void* buf, size_t cap, int timeout_ms)
+{
+    struct mock_mgmt* k = ctx;
+
+    if (k->next_event == k->nevents) return 0;
+    memcpy(buf, k->events[k->next_event++], BT_MGMT_HDR_LEN + 3);
+    return BT_MGMT_HDR_LEN + 3;
+}
+
+static void
+mock_close(void* ctx, int fd)
+{
+    ((struct mock_mgmt*)ctx)->closed = true;
+}
+
+static const bt_mgmt_ops mock_ops = {
+    .open = mock_open,
+    .send = mock_send,
+    .recv = mock_recv,
+    .close = mock_close,
+};
+
+static void
+assert_sent(struct mock_mgmt* k, int i, uint16_t opcode, const uint8_t* params,
+            size_t len)
+{
+    const uint8_t* cmd = k->sent[i];
+
+    assert(k->sent_len[i] == BT_MGMT_HDR_LEN + len);
+    assert((cmd[0] | (cmd[1] << 8)) == opcode);
+    assert((cmd[2] | (cmd[3] << 8)) == 1);
+    assert((cmd[4] | (cmd[5] << 8)) == len);
+    assert(memcmp(cmd + BT_MGMT_HDR_LEN, params, len) == 0);
+}
+
+/* Management socket: adapter setup is one command per setting, in order */
+static void
+test_mgmt(void)
+{
+    static const uint8_t on = 1, io = BT_MGMT_IO_KEYBOARD_DISPLAY;
+    static const uint8_t discoverable[3] = {1, 0, 0};
+    struct mock_mgmt k = {0};
+    bt_mgmt m;
+
+    assert(bt_mgmt_open(&m, 1, &mock_ops, &k) == 0);
+    assert(bt_mgmt_setup_peripheral(&m) == 0);
+    assert(k.nsent == 4);
+    assert_sent(&k, 0, BT_MGMT_OP_SET_POWERED, &on, 1);
+    assert_sent(&k, 1, BT_MGMT_OP_SET_CONNECTABLE, &on, 1);
+    assert_sent(&k, 2, BT_MGMT_OP_SET_DISCOVERABLE, discoverable, 3);
+    assert_sent(&k, 3, BT_MGMT_OP_SET_BONDABLE, &on, 1);
+
+    assert(bt_mgmt_secure_links(&m) == 0);
+    assert(k.nsent == 6);
+    assert_sent(&k, 4, BT_MGMT_OP_SET_IO_CAPABILITY, &io, 1);
+    assert_sent(&k, 5, BT_MGMT_OP_SET_LINK_SECURITY, &on, 1);
+    bt_mgmt_close(&m);
+    assert(k.closed);
+
+    /* A refused command stops the setup with the kernel's status */
+    memset(&k, 0, sizeof(k));
+    k.fail_opcode = BT_MGMT_OP_SET_CONNECTABLE;
+    assert(bt_mgmt_open(&m, 1, &mock_ops, &k) == 0);
+    assert(bt_mgmt_setup_peripheral(&m) == -1);
+    assert(k.nsent == 2);
+    assert(m.status == 0x0c);
+
+    /* No answer is a failure too, not a hang */
+    memset(&k, 0, sizeof(k));
+    k.silent = true;
+    assert(bt_mgmt_open(&m, 1, &mock_ops, &k) == 0);
+    assert(bt_mgmt_set_mode(&m, BT_MGMT_OP_SET_POWERED, 1) == -1);
+    assert(m.status == 0);
+    bt_mgmt_close(&m);
+}
+#endif
+
+int
+main(int argc, char** argv)
+{
+
+    uint8_t buffer[128];
+
+    /* BB-session */
+    for (int i = 0; i < 10; i++) {
+        ecdh_keygen(pub_c, priv_c);
+        ecdh_keygen(pub_p, priv_p);
+
+        bbstate_init(&central, BB_ROLE_CENTRAL, pub_c, priv_c, pub_p, NULL);
+        bbstate_init(&peripheral, BB_ROLE_PERIPHERAL, pub_p, priv_p, pub_c,
+                     NULL);
+
+        bb_session_start_req(&central, buffer);
+
+        bb_session_start_rx(&peripheral, buffer);
+
+        bb_session_start_rsp(&peripheral, buffer);
+
+        bb_session_start_rx(&central, buffer);
+
+        assert(memcmp(central.key, peripheral.key, sizeof(central.key)) == 0);
+        assert(memcmp(central.hc, peripheral.hc, sizeof(central.hc)) == 0);
+        memset(&central, 0, sizeof(central));
+        memset(&peripheral, 0, sizeof(peripheral));
+    }
+
+#ifdef BT_MGMT_TESTS
+    test_mgmt();
+#endif
+    printf("tests ok\n");
+}
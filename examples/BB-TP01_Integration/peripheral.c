@@ -4,17 +4,27 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/l2cap.h>
 #include "bbstate.h"
-#include <bluetooth/hci.h>     // For HCI functions
-#include <bluetooth/hci_lib.h> // For HCI functions
+#include "bb_server.h"
+#include "bb_kdf.h"
 #include "tropic_simple.h"
 
 /* L2CAP server channel - must match client configuration */
 #define L2CAP_SERVER_PORT_NUM 0x0235
 
+// Resumption tickets from centrals, kept across restarts
+#define TICKET_FILE "bb_tickets.bin"
+
+// Commands issued while no central was connected, one per line with their
+// idempotency key, kept across restarts until a central answered them
+#define QUEUE_FILE "bb_queue.txt"
+#define QUEUE_MAX 64
+
 // Pre-shared cryptographic keys for secure handshake
 // These keys are used for the initial key exchange protocol
 static uint8_t private_key[32] = {
@@ -33,8 +43,8 @@ static uint8_t remote_public_key[32] = {
     0x70, 0xdf, 0xe9, 0x44, 0x98, 0x5f, 0x31, 0xe9, 0x54, 0x77, 0x7e,
     0xb9, 0xba, 0xd6, 0x3d, 0xa0, 0xec, 0xf7, 0x4f, 0x6f, 0x61};
 
-// Global state for the secure communication session
-static bbstate state;
+// Sessions with all connected central devices
+static bb_server server;
 
 /**
  * Print buffer contents in hexadecimal format
@@ -70,6 +80,7 @@ void parse_command(const char* input, struct tropic_message* msg) {
     strncpy(msg->command, input, sizeof(msg->command) - 1);
     msg->command[sizeof(msg->command) - 1] = '\0';
     msg->data_len = 0;
+    msg->key = 0;
 
     // Remove trailing newline
     char* newline = strchr(msg->command, '\n');
@@ -92,20 +103,557 @@ void format_response(struct tropic_response* resp, const char* status, const uin
     }
 }
 
+// Command waiting in the offline queue
+typedef struct {
+    char command[128];  // As typed, see tropic_message.command
+    uint32_t no;        // Number shown when it was queued
+    uint64_t key;       // Idempotency key, the same for every attempt
+    bb_session* s;      // Session its batch went out on, NULL while waiting
+    uint32_t id;        // Request id of that batch
+} console_queued;
+
+static struct {
+    console_queued items[QUEUE_MAX];
+    int count;
+    uint32_t next_no;
+} queue;
+
+/**
+ * Write the queued commands to QUEUE_FILE, or remove it once empty
+ */
+static void console_queue_save(void) {
+    if (queue.count == 0) {
+        unlink(QUEUE_FILE);
+        return;
+    }
+
+    FILE* f = fopen(QUEUE_FILE, "w");
+    if (!f) {
+        perror("Failed to save command queue");
+        return;
+    }
+    for (int i = 0; i < queue.count; i++) {
+        fprintf(f, "%016llx %s\n", (unsigned long long)queue.items[i].key,
+                queue.items[i].command);
+    }
+    fclose(f);
+}
+
+/**
+ * Append a command to the offline queue
+ *
+ * @param key - Idempotency key of the command, 0 to pick a new one
+ * @return Number of the queued command, 0 if the queue is full
+ */
+static uint32_t console_queue_add(const char* command, uint64_t key) {
+    if (queue.count == QUEUE_MAX) return 0;
+    while (key == 0) {
+        if (bb_random(&key, sizeof(key)) < 0) return 0;
+    }
+
+    console_queued* q = &queue.items[queue.count++];
+    snprintf(q->command, sizeof(q->command), "%s", command);
+    q->key = key;
+    q->no = ++queue.next_no;
+    q->s = NULL;
+    q->id = 0;
+    return q->no;
+}
+
+/**
+ * Queue the commands a previous run saved and did not get answered
+ */
+static void console_queue_load(void) {
+    char line[17 + sizeof(queue.items[0].command) + 1];
+    FILE* f = fopen(QUEUE_FILE, "r");
+
+    if (!f) return;
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long long key;
+        int start = 0;
+
+        line[strcspn(line, "\n")] = '\0';
+        if (sscanf(line, "%16llx %n", &key, &start) < 1 || start == 0) continue;
+        if (line[start] != '\0' && console_queue_add(line + start, key) == 0) break;
+    }
+    fclose(f);
+    if (queue.count > 0) {
+        printf("%d queued commands from a previous run, sent once a central connects\n",
+               queue.count);
+    }
+}
+
+/**
+ * Print the sessions of all connected central devices
+ * The session commands are sent on is marked with '*'
+ */
+static void console_list_sessions(bb_server* srv, bb_session* active) {
+    int count = 0;
+
+    for (int i = 0; i < BB_MAX_SESSIONS; i++) {
+        bb_session* s = &srv->sessions.slots[i];
+        if (s->status == BB_SESSION_FREE) continue;
+
+        printf(" %c %d: %s %s (rx %u, tx %u, %d outstanding", s == active ? '*' : ' ', i,
+               s->peer, s->status == BB_SESSION_ESTABLISHED ? "established" : "handshaking",
+               s->rx_frames, s->tx_frames, s->inflight);
+        if (s->tx_bundles > 0) {
+            printf(", %u bundles of %.1f msgs", s->tx_bundles,
+                   (double)s->tx_bundled / s->tx_bundles);
+        }
+        if (s->latency_ms > 0) {
+            printf(", %u ms per response", s->latency_ms);
+        }
+        if (s->tx_ratchets + s->rx_ratchets > 0) {
+            printf(", key steps tx %u rx %u", s->tx_ratchets, s->rx_ratchets);
+        }
+        printf(")\n");
+        count++;
+    }
+    if (count == 0) {
+        printf("No central connected\n");
+    }
+}
+
+static void console_print_result(const struct tropic_response* resp) {
+    printf("%s", resp->status);
+    if (resp->data_len > 0) {
+        printf(" - Data (%d bytes): ", resp->data_len);
+        print_hex(resp->data, resp->data_len);
+    } else {
+        printf("\n");
+    }
+}
+
+/**
+ * Print an event a central pushed for a topic we subscribed to
+ */
+static void console_on_event(bb_session* s, uint32_t topic, const uint8_t* data, size_t len) {
+    struct tropic_response event;
+
+    if (tropic_decode_response(data, len, &event) < 0) return;
+    printf("\nEvent from %s (topic %u): ", s->peer, topic);
+    console_print_result(&event);
+    printf("TROPIC01> ");
+    fflush(stdout);
+}
+
+/**
+ * Print the response to a console command when it arrives
+ * Commands are pipelined, so responses may show up after later prompts
+ */
+static void console_on_response(bb_session* s, uint32_t id, void* arg,
+                                const uint8_t* data, ssize_t len) {
+    struct tropic_response resp;
+
+    if (len < 0) {
+        printf("\nCommand #%u to %s failed: connection lost or no response in time\n", id,
+               s->peer);
+    } else if (tropic_decode_response(data, len, &resp) < 0) {
+        printf("\nInvalid response\n");
+    } else {
+        // Display command result to user
+        printf("\nResponse #%u: ", id);
+        console_print_result(&resp);
+    }
+    printf("TROPIC01> ");
+    fflush(stdout);
+}
+
+/**
+ * Print the responses of a batch, one line per command
+ * arg is the number of commands in the batch
+ */
+static void console_on_batch_response(bb_session* s, uint32_t id, void* arg,
+                                      const uint8_t* data, ssize_t len) {
+    int count = (int)(intptr_t)arg;
+    struct tropic_response resp;
+    const uint8_t* item;
+    size_t item_len, pos = 0;
+    int i = 0;
+
+    if (len < 0) {
+        printf("\nBatch #%u to %s failed: connection lost or no response in time\n", id,
+               s->peer);
+    } else {
+        printf("\nResponse #%u (batch of %d):\n", id, count);
+        while (i < count && tropic_batch_next(data, len, &pos, &item, &item_len) > 0) {
+            printf("  %d: ", ++i);
+            if (tropic_decode_response(item, item_len, &resp) < 0) {
+                printf("Invalid response\n");
+            } else {
+                console_print_result(&resp);
+            }
+        }
+        while (i < count) {
+            printf("  %d: No response\n", ++i);
+        }
+    }
+    printf("TROPIC01> ");
+    fflush(stdout);
+}
+
+/**
+ * Print the results of a batch of queued commands and drop them from the
+ * queue; if the batch was lost with its session the commands wait for the
+ * next central
+ */
+static void console_on_queue_response(bb_session* s, uint32_t id, void* arg,
+                                      const uint8_t* data, ssize_t len) {
+    struct tropic_response resp;
+    const uint8_t* item;
+    size_t item_len, pos = 0;
+    int kept = 0, retry = 0;
+
+    printf("\n");
+    for (int i = 0; i < queue.count; i++) {
+        console_queued* q = &queue.items[i];
+        if (q->s != s || q->id != id) {
+            queue.items[kept++] = *q;
+            continue;
+        }
+
+        if (len < 0) {
+            q->s = NULL;
+            queue.items[kept++] = *q;
+            retry++;
+            continue;
+        }
+        // Answered, or run and not answered: sending it again could run it twice
+        printf("Queued #%u (%s): ", q->no, q->command);
+        if (tropic_batch_next(data, len, &pos, &item, &item_len) <= 0) {
+            printf("No response\n");
+        } else if (tropic_decode_response(item, item_len, &resp) < 0) {
+            printf("Invalid response\n");
+        } else {
+            console_print_result(&resp);
+        }
+    }
+    queue.count = kept;
+    console_queue_save();
+
+    if (retry > 0) {
+        printf("%d queued commands to %s failed, they wait for the next central\n", retry,
+               s->peer);
+    }
+    printf("TROPIC01> ");
+    fflush(stdout);
+}
+
+/**
+ * Send waiting queued commands to the centrals, as many batches as their
+ * bulk windows and credits take
+ */
+static void console_queue_flush(bb_server* srv) {
+    static bb_buf tx;
+    struct tropic_message msg;
+    int next = 0;
+
+    while (1) {
+        while (next < queue.count && queue.items[next].s) next++;
+        if (next == queue.count) return;
+
+        bb_session* s = bb_server_ready_session(srv, BB_CHANNEL_BULK);
+        if (!s) return;
+
+        // Consecutive waiting commands, in the order they were typed
+        size_t len = tropic_batch_begin(BB_BUF_PAYLOAD(&tx), BB_MAX_MESSAGE);
+        int first = next, count = 0;
+        while (next < queue.count && !queue.items[next].s && count < TROPIC_BATCH_MAX) {
+            parse_command(queue.items[next].command, &msg);
+            msg.key = queue.items[next].key;
+            size_t n = tropic_batch_add_message(BB_BUF_PAYLOAD(&tx), len, BB_MAX_MESSAGE, &msg);
+            if (n == 0) break;
+            len = n;
+            next++;
+            count++;
+        }
+        if (count == 0) return;
+
+        uint32_t id = bb_server_request_buf(srv, s, BB_CHANNEL_BULK, &tx, len,
+                                            console_on_queue_response, NULL);
+        if (id == 0) return;
+        for (int i = first; i < next; i++) {
+            queue.items[i].s = s;
+            queue.items[i].id = id;
+        }
+        printf("\nSent %d queued commands to %s as batch #%u\nTROPIC01> ", count, s->peer, id);
+        fflush(stdout);
+    }
+}
+
+/**
+ * Encode "cmd; cmd; ..." as one batch request
+ *
+ * @param count - Set to the number of commands
+ * @return Encoded length, 0 if the list is empty, too long or has more
+ *         than TROPIC_BATCH_MAX commands
+ */
+static size_t console_encode_batch(const char* list, uint8_t* out, size_t cap, int* count) {
+    struct tropic_message msg;
+    char item[sizeof(msg.command)];
+    size_t pos = tropic_batch_begin(out, cap);
+
+    *count = 0;
+    while (*list) {
+        size_t n = strcspn(list, ";");
+        const char* next = list[n] == ';' ? list + n + 1 : list + n;
+
+        // Trim the spaces around each command
+        while (n > 0 && *list == ' ') {
+            list++;
+            n--;
+        }
+        while (n > 0 && (list[n - 1] == ' ' || list[n - 1] == '\n')) n--;
+
+        if (n > 0) {
+            if (n >= sizeof(item) || *count == TROPIC_BATCH_MAX) return 0;
+            memcpy(item, list, n);
+            item[n] = '\0';
+            parse_command(item, &msg);
+            pos = tropic_batch_add_message(out, pos, cap, &msg);
+            if (pos == 0) return 0;
+            (*count)++;
+        }
+        list = next;
+    }
+    return *count > 0 ? pos : 0;
+}
+
+// Progress of a "bench" run, updated by its response callbacks
+typedef struct {
+    int done;
+    int failed;
+} console_bench;
+
+static void console_on_bench_response(bb_session* s, uint32_t id, void* arg,
+                                      const uint8_t* data, ssize_t len) {
+    console_bench* bench = (console_bench*)arg;
+    struct tropic_response resp;
+
+    if (len < 0 || tropic_decode_response(data, len, &resp) < 0) bench->failed++;
+    bench->done++;
+}
+
+/**
+ * Channel a command travels on: quick random and subscription requests are
+ * interactive, key, signing and memory operations keep the secure element
+ * busy and go on the bulk channel behind them
+ */
+static uint8_t console_channel(const char* command) {
+    if (strncmp(command, "random ", 7) == 0 || strncmp(command, "corev_random ", 13) == 0 ||
+        strncmp(command, "subscribe ", 10) == 0 || strncmp(command, "unsubscribe ", 12) == 0) {
+        return BB_CHANNEL_INTERACTIVE;
+    }
+    return BB_CHANNEL_BULK;
+}
+
+/**
+ * Check an encoded request against the commands the central announced
+ * A central that announced none is asked anyway and reports unknown
+ * commands itself
+ *
+ * @return 1 if the central handles the request, 0 if not
+ */
+static int console_peer_supports(const bb_session* s, const uint8_t* req, size_t len) {
+    struct tropic_caps caps;
+
+    if (tropic_decode_caps(s->peer_caps.app, s->peer_caps.app_len, &caps) < 0) return 1;
+    return tropic_caps_supports(&caps, req, len);
+}
+
+/**
+ * Send the same command count times, keeping the request window of every
+ * connected central full, and report the time until all responses arrived
+ */
+static void console_bench_run(bb_server* srv, int count, const struct tropic_message* msg) {
+    static console_bench bench;
+    static bb_buf tx;
+    uint8_t channel = console_channel(msg->command);
+    int sent = 0;
+
+    if (tropic_encode_message(msg, BB_BUF_PAYLOAD(&tx), BB_MAX_MESSAGE) == 0) {
+        printf("Command too long\n");
+        return;
+    }
+
+    memset(&bench, 0, sizeof(bench));
+    uint64_t start = bb_now_ms();
+
+    while (1) {
+        bb_session* s;
+        while (sent < count && (s = bb_server_ready_session(srv, channel)) != NULL) {
+            // Encryption happens in place, every request is encoded afresh
+            size_t len = tropic_encode_message(msg, BB_BUF_PAYLOAD(&tx), BB_MAX_MESSAGE);
+            if (!bb_server_request_buf(srv, s, channel, &tx, len, console_on_bench_response,
+                                       &bench)) {
+                break;
+            }
+            sent++;
+        }
+        // Done when everything was answered, or nothing is left to send on
+        if (bench.done == sent && (sent == count || !bb_server_any_session(srv))) break;
+        if (bb_server_poll(srv, BB_SERVER_TICK_MS) < 0) break;
+    }
+
+    uint64_t elapsed = bb_now_ms() - start;
+    printf("%d/%d requests answered in %llu ms (%d failed)",
+           bench.done - bench.failed, count, (unsigned long long)elapsed, bench.failed);
+    if (bench.done > 0) {
+        printf(", %.2f ms per request\n", (double)elapsed / bench.done);
+    } else {
+        printf("\n");
+    }
+}
+
+/**
+ * Handle one line entered on the console
+ * Console commands are handled locally, everything else is encrypted and
+ * sent to the selected central device, which executes it on TROPIC01
+ * Up to BB_WINDOW commands may be outstanding per central, their responses
+ * are printed as they arrive
+ *
+ * @param srv - Session server holding all connected centrals
+ * @param active - Selected session, updated by "use" and on disconnect
+ * @param input - Line entered by the user
+ * @return 1 if the console should exit, 0 otherwise
+ */
+static int console_handle_line(bb_server* srv, bb_session** active, const char* input) {
+    struct tropic_message msg;
+    static bb_buf tx;
+
+    // Handle exit command
+    if (strncmp(input, "exit", 4) == 0) {
+        printf("Exiting...\n");
+        return 1;
+    }
+
+    // Local session management commands
+    if (strncmp(input, "sessions", 8) == 0) {
+        console_list_sessions(srv, *active);
+        return 0;
+    }
+    if (strncmp(input, "queue", 5) == 0) {
+        for (int i = 0; i < queue.count; i++) {
+            printf("  #%u %s%s\n", queue.items[i].no, queue.items[i].command,
+                   queue.items[i].s ? " (sent)" : "");
+        }
+        printf("%d commands queued\n", queue.count);
+        return 0;
+    }
+    if (strncmp(input, "use ", 4) == 0) {
+        int idx = atoi(input + 4);
+        if (idx < 0 || idx >= BB_MAX_SESSIONS ||
+            srv->sessions.slots[idx].status != BB_SESSION_ESTABLISHED) {
+            printf("No established session %d\n", idx);
+        } else {
+            *active = &srv->sessions.slots[idx];
+            printf("Using session %d (%s)\n", idx, (*active)->peer);
+        }
+        return 0;
+    }
+    if (strncmp(input, "bench ", 6) == 0) {
+        char* rest;
+        int count = (int)strtol(input + 6, &rest, 10);
+        while (*rest == ' ') rest++;
+        if (count <= 0 || *rest == '\0') {
+            printf("Usage: bench <count> <command>\n");
+            return 0;
+        }
+        parse_command(rest, &msg);
+        console_bench_run(srv, count, &msg);
+        return 0;
+    }
+
+    bb_response_cb on_response = console_on_response;
+    uint8_t channel = BB_CHANNEL_BULK;
+    int batch_count = 0;
+    size_t wire_len;
+
+    if (strncmp(input, "batch ", 6) == 0) {
+        // Several commands in one frame, answered by one frame
+        wire_len = console_encode_batch(input + 6, BB_BUF_PAYLOAD(&tx), BB_MAX_MESSAGE,
+                                        &batch_count);
+        if (wire_len == 0) {
+            printf("Usage: batch <command>; <command>; ... (up to %d commands)\n",
+                   TROPIC_BATCH_MAX);
+            return 0;
+        }
+        on_response = console_on_batch_response;
+        snprintf(msg.command, sizeof(msg.command), "batch of %d commands", batch_count);
+    } else {
+        // Parse user input into command structure
+        parse_command(input, &msg);
+
+        // Skip empty commands
+        if (strlen(msg.command) == 0) {
+            return 0;
+        }
+
+        // Encode only the used bytes of the command, straight into the buffer
+        // it is encrypted and sent from
+        wire_len = tropic_encode_message(&msg, BB_BUF_PAYLOAD(&tx), BB_MAX_MESSAGE);
+        if (wire_len == 0) {
+            printf("Command too long\n");
+            return 0;
+        }
+        channel = console_channel(msg.command);
+    }
+
+    // Keep the selected session while it is up, otherwise use any other one
+    if (!*active || (*active)->status != BB_SESSION_ESTABLISHED) {
+        *active = bb_server_any_session(srv);
+    }
+    if (!*active) {
+        // Bulk work keeps until a central is back, random bytes are wanted now
+        uint32_t no = 0;
+        if (channel == BB_CHANNEL_BULK && batch_count == 0 &&
+            (no = console_queue_add(msg.command, 0)) != 0) {
+            console_queue_save();
+            printf("No central connected, queued as #%u (%d waiting)\n", no, queue.count);
+        } else {
+            printf("No central connected, command not sent\n");
+        }
+        return 0;
+    }
+    if (!bb_session_window_open(*active, channel)) {
+        printf("%d commands outstanding on %s (%d bulk credits left), wait for responses\n",
+               (*active)->inflight, (*active)->peer, (*active)->bulk_credits);
+        return 0;
+    }
+    if (!console_peer_supports(*active, BB_BUF_PAYLOAD(&tx), wire_len)) {
+        printf("%s does not support this command, not sent\n", (*active)->peer);
+        return 0;
+    }
+
+    // Encrypt and send command with the session key, tagged with a request id
+    uint32_t id = bb_server_request_buf(srv, *active, channel, &tx, wire_len, on_response,
+                                        (void*)(intptr_t)batch_count);
+    if (id == 0) {
+        perror("Failed to send command");
+        *active = NULL;
+        return 0;
+    }
+    printf("Sent command #%u to %s: %s\n", id, (*active)->peer, msg.command);
+    return 0;
+}
+
 /**
  * Console interface for user interaction with TROPIC01 hardware
- * Provides a command-line interface to send encrypted commands to the central device
+ * Provides a command-line interface to send encrypted commands to the central devices
  * The central device will execute these commands on the actual TROPIC01 hardware
+ * While waiting for input, new centrals are accepted and handshaked in the background
  *
- * @param socket - Connected L2CAP socket to central device
- * @param state - Secure session state containing encryption keys and counters
+ * @param srv - Session server listening for central devices
  */
-void console_interface(int socket, bbstate* state) {
+void console_interface(bb_server* srv) {
     char input[256];
-    struct tropic_message msg;
-    struct tropic_response resp;
-    uint8_t encrypted_msg[2048];
-    uint8_t decrypted_resp[2048];
+    size_t input_len = 0;
+    bb_session* active = NULL;
+    struct pollfd fds[2] = {
+        {.fd = STDIN_FILENO, .events = POLLIN},
+        {.fd = srv->epfd, .events = POLLIN},
+    };
 
     // Display available TROPIC01 hardware commands
     printf("\nTROPIC01 Console Interface\n");
@@ -118,67 +666,58 @@ void console_interface(int socket, bbstate* state) {
     printf("  mem-store <slot> <data> - Store data\n");
     printf("  mem-read <slot>        - Read data\n");
     printf("  mem-erase <slot>       - Erase slot\n");
+    printf("  subscribe <topic>      - Get events pushed by the central (0: slot changes)\n");
+    printf("  unsubscribe <topic>    - Stop them\n");
+    printf("  sessions               - List connected centrals\n");
+    printf("  use <n>                - Send commands to session n\n");
+    printf("  bench <n> <command>    - Pipeline a command n times, report timing\n");
+    printf("  batch <cmd>; <cmd>; .. - Send several commands in one frame\n");
+    printf("  queue                  - List commands waiting for a central\n");
     printf("  exit                   - Exit\n");
+    console_queue_load();
     printf("\nTROPIC01> ");
     fflush(stdout);
 
-    // Main command processing loop
-    while (fgets(input, sizeof(input), stdin)) {
-        // Handle exit command
-        if (strncmp(input, "exit", 4) == 0) {
-            printf("Exiting...\n");
-            break;
-        }
-
-        // Parse user input into command structure
-        parse_command(input, &msg);
-
-        // Skip empty commands
-        if (strlen(msg.command) == 0) {
-            printf("TROPIC01> ");
-            fflush(stdout);
-            continue;
-        }
-
-        printf("Sending command: %s\n", msg.command);
-
-        // Encrypt command using AEAD with session key and counter
-        // Counter is incremented to prevent replay attacks
-        size_t enc_len = aead_encrypt(encrypted_msg, state->key, state->counter++,
-                                     NULL, 0, (uint8_t*)&msg, sizeof(msg));
-        if (send(socket, encrypted_msg, enc_len, 0) <= 0) {
-            perror("Failed to send command");
+    // Main event loop: console input and session events
+    while (1) {
+        // Wake up every tick even when idle, the link timers must run
+        int ready = poll(fds, 2, BB_SERVER_TICK_MS);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
             break;
         }
 
-        // Receive encrypted response from central device
-        ssize_t recv_len = recv(socket, encrypted_msg, sizeof(encrypted_msg), 0);
-        if (recv_len <= 0) {
-            perror("Failed to receive response");
-            break;
+        // Accept new centrals, complete handshakes, notice disconnects,
+        // send heartbeats and drop silent centrals
+        if (ready == 0 || (fds[1].revents & POLLIN)) {
+            bb_server_poll(srv, 0);
         }
-
-        // Decrypt response using session key and incremented counter
-        size_t dec_len = aead_decrypt(decrypted_resp, state->key, state->counter++,
-                                     NULL, 0, encrypted_msg, recv_len);
-
-        if (dec_len < sizeof(resp)) {
-            printf("Invalid response size\n");
-            printf("TROPIC01> ");
-            fflush(stdout);
-            continue;
+        console_queue_flush(srv);
+
+        if (!(fds[0].revents & (POLLIN | POLLHUP))) continue;
+
+        ssize_t n = read(STDIN_FILENO, input + input_len, sizeof(input) - 1 - input_len);
+        if (n <= 0) break;
+        input_len += n;
+        input[input_len] = '\0';
+
+        // Handle every complete line, keep a partial one for the next read
+        char* line = input;
+        char* newline;
+        int done = 0;
+        while (!done && (newline = strchr(line, '\n')) != NULL) {
+            *newline = '\0';
+            done = console_handle_line(srv, &active, line);
+            line = newline + 1;
         }
+        if (done) break;
 
-        // Extract response structure from decrypted data
-        memcpy(&resp, decrypted_resp, sizeof(resp));
-
-        // Display command result to user
-        printf("Response: %s", resp.status);
-        if (resp.data_len > 0) {
-            printf(" - Data (%d bytes): ", resp.data_len);
-            print_hex(resp.data, resp.data_len);
-        } else {
-            printf("\n");
+        input_len = strlen(line);
+        memmove(input, line, input_len + 1);
+        if (input_len == sizeof(input) - 1) {
+            // Over-long line without newline, drop it
+            input_len = 0;
         }
 
         printf("TROPIC01> ");
@@ -192,125 +731,39 @@ void console_interface(int socket, bbstate* state) {
  * 1. Sets up L2CAP server on hci0 Bluetooth adapter
  * 2. Performs secure handshake with central device
  * 3. Provides console interface for sending commands to TROPIC01 hardware
+ *
+ * Usage: peripheral [listen-address]
+ * The address is a transport spec (see bb_transport.h), default "l2cap:hci0".
  */
 int
 main(int argc, char** argv)
 {
-    struct sockaddr_l2 loc_addr = {0}, rem_addr = {0};
-    uint8_t buffer[128] = {0};
-    int server_socket, client_socket, bytes_read;
-    unsigned int opt = sizeof(rem_addr);
-
-    bdaddr_t local_bdaddr = {0}; // Local Bluetooth address storage
-    int dev_id = 0;              // Use hci0 device (first Bluetooth adapter)
-
-    printf("Start Bluetooth L2CAP server...\n");
-
-    // Get the local Bluetooth address of hci0 adapter
-    int hci_sock = hci_open_dev(dev_id);
-    if (hci_sock < 0) {
-        perror("failed to open HCI device hci0");
-        exit(1);
-    }
-
-    if (hci_read_bd_addr(hci_sock, &local_bdaddr, 0) < 0) {
-        perror("failed to read local Bluetooth address for hci0 device");
-        close(hci_sock);
-        exit(1);
-    }
-
-    char local_addr_str[18];
-    ba2str(&local_bdaddr, local_addr_str);
-    printf("Using local HCI device: hci%d (%s)\n", dev_id, local_addr_str);
+    const char* listen_spec = "l2cap:hci0"; // First Bluetooth adapter by default
+    bb_keys keys = {public_key, private_key, remote_public_key};
 
-    // Enable device discoverability by setting scan mode
-    // This allows the central device to find and connect to this peripheral
-    uint8_t param = (SCAN_PAGE | SCAN_INQUIRY); // Enable both page and inquiry scan
-
-    // Send HCI command to enable scanning
-    if (hci_send_cmd(hci_sock, OGF_HOST_CTL, OCF_WRITE_SCAN_ENABLE, 1, &param) < 0) {
-        perror("Failed to send HCI_Write_Scan_Enable command");
-        return -1;
+    if (argc > 1) {
+        listen_spec = argv[1];
     }
-    close(hci_sock);
 
-    // Create L2CAP socket for server
-    server_socket = socket(AF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
-    if (server_socket < 0) {
-        perror("failed to create socket");
-        exit(1);
-    }
-
-    // Bind socket to local Bluetooth adapter (hci0) and specified port
-    loc_addr.l2_family = AF_BLUETOOTH;
-    bacpy(&loc_addr.l2_bdaddr, &local_bdaddr); // Use hci0 address
-    loc_addr.l2_psm = htobs(L2CAP_SERVER_PORT_NUM); // Set port number
+    printf("Start Bluetooth L2CAP server...\n");
 
-    printf("binding\n");
-    if (bind(server_socket, (struct sockaddr*)&loc_addr, sizeof(loc_addr)) < 0) {
-        perror("failed to bind");
-        close(server_socket);
+    // Session server on the selected transport (hci0 and the L2CAP PSM by default)
+    // Every central gets its own session with isolated keys and counters
+    if (bb_server_init(&server, &keys, NULL) < 0) {
         exit(1);
     }
+    bb_server_set_ticket_file(&server, TICKET_FILE);
+    bb_server_set_notify_handler(&server, console_on_event);
 
     printf("listening\n");
-    // Put socket into listening mode - wait for incoming connections
-    listen(server_socket, 2);
-
-    // Accept connection from central device
-    client_socket = accept(server_socket, (struct sockaddr*)&rem_addr, &opt);
-    if (client_socket < 0) {
-        perror("accept");
-        close(server_socket);
-        return client_socket;
-    }
-
-    // Display connected client information
-    char buf[18];
-    ba2str(&rem_addr.l2_bdaddr, buf);
-    printf("connected from %s\n", buf);
-
-    // Initialize secure session state as peripheral device
-    // This prepares the cryptographic state for the handshake
-    bbstate_init(&state, BB_ROLE_PERIPHERAL, public_key, private_key,
-                 remote_public_key, NULL);
-
-    // Receive handshake initiation from central device
-    bytes_read = recv(client_socket, buffer, sizeof(struct bb_session_start_req), 0);
-    if (bytes_read <= 0) {
-        perror("Error handshake initiation\n");
-        close(client_socket);
-        close(server_socket);
+    if (bb_server_listen(&server, listen_spec) < 0) {
         exit(1);
     }
 
-    // Process the received handshake request
-    // This validates the central device and computes shared session key
-    bb_session_start_rx(&state, buffer);
-
-    // Prepare handshake response
-    bb_session_start_rsp(&state, buffer);
-
-    // Send handshake response to complete key exchange
-    int rc = send(client_socket, buffer, sizeof(struct bb_session_start_req), 0);
-    if (rc <= 0) {
-        perror("Error sending");
-        close(client_socket);
-        close(server_socket);
-        exit(1);
-    }
-
-    // Handshake complete - display derived session key
-    printf("Handshake complete, key:\n");
-    print_buf(state.key, 32);
-
     // Start interactive console for sending commands to TROPIC01 hardware
-    // User can now enter commands that will be securely transmitted to
-    // the central device for execution on the actual hardware
-    console_interface(client_socket, &state);
+    // Centrals may connect, disconnect and reconnect at any time; each
+    // completed handshake adds a session commands can be sent on
+    console_interface(&server);
 
-    // Cleanup connections
-    close(client_socket);
-    close(server_socket);
     return 0;
 }
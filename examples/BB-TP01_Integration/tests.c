@@ -1,9 +1,23 @@
 #include <assert.h>
+#include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "bbstate.h"
+#include "tropic_simple.h"
+#ifdef BB_LINK_TESTS
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "bb_server.h"
+#include "bb_session.h"
+#include "bb_ticket.h"
+#include "bb_transport.h"
+#endif
 
 static bbstate central, peripheral;
 
@@ -23,6 +37,1252 @@ print_buf(void* buf, size_t buf_len)
     printf("\n");
 }
 
+/* Wire format: commands round-trip and only use the bytes they need */
+static void
+test_wire_command(const char* command, size_t expect_len)
+{
+    struct tropic_message msg = {0}, out;
+    uint8_t wire[TROPIC_WIRE_MAX];
+
+    strcpy(msg.command, command);
+    size_t len = tropic_encode_message(&msg, wire, sizeof(wire));
+    assert(len > 0);
+    if (expect_len) assert(len == expect_len);
+    int rc = tropic_decode_message(wire, len, &out);
+    assert(rc == 0);
+    assert(strcmp(out.command, command) == 0);
+    assert(out.data_len == 0);
+
+    // Truncated messages are rejected, never read past the end
+    if (len > 2) {
+        rc = tropic_decode_message(wire, len - 1, &out);
+        assert(rc < 0);
+    }
+}
+
+static void
+test_wire(void)
+{
+    struct tropic_response resp = {0}, out;
+    uint8_t wire[TROPIC_WIRE_MAX];
+
+    test_wire_command("random 2", 6);
+    test_wire_command("corev_random 16", 6);
+    test_wire_command("subscribe 0", 6);
+    test_wire_command("ecc-sign 3 hello world", 2 + 4 + 3 + 11);
+    test_wire_command("mem-store 0  two spaces", 0);
+    test_wire_command("random 300", 2 + 3 + 10);
+    test_wire_command("random", 0);
+    test_wire_command("unknown command", 0);
+
+    strcpy(resp.status, "OK");
+    resp.data[0] = 0xab;
+    resp.data[1] = 0xcd;
+    resp.data_len = 2;
+    size_t len = tropic_encode_response(&resp, wire, sizeof(wire));
+    assert(len == 1 + 5 + 5);
+    int rc = tropic_decode_response(wire, len, &out);
+    assert(rc == 0);
+    assert(strcmp(out.status, "OK") == 0 && out.data_len == 2);
+    assert(memcmp(out.data, resp.data, 2) == 0);
+    rc = tropic_decode_response(wire, len - 1, &out);
+    assert(rc < 0);
+
+    wire[0] = TROPIC_WIRE_VERSION + 1;
+    rc = tropic_decode_response(wire, len, &out);
+    assert(rc < 0);
+}
+
+/* Wire format: a batch carries its commands and responses in order */
+static void
+test_wire_batch(void)
+{
+    static const char* commands[] = {"random 4", "ecc-download 1", "hello"};
+    struct tropic_message msg = {0}, out;
+    struct tropic_response resp = {0}, resp_out;
+    uint8_t wire[TROPIC_WIRE_MAX];
+    const uint8_t* item;
+    size_t item_len, pos = 0;
+    int rc;
+
+    size_t len = tropic_batch_begin(wire, sizeof(wire));
+    for (int i = 0; i < 3; i++) {
+        strcpy(msg.command, commands[i]);
+        len = tropic_batch_add_message(wire, len, sizeof(wire), &msg);
+        assert(len > 0);
+    }
+    assert(tropic_is_batch(wire, len));
+    for (int i = 0; i < 3; i++) {
+        rc = tropic_batch_next(wire, len, &pos, &item, &item_len);
+        assert(rc == 1);
+        rc = tropic_decode_message(item, item_len, &out);
+        assert(rc == 0 && strcmp(out.command, commands[i]) == 0);
+    }
+    rc = tropic_batch_next(wire, len, &pos, &item, &item_len);
+    assert(rc == 0);
+
+    // A batch is never mistaken for a single command, nor nested
+    rc = tropic_decode_message(wire, len, &out);
+    assert(rc < 0);
+    pos = 0;
+    for (int i = 0; i < 2; i++) {
+        rc = tropic_batch_next(wire, len - 1, &pos, &item, &item_len);
+        assert(rc == 1);
+    }
+    rc = tropic_batch_next(wire, len - 1, &pos, &item, &item_len);
+    assert(rc < 0);
+
+    // Responses, until the buffer is full
+    len = tropic_batch_begin(wire, 64);
+    strcpy(resp.status, "OK");
+    resp.data_len = 20;
+    len = tropic_batch_add_response(wire, len, 64, &resp);
+    assert(len == 2 + 3 + 1 + 5 + 23);
+    size_t full = tropic_batch_add_response(wire, len, 64, &resp);
+    assert(full == 0);
+    pos = 0;
+    rc = tropic_batch_next(wire, len, &pos, &item, &item_len);
+    assert(rc == 1);
+    rc = tropic_decode_response(item, item_len, &resp_out);
+    assert(rc == 0 && strcmp(resp_out.status, "OK") == 0 && resp_out.data_len == 20);
+    rc = tropic_batch_next(wire, len, &pos, &item, &item_len);
+    assert(rc == 0);
+
+    assert(!tropic_is_batch(wire, 1));
+}
+
+/* Wire format: commands are checked against what a central announced */
+static void
+test_wire_caps(void)
+{
+    struct tropic_message msg = {0};
+    struct tropic_caps caps;
+    uint8_t wire[TROPIC_WIRE_MAX], buf[TROPIC_CAPS_LEN + TROPIC_NODE_NAME_LEN];
+    size_t n;
+    int rc;
+
+    n = tropic_encode_caps(TROPIC_OPS_TROPIC01, NULL, buf, sizeof(buf));
+    assert(n == TROPIC_CAPS_LEN);
+    rc = tropic_decode_caps(buf, TROPIC_CAPS_LEN, &caps);
+    assert(rc == 0);
+    assert(caps.version == TROPIC_WIRE_VERSION && caps.opcodes == TROPIC_OPS_TROPIC01);
+    assert(caps.batch_max == TROPIC_BATCH_MAX && caps.node[0] == '\0');
+    rc = tropic_decode_caps(buf, TROPIC_CAPS_LEN - 1, &caps);
+    assert(rc < 0);
+    n = tropic_encode_caps(TROPIC_OPS_TROPIC01, NULL, buf, TROPIC_CAPS_LEN - 1);
+    assert(n == 0);
+
+    // The node name fills the rest
+    n = tropic_encode_caps(TROPIC_OPS_TROPIC01, "se-2", buf, sizeof(buf));
+    assert(n == TROPIC_CAPS_LEN + 4);
+    rc = tropic_decode_caps(buf, TROPIC_CAPS_LEN + 4, &caps);
+    assert(rc == 0);
+    assert(strcmp(caps.node, "se-2") == 0 && caps.opcodes == TROPIC_OPS_TROPIC01);
+    n = tropic_encode_caps(TROPIC_OPS_TROPIC01, "se-2", buf, TROPIC_CAPS_LEN + 3);
+    assert(n == 0);
+    n = tropic_encode_caps(TROPIC_OPS_TROPIC01, "a-node-name-much-too-long", buf, sizeof(buf));
+    assert(n == 0);
+
+    strcpy(msg.command, "random 2");
+    size_t len = tropic_encode_message(&msg, wire, sizeof(wire));
+    assert(tropic_caps_supports(&caps, wire, len));
+    strcpy(msg.command, "corev_random 2");
+    len = tropic_encode_message(&msg, wire, sizeof(wire));
+    assert(!tropic_caps_supports(&caps, wire, len));
+    caps.opcodes |= TROPIC_OP_BIT(TROPIC_OP_COREV_RANDOM);
+    assert(tropic_caps_supports(&caps, wire, len));
+
+    // A batch needs the batch opcode, each of its commands and room for all
+    len = tropic_batch_begin(wire, sizeof(wire));
+    len = tropic_batch_add_message(wire, len, sizeof(wire), &msg);
+    len = tropic_batch_add_message(wire, len, sizeof(wire), &msg);
+    assert(tropic_caps_supports(&caps, wire, len));
+    caps.batch_max = 1;
+    assert(!tropic_caps_supports(&caps, wire, len));
+    caps.batch_max = TROPIC_BATCH_MAX;
+    caps.opcodes &= ~TROPIC_OP_BIT(TROPIC_OP_COREV_RANDOM);
+    assert(!tropic_caps_supports(&caps, wire, len));
+    wire[0] = TROPIC_WIRE_VERSION + 1;
+    assert(!tropic_caps_supports(&caps, wire, len));
+}
+
+/* Wire format: a retried command keeps its key and gets the first answer */
+static void
+test_wire_cache(void)
+{
+    static struct tropic_cache cache;
+    struct tropic_message msg = {0}, out;
+    struct tropic_response resp = {0};
+    uint8_t wire[TROPIC_WIRE_MAX];
+
+    strcpy(msg.command, "ecc-gen 1");
+    msg.key = 0x0102030405060708ULL;
+    size_t len = tropic_encode_message(&msg, wire, sizeof(wire));
+    assert(len == 2 + 4 + 11);
+    int rc = tropic_decode_message(wire, len, &out);
+    assert(rc == 0);
+    assert(out.key == msg.key && strcmp(out.command, "ecc-gen 1") == 0);
+
+    strcpy(resp.status, "OK");
+    assert(tropic_cache_get(&cache, "peer", &out, 0) == NULL);
+    tropic_cache_put(&cache, "peer", &out, &resp, 0);
+    assert(tropic_cache_get(&cache, "peer", &out, 1) != NULL);
+    assert(strcmp(tropic_cache_get(&cache, "peer", &out, 1)->status, "OK") == 0);
+    assert(tropic_cache_get(&cache, "other", &out, 1) == NULL);
+    assert(tropic_cache_get(&cache, "peer", &out, TROPIC_CACHE_TTL_MS) == NULL);
+    strcpy(out.command, "ecc-gen 2");
+    assert(tropic_cache_get(&cache, "peer", &out, 1) == NULL);
+
+    // Commands without a key always run, a full cache drops the oldest
+    out.key = 0;
+    tropic_cache_put(&cache, "peer", &out, &resp, 0);
+    assert(tropic_cache_get(&cache, "peer", &out, 1) == NULL);
+    for (int i = 0; i < TROPIC_CACHE_SIZE; i++) {
+        out.key = 100 + i;
+        tropic_cache_put(&cache, "peer", &out, &resp, 1 + i);
+    }
+    strcpy(out.command, "ecc-gen 1");
+    out.key = msg.key;
+    assert(tropic_cache_get(&cache, "peer", &out, 1) == NULL);
+    strcpy(out.command, "ecc-gen 2");
+    out.key = 100;
+    assert(tropic_cache_get(&cache, "peer", &out, 1) != NULL);
+}
+
+/* Wire format: logical slots are placed by consistent hashing and pinned */
+static void
+test_wire_shard(void)
+{
+    static struct tropic_routes routes;
+    const char* nodes[] = {"se-a", "se-b", "se-c", "se-d"};
+    struct tropic_message msg = {0}, out;
+    uint16_t slot;
+    int effect, moved = 0, owners[3] = {0};
+    int kind, rc;
+
+    kind = tropic_slot_command("ecc-sign 40 hello", &slot, &effect);
+    assert(kind == TROPIC_SLOT_ECC && slot == 40 && effect == TROPIC_SLOT_USE);
+    kind = tropic_slot_command("mem-store 300 x", &slot, &effect);
+    assert(kind == TROPIC_SLOT_MEM && slot == 300 && effect == TROPIC_SLOT_FILL);
+    kind = tropic_slot_command("ecc-clear 1", &slot, &effect);
+    assert(kind == TROPIC_SLOT_ECC && effect == TROPIC_SLOT_EMPTY);
+    kind = tropic_slot_command("random 4", &slot, &effect);
+    assert(kind < 0);
+    kind = tropic_slot_command("ecc-gen x", &slot, &effect);
+    assert(kind < 0);
+
+    strcpy(msg.command, "ecc-sign 40 hello 7");
+    msg.key = 5;
+    rc = tropic_slot_rewrite(&msg, 3, &out);
+    assert(rc == 0);
+    assert(strcmp(out.command, "ecc-sign 3 hello 7") == 0 && out.key == 5);
+
+    // Slots spread over all nodes; a fourth node takes about a quarter,
+    // every other slot stays where it was
+    assert(tropic_ring_owner(nodes, 0, TROPIC_SLOT_ECC, 1) < 0);
+    for (int i = 0; i < 1000; i++) {
+        int before = tropic_ring_owner(nodes, 3, TROPIC_SLOT_ECC, (uint16_t)i);
+        int after = tropic_ring_owner(nodes, 4, TROPIC_SLOT_ECC, (uint16_t)i);
+        assert(before >= 0 && before < 3);
+        owners[before]++;
+        if (after != before) {
+            assert(after == 3);
+            moved++;
+        }
+    }
+    assert(owners[0] > 150 && owners[1] > 150 && owners[2] > 150);
+    assert(moved > 100 && moved < 400);
+
+    // Each node's chip slots are handed out once, freed ones again
+    struct tropic_route* r = tropic_route_place(&routes, TROPIC_SLOT_ECC, 40, "se-a");
+    assert(r && r->physical == 0 && tropic_route_find(&routes, TROPIC_SLOT_ECC, 40) == r);
+    assert(tropic_route_find(&routes, TROPIC_SLOT_MEM, 40) == NULL);
+    struct tropic_route* p = tropic_route_place(&routes, TROPIC_SLOT_ECC, 41, "se-b");
+    assert(p && p->physical == 0);
+    p = tropic_route_place(&routes, TROPIC_SLOT_ECC, 42, "se-a");
+    assert(p && p->physical == 1);
+    tropic_route_drop(r);
+    assert(tropic_route_find(&routes, TROPIC_SLOT_ECC, 40) == NULL);
+    p = tropic_route_place(&routes, TROPIC_SLOT_ECC, 43, "se-a");
+    assert(p && p->physical == 0);
+    for (int i = 2; i < TROPIC_ECC_SLOTS; i++) {
+        p = tropic_route_place(&routes, TROPIC_SLOT_ECC, (uint16_t)(100 + i), "se-a");
+        assert(p);
+    }
+    p = tropic_route_place(&routes, TROPIC_SLOT_ECC, 99, "se-a");
+    assert(p == NULL);
+    p = tropic_route_place(&routes, TROPIC_SLOT_MEM, 99, "se-a");
+    assert(p && p->physical == 0);
+
+    // A slot in doubt keeps its chip slot, and is probed there without
+    // changing it
+    r = tropic_route_find(&routes, TROPIC_SLOT_MEM, 99);
+    r->unknown = 1;
+    p = tropic_route_place(&routes, TROPIC_SLOT_MEM, 98, "se-a");
+    assert(p && p->physical == 1);
+    tropic_slot_probe(r, &out);
+    assert(strcmp(out.command, "mem-read 0") == 0 && out.key == 0);
+    kind = tropic_slot_command(out.command, &slot, &effect);
+    assert(kind == TROPIC_SLOT_MEM && slot == 0 && effect == TROPIC_SLOT_USE);
+    tropic_slot_probe(tropic_route_find(&routes, TROPIC_SLOT_ECC, 43), &out);
+    assert(strcmp(out.command, "ecc-download 0") == 0);
+    tropic_route_drop(r);
+    p = tropic_route_place(&routes, TROPIC_SLOT_MEM, 97, "se-a");
+    assert(p && p->physical == 0);
+}
+
+#ifdef BB_LINK_TESTS
+/* BB-link: transports are picked by the scheme of an address */
+static void
+test_transport_lookup(void)
+{
+    const bb_transport* t;
+    const char* addr;
+
+    t = bb_transport_lookup("unix:/tmp/x", &addr);
+    assert(t == &bb_transport_unix && strcmp(addr, "/tmp/x") == 0);
+    t = bb_transport_lookup("tcp:127.0.0.1:7000", &addr);
+    assert(t == &bb_transport_tcp);
+    t = bb_transport_lookup("AA:BB:CC:DD:EE:FF", &addr);
+    assert(t == &bb_transport_l2cap);
+    t = bb_transport_lookup("foo:bar", &addr);
+    assert(t == NULL);
+}
+
+/* BB-link: frames keep their boundaries on every transport, and neither
+ * a full socket nor a frame arriving in pieces blocks */
+static void
+test_transport(const bb_transport* t, int type)
+{
+    static bb_io a, b;
+    int sv[2];
+    uint8_t frame[300], out[BB_MAX_FRAME];
+    ssize_t n;
+
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    int rc = socketpair(AF_UNIX, type | SOCK_NONBLOCK, 0, sv);
+    assert(rc == 0);
+    for (size_t i = 0; i < sizeof(frame); i++) {
+        frame[i] = (uint8_t)i;
+    }
+
+    // Two frames back to back must come out separately
+    n = t->send(sv[0], &a, frame, sizeof(frame));
+    assert(n == sizeof(frame));
+    n = t->send(sv[0], &a, frame, 7);
+    assert(n == 7);
+    n = t->recv(sv[1], &b, out, sizeof(out));
+    assert(n == sizeof(frame) && memcmp(out, frame, sizeof(frame)) == 0);
+    n = t->recv(sv[1], &b, out, sizeof(out));
+    assert(n == 7);
+    n = t->recv(sv[1], &b, out, sizeof(out));
+    assert(n == -1 && errno == EAGAIN);
+
+    // A frame gathered from two buffers is scattered back at any boundary
+    uint8_t hdr[5], body[BB_MAX_FRAME];
+    struct iovec tx[2] = {{frame, 5}, {frame + 5, 95}};
+    struct iovec rx[2] = {{hdr, sizeof(hdr)}, {body, sizeof(body)}};
+    n = t->sendv(sv[0], &a, tx, 2);
+    assert(n == 100);
+    n = t->recvv(sv[1], &b, rx, 2);
+    assert(n == 100);
+    assert(memcmp(hdr, frame, 5) == 0 && memcmp(body, frame + 5, 95) == 0);
+
+    if (type == SOCK_STREAM) {
+        // Half a frame is kept until the rest arrives
+        const uint8_t part[] = {0, 10, 1, 2, 3, 4};
+        n = write(sv[0], part, sizeof(part));
+        assert(n == sizeof(part));
+        n = t->recv(sv[1], &b, out, sizeof(out));
+        assert(n == -1 && errno == EAGAIN);
+        n = write(sv[0], frame, 6);
+        assert(n == 6);
+        n = t->recv(sv[1], &b, out, sizeof(out));
+        assert(n == 10);
+        assert(memcmp(out, part + 2, 4) == 0 && memcmp(out + 4, frame, 6) == 0);
+    }
+
+    // A full socket queues frames, they follow in order once it drains
+    int sent = 0, got = 0;
+    while (a.tx_len == 0) {
+        frame[0] = (uint8_t)sent++;
+        n = t->send(sv[0], &a, frame, sizeof(frame));
+        assert(n == sizeof(frame));
+    }
+    frame[0] = (uint8_t)sent++;
+    n = t->send(sv[0], &a, frame, sizeof(frame));
+    assert(n == sizeof(frame));
+    while (got < sent) {
+        n = t->recv(sv[1], &b, out, sizeof(out));
+        if (n < 0) {
+            assert(errno == EAGAIN && a.tx_len > 0);
+            rc = t->flush(sv[0], &a);
+            assert(rc >= 0);
+            continue;
+        }
+        assert(n == sizeof(frame) && out[0] == (uint8_t)got);
+        got++;
+    }
+    rc = t->flush(sv[0], &a);
+    assert(rc == 0 && a.tx_len == 0);
+
+    close(sv[0]);
+    n = t->recv(sv[1], &b, out, sizeof(out));
+    assert(n <= 0);
+    close(sv[1]);
+
+    // A frame larger than the buffer is an error, never cut short; on a
+    // fresh pair, as a stream cannot resynchronize after it
+    memset(&b, 0, sizeof(b));
+    rc = socketpair(AF_UNIX, type | SOCK_NONBLOCK, 0, sv);
+    assert(rc == 0);
+    n = t->send(sv[0], &a, frame, sizeof(frame));
+    assert(n == sizeof(frame));
+    n = t->recv(sv[1], &b, out, 100);
+    assert(n == -1 && errno == EMSGSIZE);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+/* Two sessions keyed by one handshake, over a fresh socketpair; with
+ * announce, each has taken in the capabilities of the other */
+static void
+session_pair(bb_session* a, bb_session* b, int announce)
+{
+    uint8_t buffer[128];
+    uint8_t type;
+    uint32_t id;
+    int sv[2];
+
+    memset(a, 0, sizeof(*a));
+    memset(b, 0, sizeof(*b));
+    ecdh_keygen(pub_c, priv_c);
+    ecdh_keygen(pub_p, priv_p);
+    bbstate_init(&a->state, BB_ROLE_CENTRAL, pub_c, priv_c, pub_p, NULL);
+    bbstate_init(&b->state, BB_ROLE_PERIPHERAL, pub_p, priv_p, pub_c, NULL);
+    bb_session_start_req(&a->state, buffer);
+    bb_session_start_rx(&b->state, buffer);
+    bb_session_start_rsp(&b->state, buffer);
+    bb_session_start_rx(&a->state, buffer);
+
+    int rc = socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv);
+    assert(rc == 0);
+    a->fd = sv[0];
+    b->fd = sv[1];
+    a->transport = b->transport = &bb_transport_unix;
+    a->outgoing = 1;
+    a->status = b->status = BB_SESSION_ESTABLISHED;
+    bb_session_set_keys(a);
+    bb_session_set_keys(b);
+    if (!announce) return;
+
+    int sent_a = bb_session_send_caps(a, NULL, 0);
+    int sent_b = bb_session_send_caps(b, NULL, 0);
+    ssize_t len_a = bb_session_recv(a, &type, &id, buffer, sizeof(buffer));
+    ssize_t len_b = bb_session_recv(b, &type, &id, buffer, sizeof(buffer));
+    assert(sent_a == 0 && sent_b == 0 && len_a == BB_CAPS_LEN && len_b == BB_CAPS_LEN);
+}
+
+static void
+session_pair_close(bb_session* a, bb_session* b)
+{
+    close(a->fd);
+    close(b->fd);
+}
+
+/* BB-link: each direction has its own key, and the root they came from
+ * is gone once the session is established */
+static void
+test_session_keys(void)
+{
+    static bb_session a, b;
+    static const bbstate wiped;
+    static const uint8_t zero[KEY_LEN];
+
+    session_pair(&a, &b, 0);
+    assert(memcmp(a.tx_key, b.rx_key, KEY_LEN) == 0 && memcmp(a.rx_key, b.tx_key, KEY_LEN) == 0);
+    assert(memcmp(a.tx_key, a.rx_key, KEY_LEN) != 0);
+    assert(memcmp(&a.state, &wiped, sizeof(wiped)) == 0);
+    assert(memcmp(&b.state, &wiped, sizeof(wiped)) == 0);
+
+    // Only the resumption secret is kept, until the ticket is dealt with
+    assert(memcmp(a.resume_rms, b.resume_rms, KEY_LEN) == 0);
+    assert(memcmp(a.resume_rms, zero, KEY_LEN) != 0);
+    assert(memcmp(a.resume_rms, a.tx_key, KEY_LEN) != 0);
+    assert(memcmp(a.resume_rms, a.rx_key, KEY_LEN) != 0);
+    session_pair_close(&a, &b);
+}
+
+/* BB-link: capabilities come first, features are only used towards a peer
+ * that announced them */
+static void
+test_session_caps(void)
+{
+    static bb_session a, b;
+    uint8_t buffer[BB_CAPS_APP_MAX + 1] = {0}, out[64];
+    uint8_t type;
+    uint32_t id;
+    ssize_t n;
+    int rc;
+
+    session_pair(&a, &b, 0);
+    assert(a.peer_caps.version == 0);
+    rc = bb_session_send_caps(&b, (const uint8_t*)"app", 3);
+    assert(rc == 0);
+    n = bb_session_recv(&a, &type, &id, out, sizeof(out));
+    assert(n == BB_CAPS_LEN + 3);
+    assert(type == BB_FRAME_CAPS && a.rx_channel == BB_CHANNEL_CONTROL);
+    assert(a.peer_caps.version == BB_LINK_VERSION && a.peer_caps.features == BB_CAPS_LOCAL);
+    assert(a.peer_caps.max_frame == BB_MAX_FRAME && a.peer_caps.max_message == BB_MAX_MESSAGE);
+    assert(a.peer_caps.app_len == 3 && memcmp(a.peer_caps.app, "app", 3) == 0);
+    rc = bb_session_send_caps(&a, NULL, 0);
+    assert(rc == 0);
+    n = bb_session_recv(&b, &type, &id, out, sizeof(out));
+    assert(n == BB_CAPS_LEN);
+    assert(b.peer_caps.features == BB_CAPS_LOCAL && b.peer_caps.app_len == 0);
+    rc = bb_session_send_caps(&a, buffer, BB_CAPS_APP_MAX + 1);
+    assert(rc < 0);
+
+    // Either side may push notifications, to a peer that takes them
+    n = bb_session_notify(&a, 3, "event", 5);
+    assert(n > 0);
+    n = bb_session_recv(&b, &type, &id, out, sizeof(out));
+    assert(n == 5 && type == BB_FRAME_NOTIFY && id == 3 && memcmp(out, "event", 5) == 0);
+    n = bb_session_notify(&a, BB_TOPICS, "event", 5);
+    assert(n < 0);
+    b.peer_caps.features &= ~BB_CAP_NOTIFY;
+    n = bb_session_notify(&b, 3, "event", 5);
+    assert(n < 0);
+    session_pair_close(&a, &b);
+}
+
+static int completed[4];
+
+static void
+on_response(bb_session* s, uint32_t id, void* arg, const uint8_t* resp, ssize_t len)
+{
+    // Every request carries its own id as payload
+    assert(len == sizeof(id) && memcmp(resp, &id, sizeof(id)) == 0);
+    completed[(intptr_t)arg]++;
+}
+
+/* BB-link: pipelined requests complete by id, whatever order the
+ * responses come in */
+static void
+test_session_requests(void)
+{
+    static bb_session a, b;
+    static bb_server srv;
+    uint8_t out[64];
+    uint8_t type;
+    uint32_t id, ids[3];
+    ssize_t n;
+    int rc;
+
+    session_pair(&a, &b, 1);
+    n = bb_session_send(&a, BB_FRAME_REQUEST, BB_CHANNEL_INTERACTIVE, 7, "hello", 5);
+    assert(n > 0);
+    n = bb_session_recv(&b, &type, &id, out, sizeof(out));
+    assert(n == 5 && type == BB_FRAME_REQUEST && id == 7);
+    assert(memcmp(out, "hello", 5) == 0);
+
+    for (int i = 0; i < 3; i++) {
+        uint32_t next = a.next_id + 1;
+        ids[i] = bb_session_send_request(&a, BB_CHANNEL_INTERACTIVE, &next, sizeof(next),
+                                         on_response, (void*)(intptr_t)i);
+        assert(ids[i] == next);
+    }
+    assert(a.inflight == 3);
+    for (int i = 0; i < 3; i++) {
+        n = bb_session_recv(&b, &type, &id, out, sizeof(out));
+        assert(n == sizeof(id) && type == BB_FRAME_REQUEST && id == ids[i]);
+    }
+    for (int i = 2; i >= 0; i--) {
+        n = bb_session_send(&b, BB_FRAME_RESPONSE, BB_CHANNEL_INTERACTIVE, ids[i],
+                            &ids[i], sizeof(ids[i]));
+        assert(n > 0);
+        n = bb_session_recv(&a, &type, &id, out, sizeof(out));
+        assert(n == sizeof(id) && type == BB_FRAME_RESPONSE && id == ids[i]);
+        rc = bb_session_complete(&a, id, out, sizeof(id));
+        assert(rc == 0);
+    }
+    assert(a.inflight == 0);
+    assert(completed[0] == 1 && completed[1] == 1 && completed[2] == 1);
+    rc = bb_session_complete(&a, ids[0], out, sizeof(id));
+    assert(rc < 0);
+
+    // Responses feed the smoothed latency, outstanding requests the load
+    a.latency_ms = 80;
+    ids[0] = bb_session_send_request(&a, BB_CHANNEL_INTERACTIVE, "x", 1, NULL, NULL);
+    assert(ids[0] != 0 && bb_session_load_ms(&a) == 160);
+    n = bb_session_recv(&b, &type, &id, out, sizeof(out));
+    assert(n == 1);
+    rc = bb_session_complete(&a, id, out, 0);
+    assert(rc == 0 && a.latency_ms == 70 && bb_session_load_ms(&a) == 70);
+
+    // A deferred answer carries the id of its request, unless the session
+    // closed in between
+    bb_deferred d = {&b, b.generation, BB_CHANNEL_INTERACTIVE, 9};
+    rc = bb_server_respond(&srv, &d, "late", 4);
+    assert(rc == 0);
+    n = bb_session_recv(&a, &type, &id, out, sizeof(out));
+    assert(n == 4 && type == BB_FRAME_RESPONSE && id == 9 && memcmp(out, "late", 4) == 0);
+    d.generation--;
+    rc = bb_server_respond(&srv, &d, "late", 4);
+    assert(rc < 0);
+    session_pair_close(&a, &b);
+}
+
+/* BB-link: bulk requests need credits granted by the receiver and leave
+ * room in the window for interactive ones */
+static void
+test_session_credits(void)
+{
+    static bb_session a, b;
+    uint8_t out[64];
+    uint8_t type;
+    uint32_t id, rng;
+    ssize_t n;
+    int rc;
+
+    session_pair(&a, &b, 1);
+    assert(!bb_session_window_open(&a, BB_CHANNEL_BULK));
+    rc = bb_session_grant(&b, BB_BULK_WINDOW + 1);
+    assert(rc == 0 && b.bulk_granted == BB_BULK_WINDOW + 1);
+    n = bb_session_recv(&a, &type, &id, out, sizeof(out));
+    assert(n == 2 && type == BB_FRAME_CREDIT && a.bulk_credits == BB_BULK_WINDOW + 1);
+
+    for (int i = 0; i < BB_BULK_WINDOW; i++) {
+        id = bb_session_send_request(&a, BB_CHANNEL_BULK, "bulk", 4, NULL, NULL);
+        assert(id != 0);
+        n = bb_session_recv(&b, &type, &id, out, sizeof(out));
+        assert(n == 4 && b.rx_channel == BB_CHANNEL_BULK);
+    }
+    assert(!bb_session_window_open(&a, BB_CHANNEL_BULK));
+    id = bb_session_send_request(&a, BB_CHANNEL_BULK, "bulk", 4, NULL, NULL);
+    assert(id == 0);
+    rng = bb_session_send_request(&a, BB_CHANNEL_INTERACTIVE, "rng", 3, NULL, NULL);
+    assert(rng != 0);
+    n = bb_session_recv(&b, &type, &id, out, sizeof(out));
+    assert(n == 3 && id == rng && b.rx_channel == BB_CHANNEL_INTERACTIVE);
+    rc = bb_session_complete(&a, a.next_id - 1, out, 0);
+    assert(rc == 0 && bb_session_window_open(&a, BB_CHANNEL_BULK));
+    bb_session_fail_pending(&a);
+    assert(a.inflight == 0 && a.bulk_inflight == 0);
+    id = bb_session_send_request(&a, BB_CHANNEL_BULK, "last", 4, NULL, NULL);
+    assert(id != 0);
+    n = bb_session_recv(&b, &type, &id, out, sizeof(out));
+    assert(n == 4 && a.bulk_credits == 0 && !bb_session_window_open(&a, BB_CHANNEL_BULK));
+    bb_session_fail_pending(&a);
+    session_pair_close(&a, &b);
+}
+
+/* BB-link: small messages within the budget share one frame, anything
+ * else sends them first */
+static void
+test_session_bundle(void)
+{
+    static bb_session a, b;
+    uint8_t out[64];
+    uint8_t type;
+    uint32_t id;
+    size_t pos = 0, msg_len;
+    const uint8_t* item;
+    ssize_t n;
+    int rc;
+
+    session_pair(&a, &b, 1);
+    a.coalesce_us[BB_CHANNEL_BULK] = 60 * 1000000;
+    for (uint32_t i = 1; i <= 3; i++) {
+        n = bb_session_send(&a, BB_FRAME_RESPONSE, BB_CHANNEL_BULK, i, "part", 4);
+        assert(n == 4);
+    }
+    rc = bb_session_flush(&a, 0);
+    assert(rc == 0 && a.bundle_count == 3);
+    rc = bb_session_flush(&a, 1);
+    assert(rc == 0 && a.tx_bundles == 1 && a.tx_bundled == 3);
+    ssize_t bundle_len = bb_session_recv(&b, &type, &id, out, sizeof(out));
+    assert(bundle_len == 3 * (BB_BUNDLE_ITEM_HDR + 4) && type == BB_FRAME_BUNDLE);
+    assert(b.rx_channel == BB_CHANNEL_BULK);
+    for (uint32_t i = 1; i <= 3; i++) {
+        rc = bb_bundle_next(out, bundle_len, &pos, &type, &id, &item, &msg_len);
+        assert(rc == 1 && type == BB_FRAME_RESPONSE && id == i && msg_len == 4);
+        assert(memcmp(item, "part", 4) == 0);
+    }
+    rc = bb_bundle_next(out, bundle_len, &pos, &type, &id, &item, &msg_len);
+    assert(rc == 0);
+    pos = 0;
+    rc = bb_bundle_next(out, BB_BUNDLE_ITEM_HDR + 3, &pos, &type, &id, &item, &msg_len);
+    assert(rc < 0);
+
+    n = bb_session_send(&a, BB_FRAME_RESPONSE, BB_CHANNEL_BULK, 4, "lone", 4);
+    assert(n == 4);
+    n = bb_session_send(&a, BB_FRAME_RESPONSE, BB_CHANNEL_INTERACTIVE, 5, "now", 3);
+    assert(n > 0 && a.bundle_len == 0 && a.tx_bundles == 1);
+    n = bb_session_recv(&b, &type, &id, out, sizeof(out));
+    assert(n == 4 && type == BB_FRAME_RESPONSE && id == 4 && memcmp(out, "lone", 4) == 0);
+    n = bb_session_recv(&b, &type, &id, out, sizeof(out));
+    assert(n == 3 && id == 5);
+    session_pair_close(&a, &b);
+}
+
+/* BB-link: heartbeats show the peer is alive, overdue requests fail */
+static void
+test_session_deadlines(void)
+{
+    static bb_session a, b;
+    uint8_t out[64];
+    uint8_t type;
+    uint32_t id, late;
+    ssize_t n;
+    int rc;
+
+    session_pair(&a, &b, 1);
+    b.last_rx_ms = 0;
+    rc = bb_session_heartbeat(&a);
+    assert(rc == 0);
+    n = bb_session_recv(&b, &type, &id, out, sizeof(out));
+    assert(n == 1 && type == BB_FRAME_HEARTBEAT && b.last_rx_ms > 0);
+
+    a.request_timeout_ms = 1000;
+    late = bb_session_send_request(&a, BB_CHANNEL_INTERACTIVE, "late", 4, NULL, NULL);
+    n = bb_session_recv(&b, &type, &id, out, sizeof(out));
+    assert(late != 0 && n == 4);
+    rc = bb_session_expire(&a, bb_now_ms());
+    assert(rc == 0);
+    rc = bb_session_set_deadline(&a, late, 0);
+    assert(rc == 0);
+    rc = bb_session_expire(&a, UINT64_MAX);
+    assert(rc == 0);
+    rc = bb_session_set_deadline(&a, late, 1);
+    assert(rc == 0);
+    rc = bb_session_expire(&a, bb_now_ms() + 1);
+    assert(rc == 1 && a.inflight == 0);
+    rc = bb_session_set_deadline(&a, late, 1);
+    assert(rc < 0);
+    session_pair_close(&a, &b);
+}
+
+/* BB-link: each direction keeps its own count, frames arriving out of
+ * order are accepted once each, replays and frames behind the window are not */
+static void
+test_session_counters(void)
+{
+    static bb_session a, b;
+    static uint8_t frames[3][64];
+    ssize_t frame_len[3];
+    uint8_t out[64];
+    uint8_t type;
+    uint32_t id;
+    ssize_t n;
+
+    session_pair(&a, &b, 1);
+    n = bb_session_send(&a, BB_FRAME_REQUEST, BB_CHANNEL_INTERACTIVE, 7, "hello", 5);
+    assert(n > 0);
+    n = bb_session_send(&a, BB_FRAME_RESPONSE, BB_CHANNEL_INTERACTIVE, 7, "again", 5);
+    assert(n > 0);
+    n = bb_session_send(&b, BB_FRAME_REQUEST, BB_CHANNEL_INTERACTIVE, 7, "world", 5);
+    assert(n > 0);
+    n = bb_session_recv(&a, &type, &id, out, sizeof(out));
+    assert(n == 5 && type == BB_FRAME_REQUEST && memcmp(out, "world", 5) == 0);
+    n = bb_session_recv(&b, &type, &id, out, sizeof(out));
+    assert(n == 5 && memcmp(out, "hello", 5) == 0);
+    n = bb_session_recv(&b, &type, &id, out, sizeof(out));
+    assert(n == 5 && type == BB_FRAME_RESPONSE && memcmp(out, "again", 5) == 0);
+    assert(a.tx_seq == b.rx_top && b.tx_seq == a.rx_top);
+
+    for (int i = 0; i < 3; i++) {
+        n = bb_session_send(&a, BB_FRAME_REQUEST, BB_CHANNEL_INTERACTIVE, 20 + i, "reorder", 7);
+        assert(n > 0);
+        frame_len[i] = bb_transport_unix.recv(b.fd, &b.io, frames[i], sizeof(frames[i]));
+        assert(frame_len[i] == BB_FRAME_HDR_LEN + 7 + TAG_LEN);
+    }
+    for (int i = 2; i >= 0; i--) {
+        n = bb_transport_unix.send(a.fd, &a.io, frames[i], frame_len[i]);
+        assert(n == frame_len[i]);
+        n = bb_session_recv(&b, &type, &id, out, sizeof(out));
+        assert(n == 7 && id == 20 + (uint32_t)i);
+    }
+    n = bb_transport_unix.send(a.fd, &a.io, frames[1], frame_len[1]);
+    assert(n == frame_len[1]);
+    n = bb_session_recv(&b, &type, &id, out, sizeof(out));
+    assert(n == 0);
+    for (int i = 0; i < BB_REPLAY_WINDOW + 2; i++) {
+        n = bb_session_send(&a, BB_FRAME_REQUEST, BB_CHANNEL_INTERACTIVE, 30, "skip", 4);
+        assert(n > 0);
+        n = bb_session_recv(&b, &type, &id, out, sizeof(out));
+        assert(n == 4);
+    }
+    n = bb_transport_unix.send(a.fd, &a.io, frames[0], frame_len[0]);
+    assert(n == frame_len[0]);
+    n = bb_session_recv(&b, &type, &id, out, sizeof(out));
+    assert(n == 0);
+    session_pair_close(&a, &b);
+}
+
+/* BB-link: keys step along the ratchet in-band, late messages of the old
+ * phase still decrypt and a flipped phase bit fails authentication */
+static void
+test_session_ratchet(void)
+{
+    static bb_session a, b;
+    static uint8_t steps[5][64];
+    ssize_t step_len[5];
+    uint8_t out[64];
+    uint8_t type;
+    uint32_t id;
+    ssize_t n;
+
+    session_pair(&a, &b, 1);
+    a.ratchet_msgs = 2;
+    a.tx_phase_msgs = 0;
+    for (int i = 0; i < 5; i++) {
+        n = bb_session_send(&a, BB_FRAME_REQUEST, BB_CHANNEL_INTERACTIVE, 40 + i, "step", 4);
+        assert(n > 0);
+        step_len[i] = bb_transport_unix.recv(b.fd, &b.io, steps[i], sizeof(steps[i]));
+        assert(step_len[i] == BB_FRAME_HDR_LEN + 4 + TAG_LEN);
+        assert((steps[i][0] & BB_FRAME_PHASE) == (i / 2 % 2 ? BB_FRAME_PHASE : 0));
+    }
+    assert(a.tx_ratchets == 2);
+    int order[4] = {0, 2, 1, 3};
+    for (int i = 0; i < 4; i++) {
+        int k = order[i];
+        n = bb_transport_unix.send(a.fd, &a.io, steps[k], step_len[k]);
+        assert(n == step_len[k]);
+        n = bb_session_recv(&b, &type, &id, out, sizeof(out));
+        assert(n == 4 && type == BB_FRAME_REQUEST && id == 40 + (uint32_t)k);
+    }
+    assert(b.rx_ratchets == 1);
+    steps[4][0] ^= BB_FRAME_PHASE;
+    n = bb_transport_unix.send(a.fd, &a.io, steps[4], step_len[4]);
+    assert(n == step_len[4]);
+    n = bb_session_recv(&b, &type, &id, out, sizeof(out));
+    assert(n == 0 && b.rx_ratchets == 1);
+    steps[4][0] ^= BB_FRAME_PHASE;
+    n = bb_transport_unix.send(a.fd, &a.io, steps[4], step_len[4]);
+    assert(n == step_len[4]);
+    n = bb_session_recv(&b, &type, &id, out, sizeof(out));
+    assert(n == 4 && id == 44);
+    assert(b.rx_ratchets == 2 && memcmp(a.tx_key, b.rx_key, KEY_LEN) == 0);
+
+    // The successor is not the keystream of frame 6 (= BB_KDF_RATCHET) under
+    // the current key, so a known plaintext there does not reveal it
+    uint8_t next_key[KEY_LEN], frame6[KEY_LEN + TAG_LEN] = {0};
+    bb_kdf(next_key, a.tx_key, BB_KDF_RATCHET, NULL, 0);
+    aead_encrypt(frame6, a.tx_key, 6, NULL, 0, frame6, KEY_LEN);
+    assert(memcmp(next_key, frame6, KEY_LEN) != 0);
+
+    // Time moves the key as well
+    a.ratchet_msgs = 0;
+    a.ratchet_ms = 1;
+    a.tx_phase_ms = 0;
+    n = bb_session_send(&a, BB_FRAME_REQUEST, BB_CHANNEL_INTERACTIVE, 45, "time", 4);
+    assert(n > 0);
+    n = bb_session_recv(&b, &type, &id, out, sizeof(out));
+    assert(n == 4 && b.rx_ratchets == 3);
+    session_pair_close(&a, &b);
+}
+
+/* BB-link: messages are encrypted in place, split over frames when longer
+ * than the MTU, and fail authentication when cut short or under another key */
+static void
+test_session_fragments(void)
+{
+    static bb_session a, b;
+    static bb_buf buf;
+    static uint8_t big[3000], big_out[BB_MAX_MESSAGE];
+    const uint8_t* msg;
+    uint8_t type;
+    uint32_t id;
+    ssize_t n;
+
+    session_pair(&a, &b, 1);
+    memcpy(BB_BUF_PAYLOAD(&buf), "in place", 8);
+    n = bb_session_send_buf(&a, BB_FRAME_REQUEST, BB_CHANNEL_INTERACTIVE, 8, &buf, 8);
+    assert(n == BB_FRAME_HDR_LEN + 8 + TAG_LEN);
+    assert(memcmp(BB_BUF_PAYLOAD(&buf), "in place", 8) != 0);
+    n = bb_session_recv_buf(&b, &type, &id, &msg);
+    assert(n == 8 && msg == BB_BUF_PAYLOAD(&b.rx) && memcmp(msg, "in place", 8) == 0);
+
+    bb_transport small = bb_transport_unix;
+    small.mtu = 64;
+    a.transport = b.transport = &small;
+    for (size_t i = 0; i < sizeof(big); i++) {
+        big[i] = (uint8_t)(i * 7);
+    }
+    n = bb_session_send(&a, BB_FRAME_REQUEST, BB_CHANNEL_BULK, 9, big, sizeof(big));
+    assert(n > (ssize_t)sizeof(big));
+    int fragments = 0;
+    while ((n = bb_session_recv(&b, &type, &id, big_out, sizeof(big_out))) == 0) {
+        assert(type == BB_FRAME_INCOMPLETE);
+        fragments++;
+    }
+    assert(n == sizeof(big) && type == BB_FRAME_REQUEST && id == 9);
+    assert(memcmp(big_out, big, sizeof(big)) == 0);
+    assert(fragments == (sizeof(big) + TAG_LEN) / (64 - BB_FRAME_HDR_LEN));
+
+    // Losing a fragment makes the message fail authentication
+    n = bb_session_send(&a, BB_FRAME_REQUEST, BB_CHANNEL_INTERACTIVE, 10, big, 60);
+    assert(n > 0);
+    n = small.recv(b.fd, &b.io, big_out, sizeof(big_out));
+    assert(n == 64);
+    n = bb_session_recv(&b, &type, &id, big_out, sizeof(big_out));
+    assert(n == 0 && type == BB_FRAME_REQUEST);
+    n = bb_session_send(&a, BB_FRAME_REQUEST, BB_CHANNEL_BULK, 11, big, BB_MAX_MESSAGE + 1);
+    assert(n < 0);
+    n = bb_session_send(&a, BB_FRAME_REQUEST, BB_CHANNELS, 12, big, 1);
+    assert(n < 0);
+    a.transport = b.transport = &bb_transport_unix;
+
+    // A frame encrypted under another key fails authentication
+    a.tx_key[0] ^= 1;
+    n = bb_session_send(&a, BB_FRAME_REQUEST, BB_CHANNEL_INTERACTIVE, 8, "hello", 5);
+    assert(n > 0);
+    n = bb_session_recv(&b, &type, &id, big_out, sizeof(big_out));
+    assert(n == 0);
+    session_pair_close(&a, &b);
+}
+
+/* BB-link: a retried command is answered from the cache whichever
+ * alternative address of its peer it arrives on */
+static void
+test_race_cache(void)
+{
+    static bb_server srv;
+    static struct tropic_cache cache;
+    bb_keys keys = {pub_c, priv_c, pub_p};
+    struct tropic_message msg = {0};
+    struct tropic_response resp = {0};
+
+    int rc = bb_server_init(&srv, &keys, NULL);
+    assert(rc == 0);
+    rc = bb_server_add_race(&srv, "unix:/tmp/bb-race-a.sock|unix:/tmp/bb-race-b.sock");
+    assert(rc == 0);
+    rc = bb_server_add_peer(&srv, "unix:/tmp/bb-race-c.sock");
+    assert(rc == 0);
+    bb_session* a = bb_session_table_find(&srv.sessions, "unix:/tmp/bb-race-a.sock");
+    bb_session* b = bb_session_table_find(&srv.sessions, "unix:/tmp/bb-race-b.sock");
+    bb_session* c = bb_session_table_find(&srv.sessions, "unix:/tmp/bb-race-c.sock");
+    assert(a && b && c);
+    assert(bb_server_peer_name(&srv, a) == a->peer && bb_server_peer_name(&srv, b) == a->peer);
+    assert(bb_server_peer_name(&srv, c) == c->peer);
+
+    // The first attempt ran over one alternative, the retry won on the other
+    strcpy(msg.command, "ecc-gen 1");
+    msg.key = 7;
+    strcpy(resp.status, "OK");
+    tropic_cache_put(&cache, bb_server_peer_name(&srv, a), &msg, &resp, 0);
+    assert(tropic_cache_get(&cache, bb_server_peer_name(&srv, b), &msg, 1) != NULL);
+    assert(tropic_cache_get(&cache, bb_server_peer_name(&srv, c), &msg, 1) == NULL);
+    bb_server_close(&srv);
+}
+
+/* Poll two servers, the second may be NULL, until a session of either
+ * reaches a status or ms pass */
+static int
+servers_poll_until(bb_server* a, bb_server* b, const bb_session* s,
+                   bb_session_status status, uint32_t ms)
+{
+    uint64_t deadline = bb_now_ms() + ms;
+
+    while (s->status != status) {
+        if (bb_now_ms() >= deadline) return 0;
+        bb_server_poll(a, 1);
+        if (b) bb_server_poll(b, 1);
+    }
+    return 1;
+}
+
+/* BB-link: alternative addresses race, the first handshake wins and the
+ * others are parked until it drops, then all of them race again; a
+ * connect that never completes gives up after the link timeout */
+static void
+test_server_race(void)
+{
+    static bb_server c, p;
+    bb_keys keys_c = {pub_c, priv_c, pub_p}, keys_p = {pub_p, priv_p, pub_c};
+    struct sockaddr_un sun = {.sun_family = AF_UNIX};
+    struct sockaddr_in sin = {.sin_family = AF_INET};
+    socklen_t sin_len = sizeof(sin);
+    char spec[64];
+    int fillers[2], rc;
+
+    ecdh_keygen(pub_c, priv_c);
+    ecdh_keygen(pub_p, priv_p);
+    rc = bb_server_init(&c, &keys_c, NULL);
+    assert(rc == 0);
+    rc = bb_server_init(&p, &keys_p, NULL);
+    assert(rc == 0);
+    c.log = p.log = NULL;
+    bb_server_set_timeouts(&c, 100, 300, BB_REQUEST_TIMEOUT_MS);
+    rc = bb_server_listen(&p, "unix:/tmp/bb-test-race.sock");
+    assert(rc == 0);
+
+    // Connects to a listener that never accepts complete, but no
+    // handshake ever follows
+    strcpy(sun.sun_path, "/tmp/bb-test-silent.sock");
+    unlink(sun.sun_path);
+    int silent = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    rc = bind(silent, (struct sockaddr*)&sun, sizeof(sun));
+    assert(silent >= 0 && rc == 0);
+    rc = listen(silent, BB_MAX_SESSIONS);
+    assert(rc == 0);
+
+    rc = bb_server_add_race(&c, "unix:/tmp/bb-test-silent.sock|unix:/tmp/bb-test-race.sock");
+    assert(rc == 0);
+    bb_session* loser = bb_session_table_find(&c.sessions, "unix:/tmp/bb-test-silent.sock");
+    bb_session* winner = bb_session_table_find(&c.sessions, "unix:/tmp/bb-test-race.sock");
+    assert(loser && winner && loser->race == winner->race);
+
+    rc = servers_poll_until(&c, &p, winner, BB_SESSION_ESTABLISHED, 2000);
+    assert(rc == 1);
+    assert(loser->status == BB_SESSION_IDLE && loser->fd < 0);
+    assert(loser->next_attempt_ms == UINT64_MAX);
+    bb_server_poll(&c, 10);
+    bb_server_poll(&c, 10);
+    assert(loser->status == BB_SESSION_IDLE);
+
+    // The winner drops: both alternatives connect again, the one with a
+    // peripheral behind it wins again
+    bb_server_disconnect(&c, winner);
+    int raced = 0;
+    uint64_t deadline = bb_now_ms() + 2000;
+    while (winner->status != BB_SESSION_ESTABLISHED && bb_now_ms() < deadline) {
+        bb_server_poll(&c, 1);
+        bb_server_poll(&p, 1);
+        if (loser->status != BB_SESSION_IDLE) raced = 1;
+    }
+    assert(raced && winner->status == BB_SESSION_ESTABLISHED);
+    assert(loser->status == BB_SESSION_IDLE);
+
+    // A TCP listener with a full accept queue drops further SYNs, a
+    // connect to it stays in progress
+    int tcp = socket(AF_INET, SOCK_STREAM, 0);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    rc = bind(tcp, (struct sockaddr*)&sin, sizeof(sin));
+    assert(tcp >= 0 && rc == 0);
+    rc = listen(tcp, 0);
+    assert(rc == 0);
+    rc = getsockname(tcp, (struct sockaddr*)&sin, &sin_len);
+    assert(rc == 0);
+    for (int i = 0; i < 2; i++) {
+        fillers[i] = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        connect(fillers[i], (struct sockaddr*)&sin, sizeof(sin));
+    }
+    usleep(50000);
+
+    snprintf(spec, sizeof(spec), "tcp:127.0.0.1:%u", ntohs(sin.sin_port));
+    rc = bb_server_add_peer(&c, spec);
+    assert(rc == 0);
+    bb_session* stuck = bb_session_table_find(&c.sessions, spec);
+    bb_server_poll(&c, 1);
+    assert(stuck->status == BB_SESSION_CONNECTING);
+    uint64_t started = stuck->connect_ms;
+    rc = servers_poll_until(&c, NULL, stuck, BB_SESSION_IDLE, 2000);
+    assert(rc == 1 && bb_now_ms() - started >= 300);
+    assert(stuck->fd < 0 && stuck->next_attempt_ms > bb_now_ms());
+
+    bb_server_close(&c);
+    bb_server_close(&p);
+    for (int i = 0; i < 2; i++) {
+        close(fillers[i]);
+    }
+    close(tcp);
+    close(silent);
+    unlink("/tmp/bb-test-silent.sock");
+    unlink("/tmp/bb-test-race.sock");
+}
+
+/* Drop the link from the central's side and wait until the peripheral
+ * has noticed; the central reconnects on its own */
+static void
+resume_drop(bb_server* c, bb_server* p, bb_session* cs)
+{
+    uint64_t deadline = bb_now_ms() + 2000;
+
+    bb_server_disconnect(c, cs);
+    while (bb_server_any_session(p) && bb_now_ms() < deadline) {
+        bb_server_poll(p, 1);
+    }
+    assert(bb_server_any_session(p) == NULL);
+}
+
+/* Poll until the peripheral holds a ticket, and return it */
+static bb_ticket_entry*
+resume_wait_ticket(bb_server* c, bb_server* p)
+{
+    uint64_t deadline = bb_now_ms() + 2000;
+    bb_ticket_entry* e;
+
+    while (!(e = bb_ticket_store_get(&p->tickets, "")) && bb_now_ms() < deadline) {
+        bb_server_poll(c, 1);
+        bb_server_poll(p, 1);
+    }
+    assert(e);
+    return e;
+}
+
+/* Poll until the peripheral's side of the session is established, and
+ * return it; nothing the central sends after its own side is up has been
+ * read yet */
+static bb_session*
+resume_wait_peripheral(bb_server* c, bb_server* p)
+{
+    uint64_t deadline = bb_now_ms() + 2000;
+    bb_session* ps;
+
+    while (!(ps = bb_server_any_session(p)) && bb_now_ms() < deadline) {
+        bb_server_poll(c, 1);
+        bb_server_poll(p, 1);
+    }
+    assert(ps);
+    return ps;
+}
+
+/* BB-link: a held ticket resumes the session in one exchange with
+ * matching keys; a foreign or expired ticket falls back to the full
+ * handshake and a rejected one is not presented again; a resumption the
+ * peripheral cannot confirm is dropped */
+static void
+test_server_resume(void)
+{
+    static bb_server c, p;
+    bb_keys keys_c = {pub_c, priv_c, pub_p}, keys_p = {pub_p, priv_p, pub_c};
+    uint8_t first[BB_TICKET_LEN];
+    int rc;
+
+    ecdh_keygen(pub_c, priv_c);
+    ecdh_keygen(pub_p, priv_p);
+    rc = bb_server_init(&c, &keys_c, NULL);
+    assert(rc == 0);
+    rc = bb_server_init(&p, &keys_p, NULL);
+    assert(rc == 0);
+    c.log = p.log = NULL;
+    rc = bb_server_listen(&p, "unix:/tmp/bb-test-resume.sock");
+    assert(rc == 0);
+    rc = bb_server_add_peer(&c, "unix:/tmp/bb-test-resume.sock");
+    assert(rc == 0);
+    bb_session* cs = bb_session_table_find(&c.sessions, "unix:/tmp/bb-test-resume.sock");
+
+    // The first session runs the full handshake and hands out a ticket
+    bb_ticket_entry* e = resume_wait_ticket(&c, &p);
+    assert(cs->status == BB_SESSION_ESTABLISHED && cs->resumed == 0);
+    memcpy(first, e->ticket, BB_TICKET_LEN);
+
+    // The ticket resumes the next one, the central confirms the key
+    resume_drop(&c, &p, cs);
+    bb_session* ps = resume_wait_peripheral(&c, &p);
+    rc = servers_poll_until(&c, &p, cs, BB_SESSION_ESTABLISHED, 2000);
+    assert(rc == 1 && cs->resumed == 1 && ps->resumed == 1);
+    assert(memcmp(cs->tx_key, ps->rx_key, KEY_LEN) == 0);
+    assert(memcmp(cs->rx_key, ps->tx_key, KEY_LEN) == 0);
+
+    // A resumed session hands out a fresh ticket
+    uint64_t deadline = bb_now_ms() + 2000;
+    while (memcmp(e->ticket, first, BB_TICKET_LEN) == 0 && bb_now_ms() < deadline) {
+        bb_server_poll(&c, 1);
+        bb_server_poll(&p, 1);
+    }
+    assert(memcmp(e->ticket, first, BB_TICKET_LEN) != 0);
+
+    // A ticket of another central does not open: full handshake, and our
+    // rejected ticket is gone before the new one arrives
+    rc = bb_ticket_issuer_init(&c.issuer);
+    assert(rc == 0);
+    resume_drop(&c, &p, cs);
+    ps = resume_wait_peripheral(&c, &p);
+    assert(ps->resumed == 0 && bb_ticket_store_get(&p.tickets, ps->peer) == NULL);
+    e = resume_wait_ticket(&c, &p);
+    assert(cs->status == BB_SESSION_ESTABLISHED && cs->resumed == 0);
+
+    // An expired ticket is not presented at all
+    e->received -= BB_TICKET_LIFETIME_S + 1;
+    resume_drop(&c, &p, cs);
+    ps = resume_wait_peripheral(&c, &p);
+    assert(ps->resumed == 0);
+    e = resume_wait_ticket(&c, &p);
+    assert(cs->resumed == 0);
+
+    // A ticket whose secret the peripheral got wrong: the central accepts
+    // it, but the peripheral cannot confirm the key and drops the link
+    e->rms[0] ^= 1;
+    resume_drop(&c, &p, cs);
+    rc = servers_poll_until(&c, &p, cs, BB_SESSION_ESTABLISHED, 2000);
+    assert(rc == 1 && cs->resumed == 1);
+    deadline = bb_now_ms() + 2000;
+    while (cs->status == BB_SESSION_ESTABLISHED && bb_now_ms() < deadline) {
+        bb_server_poll(&c, 1);
+        bb_server_poll(&p, 1);
+        assert(bb_server_any_session(&p) == NULL);
+    }
+    assert(cs->status != BB_SESSION_ESTABLISHED);
+
+    bb_server_close(&c);
+    bb_server_close(&p);
+    unlink("/tmp/bb-test-resume.sock");
+}
+
+/* BB-link: tickets and the store, key derivation */
+static void
+test_ticket(void)
+{
+    bb_ticket_issuer issuer, other;
+    bb_ticket_store store = {0};
+    uint8_t secret[KEY_LEN], ticket[BB_TICKET_LEN], rms[KEY_LEN];
+    uint8_t a[KEY_LEN], b[KEY_LEN];
+    int rc;
+
+    rc = bb_ticket_issuer_init(&issuer);
+    assert(rc == 0);
+    rc = bb_ticket_issuer_init(&other);
+    assert(rc == 0);
+    rc = bb_random(secret, sizeof(secret));
+    assert(rc == 0);
+
+    // Both sides end up with the same resumption secret, sealed so the
+    // ticket does not show it
+    bb_ticket_issue(&issuer, secret, ticket);
+    bb_ticket_store_put(&store, "unix:pid1", ticket, secret);
+    rc = bb_ticket_open(&issuer, ticket, rms);
+    assert(rc == 0);
+    bb_ticket_entry* e = bb_ticket_store_get(&store, "unix:pid1");
+    assert(e && memcmp(e->rms, rms, KEY_LEN) == 0);
+    assert(memcmp(rms, secret, KEY_LEN) == 0);
+    assert(memcmp(ticket + 8, secret, KEY_LEN) != 0);
+
+    // Peers without a stable name get the newest ticket
+    assert(bb_ticket_store_get(&store, "unix:pid2") == e);
+
+    // Tampered or foreign tickets are rejected
+    ticket[BB_TICKET_LEN - 1] ^= 1;
+    rc = bb_ticket_open(&issuer, ticket, rms);
+    assert(rc < 0);
+    ticket[BB_TICKET_LEN - 1] ^= 1;
+    rc = bb_ticket_open(&other, ticket, rms);
+    assert(rc < 0);
+
+    bb_ticket_store_drop(e);
+    assert(bb_ticket_store_get(&store, "unix:pid1") == NULL);
+
+    // Derivation is deterministic and separated by label and context
+    bb_kdf(a, secret, BB_KDF_RESUME_KEY, ticket, 16);
+    bb_kdf(b, secret, BB_KDF_RESUME_KEY, ticket, 16);
+    assert(memcmp(a, b, KEY_LEN) == 0);
+    bb_kdf(b, secret, BB_KDF_CONFIRM, ticket, 16);
+    assert(memcmp(a, b, KEY_LEN) != 0);
+    bb_kdf(b, secret, BB_KDF_RESUME_KEY, ticket + 1, 16);
+    assert(memcmp(a, b, KEY_LEN) != 0);
+
+    // Nor is it the AEAD keystream at nonce = label under the same key
+    uint8_t stream[KEY_LEN + TAG_LEN];
+    memset(stream, 0, KEY_LEN);
+    aead_encrypt(stream, secret, BB_KDF_CONFIRM, NULL, 0, stream, KEY_LEN);
+    bb_kdf(a, secret, BB_KDF_CONFIRM, NULL, 0);
+    assert(memcmp(a, stream, KEY_LEN) != 0);
+}
+#endif
+
 int
 main(int argc, char** argv)
 {
@@ -85,4 +1345,29 @@ main(int argc, char** argv)
     assert(memcmp(central.hc, peripheral.hc, sizeof(central.hc)) == 0);
 
     assert(memcmp(central.key, peripheral.key, KEY_LEN) == 0);
+
+    test_wire();
+    test_wire_batch();
+    test_wire_caps();
+    test_wire_cache();
+    test_wire_shard();
+
+#ifdef BB_LINK_TESTS
+    test_transport_lookup();
+    test_transport(&bb_transport_unix, SOCK_SEQPACKET);
+    test_transport(&bb_transport_tcp, SOCK_STREAM);
+    test_session_keys();
+    test_session_caps();
+    test_session_requests();
+    test_session_credits();
+    test_session_bundle();
+    test_session_deadlines();
+    test_session_counters();
+    test_session_ratchet();
+    test_session_fragments();
+    test_race_cache();
+    test_server_race();
+    test_server_resume();
+    test_ticket();
+#endif
 }
\ No newline at end of file
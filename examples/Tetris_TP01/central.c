@@ -5,8 +5,7 @@
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/l2cap.h>
 #include "bbstate.h"
-#include <bluetooth/hci.h>
-#include <bluetooth/hci_lib.h>
+#include "bb_server.h"
 #include "tropic_simple.h"
 
 #include <sys/wait.h>  // For WEXITSTATUS
@@ -35,8 +34,16 @@ static uint8_t remote_public_key[32] = {
     0x69, 0xd6, 0x88, 0xe3, 0xd2, 0x4a, 0xa1, 0xec, 0xa5, 0x49, 0xac,
     0x95, 0xc0, 0x46, 0x80, 0x3d, 0x22, 0x03, 0x59, 0x65, 0x73};
 
-// Global state for the secure communication session
-static bbstate state;
+// Private key of the identity presented to upstream secure element nodes
+// in relay mode: they take us for a peripheral, so it is the peripheral's
+// demo key pair (its public key is remote_public_key)
+static uint8_t relay_private_key[32] = {
+    0x60, 0x58, 0xce, 0x93, 0x0d, 0xf3, 0xdd, 0x2e, 0xa0, 0x0e, 0x1a,
+    0x62, 0x6b, 0xc7, 0x0b, 0xa4, 0x17, 0x74, 0xea, 0x11, 0xe9, 0xa2,
+    0xef, 0x28, 0x7e, 0xd2, 0x5a, 0x59, 0xca, 0x04, 0x03, 0x6b};
+
+// Sessions with all configured peripheral devices
+static bb_server server;
 
 /**
  * Print buffer contents in hexadecimal format
@@ -60,6 +67,7 @@ void parse_command(const char* input, struct tropic_message* msg) {
     strncpy(msg->command, input, sizeof(msg->command) - 1);
     msg->command[sizeof(msg->command) - 1] = '\0';
     msg->data_len = 0;
+    msg->key = 0;
 
     // Remove trailing newline
     char* newline = strchr(msg->command, '\n');
@@ -316,263 +324,771 @@ int tropic_mem_erase(uint8_t slot) {
 }
 
 /**
- * Process incoming encrypted commands from peripheral device
- * This is the main command processing loop that:
- * 1. Receives encrypted commands via L2CAP
- * 2. Decrypts commands using the established session key
- * 3. Executes TROPIC01 hardware operations
- * 4. Encrypts and sends responses back to peripheral
+ * Execute one TROPIC01 command and fill in its response
+ * Dispatches the command string to the matching TROPIC01 hardware operation
  * 
- * @param socket - L2CAP socket connected to peripheral device
- * @param state - Secure session state containing keys and counters
+ * @param msg - Decrypted command received from a peripheral device
+ * @param resp - Response to be encrypted and sent back to the peripheral
  */
-void process_commands(int socket, bbstate* state) {
-    uint8_t encrypted_msg[2048];
-    uint8_t decrypted_msg[2048];
-    struct tropic_message msg;
-    struct tropic_response resp;
-    
-    printf("Central: Waiting for commands...\n");
-    
-    // Main command processing loop
-    while (1) {
-        // Receive encrypted command from peripheral device
-        ssize_t recv_len = recv(socket, encrypted_msg, sizeof(encrypted_msg), 0);
-        if (recv_len <= 0) {
-            printf("Connection closed or error\n");
-            break;
+void process_command(const struct tropic_message* msg, struct tropic_response* resp) {
+    // Process specific TROPIC01 hardware commands
+    if (strncmp(msg->command, "random ", 7) == 0) {
+        // Generate random bytes command
+        int count = atoi(msg->command + 7);
+        uint8_t random_data[256];
+        
+        if (count > 0 && count <= 255) {
+            tropic_random(random_data, count);
+            format_response(resp, "OK", random_data, count);
+        } else {
+            format_response(resp, "ERROR: Invalid count", NULL, 0);
         }
         
-        // Decrypt command using session key and counter
-        // Counter is incremented to prevent replay attacks
-        size_t dec_len = aead_decrypt(decrypted_msg, state->key, state->counter++,
-                                     NULL, 0, encrypted_msg, recv_len);
+    } else if (strncmp(msg->command, "ecc-gen ", 8) == 0) {
+        // Generate ECC key pair command
+        int slot = atoi(msg->command + 8);
         
-        if (dec_len < sizeof(msg)) {
-            printf("Invalid message size\n");
-            continue;
+        if (tropic_ecc_generate(slot) == 0) {
+            format_response(resp, "OK - ECC key generated", NULL, 0);
+        } else {
+            format_response(resp, "ERROR: Key generation failed", NULL, 0);
         }
         
-        // Extract command structure from decrypted data
-        memcpy(&msg, decrypted_msg, sizeof(msg));
-        printf("Received command: %s\n", msg.command);
+    } else if (strncmp(msg->command, "ecc-download ", 13) == 0) {
+        // Download public key command
+        int slot = atoi(msg->command + 13);
+        uint8_t pubkey[64];
         
-        // Process specific TROPIC01 hardware commands
-        if (strncmp(msg.command, "random ", 7) == 0) {
-            // Generate random bytes command
-            int count = atoi(msg.command + 7);
-            uint8_t random_data[256];
-            
-            if (count > 0 && count <= 255) {
-                tropic_random(random_data, count);
-                format_response(&resp, "OK", random_data, count);
-            } else {
-                format_response(&resp, "ERROR: Invalid count", NULL, 0);
-            }
-            
-        } else if (strncmp(msg.command, "ecc-gen ", 8) == 0) {
-            // Generate ECC key pair command
-            int slot = atoi(msg.command + 8);
-            
-            if (tropic_ecc_generate(slot) == 0) {
-                format_response(&resp, "OK - ECC key generated", NULL, 0);
-            } else {
-                format_response(&resp, "ERROR: Key generation failed", NULL, 0);
-            }
-            
-        } else if (strncmp(msg.command, "ecc-download ", 13) == 0) {
-            // Download public key command
-            int slot = atoi(msg.command + 13);
-            uint8_t pubkey[64];
-            
-            int len = tropic_ecc_download(slot, pubkey);
-            if (len > 0) {
-                format_response(&resp, "OK - Public key", pubkey, len);
-            } else {
-                format_response(&resp, "ERROR: Key download failed", NULL, 0);
-            }
-            
-        } else if (strncmp(msg.command, "ecc-clear ", 10) == 0) {
-            // Clear ECC key slot command
-            int slot = atoi(msg.command + 10);
-            
-            if (tropic_ecc_clear(slot) == 0) {
-                format_response(&resp, "OK - ECC slot cleared", NULL, 0);
-            } else {
-                format_response(&resp, "ERROR: Clear failed", NULL, 0);
-            }
-            
-        } else if (strncmp(msg.command, "ecc-sign ", 9) == 0) {
-            // Sign data command
-            char* space = strchr(msg.command + 9, ' ');
-            if (space) {
-                int slot = atoi(msg.command + 9);
-                char* data_str = space + 1;
-                uint8_t signature[64];
-                
-                int len = tropic_ecc_sign(slot, (uint8_t*)data_str, strlen(data_str), signature);
-                if (len > 0) {
-                    format_response(&resp, "OK - Signature", signature, len);
-                } else {
-                    format_response(&resp, "ERROR: Signing failed", NULL, 0);
-                }
-            } else {
-                format_response(&resp, "ERROR: Invalid sign command", NULL, 0);
-            }
-            
-        } else if (strncmp(msg.command, "mem-store ", 10) == 0) {
-            // Store data in memory command
-            char* space = strchr(msg.command + 10, ' ');
-            if (space) {
-                int slot = atoi(msg.command + 10);
-                char* data_str = space + 1;
-                
-                if (tropic_mem_store(slot, (uint8_t*)data_str, strlen(data_str)) == 0) {
-                    format_response(&resp, "OK - Data stored", NULL, 0);
-                } else {
-                    format_response(&resp, "ERROR: Store failed", NULL, 0);
-                }
-            } else {
-                format_response(&resp, "ERROR: Invalid store command", NULL, 0);
-            }
-            
-        } else if (strncmp(msg.command, "mem-read ", 9) == 0) {
-            // Read data from memory command
-            int slot = atoi(msg.command + 9);
-            uint8_t data[444];
+        int len = tropic_ecc_download(slot, pubkey);
+        if (len > 0) {
+            format_response(resp, "OK - Public key", pubkey, len);
+        } else {
+            format_response(resp, "ERROR: Key download failed", NULL, 0);
+        }
+        
+    } else if (strncmp(msg->command, "ecc-clear ", 10) == 0) {
+        // Clear ECC key slot command
+        int slot = atoi(msg->command + 10);
+        
+        if (tropic_ecc_clear(slot) == 0) {
+            format_response(resp, "OK - ECC slot cleared", NULL, 0);
+        } else {
+            format_response(resp, "ERROR: Clear failed", NULL, 0);
+        }
+        
+    } else if (strncmp(msg->command, "ecc-sign ", 9) == 0) {
+        // Sign data command
+        char* space = strchr(msg->command + 9, ' ');
+        if (space) {
+            int slot = atoi(msg->command + 9);
+            char* data_str = space + 1;
+            uint8_t signature[64];
             
-            int len = tropic_mem_read(slot, data, sizeof(data));
+            int len = tropic_ecc_sign(slot, (uint8_t*)data_str, strlen(data_str), signature);
             if (len > 0) {
-                format_response(&resp, "OK - Memory data", data, len);
+                format_response(resp, "OK - Signature", signature, len);
             } else {
-                format_response(&resp, "ERROR: Read failed", NULL, 0);
+                format_response(resp, "ERROR: Signing failed", NULL, 0);
             }
+        } else {
+            format_response(resp, "ERROR: Invalid sign command", NULL, 0);
+        }
+        
+    } else if (strncmp(msg->command, "mem-store ", 10) == 0) {
+        // Store data in memory command
+        char* space = strchr(msg->command + 10, ' ');
+        if (space) {
+            int slot = atoi(msg->command + 10);
+            char* data_str = space + 1;
             
-        } else if (strncmp(msg.command, "mem-erase ", 10) == 0) {
-            // Erase memory slot command
-            int slot = atoi(msg.command + 10);
-            
-            if (tropic_mem_erase(slot) == 0) {
-                format_response(&resp, "OK - Memory slot erased", NULL, 0);
+            if (tropic_mem_store(slot, (uint8_t*)data_str, strlen(data_str)) == 0) {
+                format_response(resp, "OK - Data stored", NULL, 0);
             } else {
-                format_response(&resp, "ERROR: Erase failed", NULL, 0);
+                format_response(resp, "ERROR: Store failed", NULL, 0);
             }
-            
         } else {
-            // Unknown command
-            format_response(&resp, "ERROR: Unknown command", NULL, 0);
+            format_response(resp, "ERROR: Invalid store command", NULL, 0);
+        }
+        
+    } else if (strncmp(msg->command, "mem-read ", 9) == 0) {
+        // Read data from memory command
+        int slot = atoi(msg->command + 9);
+        uint8_t data[444];
+        
+        int len = tropic_mem_read(slot, data, sizeof(data));
+        if (len > 0) {
+            format_response(resp, "OK - Memory data", data, len);
+        } else {
+            format_response(resp, "ERROR: Read failed", NULL, 0);
         }
         
-        // Encrypt response using session key and incremented counter
-        uint8_t encrypted_resp[2048];
-        size_t enc_len = aead_encrypt(encrypted_resp, state->key, state->counter++,
-                                     NULL, 0, (uint8_t*)&resp, sizeof(resp));
-        send(socket, encrypted_resp, enc_len, 0);
+    } else if (strncmp(msg->command, "mem-erase ", 10) == 0) {
+        // Erase memory slot command
+        int slot = atoi(msg->command + 10);
+        
+        if (tropic_mem_erase(slot) == 0) {
+            format_response(resp, "OK - Memory slot erased", NULL, 0);
+        } else {
+            format_response(resp, "ERROR: Erase failed", NULL, 0);
+        }
+        
+    } else {
+        // Unknown command
+        format_response(resp, "ERROR: Unknown command", NULL, 0);
     }
 }
 
+// Responses of keyed commands of all peripherals
+static struct tropic_cache cache;
+
+// Commands being worked on by upstream nodes at most, see relay_forward()
+#define RELAY_PENDING 32
+
+// Command of a peripheral forwarded to an upstream node
+struct relay_request {
+    bb_deferred d;              // Where the answer goes, d.s is NULL when unused
+    struct tropic_message msg;  // As the peripheral sent it, for the cache
+    int placed;                 // 1 if it placed its slot, see shard_route()
+    struct tropic_route* probe; // Slot probed before msg runs, NULL when msg is sent
+};
+
+static struct relay_request relayed[RELAY_PENDING];
+
+// Relay mode: where logical key and memory slots were placed
+#define ROUTES_FILE "bb_routes.txt"
+static struct tropic_routes routes;
+
+// Command whose node went away before answering, by route, see shard_lost()
+struct lost_command {
+    char peer[BB_ADDR_STRLEN];  // Peripheral that sent it, "" for none
+    struct tropic_message msg;
+    int effect;                 // tropic_slot_effect of msg
+};
+
+static struct lost_command lost[TROPIC_ROUTES];
+
+// 1 when upstream nodes connect to us, see main()
+static int relaying;
+
+// Our own secure element node, announced to relays
+static char node_name[TROPIC_NODE_NAME_LEN];
+
+// Smoothed time our own secure element takes for a relayable command
+static uint32_t local_latency_ms;
+
 /**
- * Main function - implements Bluetooth L2CAP client for TROPIC01 hardware interface
- * This device acts as a central that:
- * 1. Connects to peripheral device via L2CAP
- * 2. Performs secure handshake to establish session key
- * 3. Processes encrypted commands and executes TROPIC01 hardware operations
- * 4. Sends encrypted responses back to peripheral
+ * Check whether any secure element answers a command alike, so any node
+ * may run it; key and memory commands address slots of one chip
  */
-int
-main(int argc, char** argv)
-{
-    uint8_t buffer[128];
-    struct sockaddr_l2 addr = {0};
-    int sock;
-    const char* sample_text = "L2CAP Simple";
-    bdaddr_t local_bdaddr = {0}; // Local Bluetooth address storage
-    int dev_id = 0;              // Use hci0 device (first Bluetooth adapter)
-
-    printf("Start Bluetooth L2CAP client, server addr %s\n",
-           L2CAP_SERVER_BLUETOOTH_ADDR);
-
-    // Get local Bluetooth address from hci0 adapter
-    int hci_sock = hci_open_dev(dev_id);
-    if (hci_sock < 0) {
-        perror("failed to open HCI device");
-        exit(1);
+static int relay_is_stateless(const struct tropic_message* msg) {
+    return strncmp(msg->command, "random ", 7) == 0;
+}
+
+/**
+ * Handle "subscribe <topic>" and "unsubscribe <topic>" for the session
+ * Subscriptions end with the session, a reconnecting peripheral renews them
+ *
+ * @return 1 if the command was a subscription command, 0 otherwise
+ */
+static int handle_subscription(bb_session* s, const struct tropic_message* msg,
+                               struct tropic_response* resp) {
+    int subscribe = strncmp(msg->command, "subscribe ", 10) == 0;
+    if (!subscribe && strncmp(msg->command, "unsubscribe ", 12) != 0) return 0;
+
+    char* end;
+    long topic = strtol(strchr(msg->command, ' ') + 1, &end, 10);
+    if (*end != '\0' || topic != TROPIC_TOPIC_SLOTS) {
+        format_response(resp, "ERROR: Unknown topic", NULL, 0);
+        return 1;
     }
 
-    if (hci_read_bd_addr(hci_sock, &local_bdaddr, 0) < 0) {
-        perror("failed to read local Bluetooth address");
-        close(hci_sock);
-        exit(1);
+    if (subscribe) {
+        s->subscriptions |= (uint32_t)1 << topic;
+    } else {
+        s->subscriptions &= ~((uint32_t)1 << topic);
     }
-    close(hci_sock);
+    format_response(resp, "OK", NULL, 0);
+    return 1;
+}
 
-    char local_addr_str[18];
-    ba2str(&local_bdaddr, local_addr_str);
-    printf("Using local HCI device: hci%d (%s)\n", dev_id, local_addr_str);
+/**
+ * Tell subscribed peripherals other than the requester that a command
+ * changed a key or memory slot, so they need not poll for it
+ */
+static void publish_slot_change(bb_session* s, const struct tropic_message* msg,
+                                const struct tropic_response* resp) {
+    static const char* changing[] = {"ecc-gen ", "ecc-clear ", "mem-store ", "mem-erase "};
+    struct tropic_response event;
+    uint8_t wire[TROPIC_WIRE_MAX];
+    char what[32];
 
-    // Create L2CAP socket for client connection
-    sock = socket(AF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
-    if (sock < 0) {
-        perror("failed to create socket");
-        exit(1);
+    if (strncmp(resp->status, "OK", 2) != 0) return;
+    for (size_t i = 0; i < sizeof(changing) / sizeof(changing[0]); i++) {
+        size_t n = strlen(changing[i]);
+        if (strncmp(msg->command, changing[i], n) != 0) continue;
+
+        // Command and slot only, data written to the slot stays private
+        int len = (int)strcspn(msg->command + n, " ") + (int)n;
+        snprintf(what, sizeof(what), "%.*s: OK", len, msg->command);
+        format_response(&event, what, NULL, 0);
+        size_t wire_len = tropic_encode_response(&event, wire, sizeof(wire));
+        bb_server_notify(&server, s, TROPIC_TOPIC_SLOTS, wire, wire_len);
+        return;
     }
+}
 
-    // Bind socket to local address (hci0)
-    struct sockaddr_l2 local_addr = {0};
-    local_addr.l2_family = AF_BLUETOOTH;
-    bacpy(&local_addr.l2_bdaddr, &local_bdaddr); // Set to hci0's address
+/**
+ * Node expected to answer a stateless command first: the upstream node
+ * whose outstanding commands at its observed latency are done before ours
+ *
+ * @param channel - Channel the command arrived on and is forwarded on
+ * @return Upstream session, NULL to run the command here
+ */
+static bb_session* relay_pick(uint8_t channel, const struct tropic_message* msg) {
+    // Queued bulk commands run here before this one
+    uint64_t best_ms = (uint64_t)(server.bulk_count + 1) * local_latency_ms;
+    bb_session* best = NULL;
+    uint8_t wire[TROPIC_WIRE_MAX];
+    struct tropic_caps caps;
 
-    if (bind(sock, (struct sockaddr*)&local_addr, sizeof(local_addr)) < 0) {
-        perror("failed to bind local socket");
-        close(sock);
-        exit(1);
+    size_t len = tropic_encode_message(msg, wire, sizeof(wire));
+    for (int i = 0; i < BB_MAX_SESSIONS && len > 0; i++) {
+        bb_session* up = &server.sessions.slots[i];
+        if (up->outgoing || !bb_session_window_open(up, channel)) continue;
+        if (tropic_decode_caps(up->peer_caps.app, up->peer_caps.app_len, &caps) < 0 ||
+            !tropic_caps_supports(&caps, wire, len)) {
+            continue;
+        }
+
+        if (bb_session_load_ms(up) < best_ms) {
+            best = up;
+            best_ms = bb_session_load_ms(up);
+        }
     }
+    return best;
+}
 
-    // Configure connection parameters for target server
-    addr.l2_family = AF_BLUETOOTH;
-    addr.l2_psm = htobs(L2CAP_SERVER_PORT_NUM); // Server's port number
-    str2ba(L2CAP_SERVER_BLUETOOTH_ADDR, &addr.l2_bdaddr); // Server's Bluetooth address
+/**
+ * Keep the routing table in ROUTES_FILE, so a restarted relay still finds
+ * the keys and data it placed
+ */
+static void routes_save(void) {
+    FILE* f = fopen(ROUTES_FILE, "w");
+    if (!f) {
+        perror(ROUTES_FILE);
+        return;
+    }
+    for (int i = 0; i < TROPIC_ROUTES; i++) {
+        const struct tropic_route* r = &routes.entries[i];
+        if (r->node[0] == '\0') continue;
+        fprintf(f, "%s %u %u %s%s\n", r->kind == TROPIC_SLOT_ECC ? "ecc" : "mem",
+                r->logical, r->physical, r->node, r->unknown ? " unknown" : "");
+    }
+    fclose(f);
+}
 
-    // Connect to peripheral device
-    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        perror("failed to connect");
-        close(sock);
-        exit(1);
+/**
+ * Load the routing table saved by a previous run, if any
+ */
+static void routes_load(void) {
+    char line[128], kind[4], node[TROPIC_NODE_NAME_LEN], state[8];
+    unsigned int logical, physical;
+    int count = 0;
+
+    FILE* f = fopen(ROUTES_FILE, "r");
+    if (!f) return;
+    while (count < TROPIC_ROUTES && fgets(line, sizeof(line), f)) {
+        int fields = sscanf(line, "%3s %u %u %23s %7s", kind, &logical, &physical, node, state);
+        if (fields < 4) continue;
+        struct tropic_route* r = &routes.entries[count++];
+        snprintf(r->node, sizeof(r->node), "%s", node);
+        r->kind = strcmp(kind, "ecc") == 0 ? TROPIC_SLOT_ECC : TROPIC_SLOT_MEM;
+        r->logical = (uint16_t)logical;
+        r->physical = (uint16_t)physical;
+        r->unknown = fields == 5 && strcmp(state, "unknown") == 0;
     }
+    fclose(f);
+    printf("%d placed slots loaded from %s\n", count, ROUTES_FILE);
+}
 
-    printf("connected...\n");
-    
-    // Initialize secure session state as central device
-    // This prepares the cryptographic state for the handshake
-    bbstate_init(&state, BB_ROLE_CENTRAL, public_key, private_key,
-                 remote_public_key, NULL);
-    
-    // Initiate secure handshake with peripheral device
-    bb_session_start_req(&state, buffer);
+/**
+ * Name of the secure element an upstream session reaches
+ *
+ * @return 0 on success, -1 if it is no established upstream node with a name
+ */
+static int relay_node_name(const bb_session* up, char* name) {
+    struct tropic_caps caps;
 
-    // Send handshake request
-    if (send(sock, buffer, sizeof(struct bb_session_start_req), 0) <= 0) {
-        perror("failed to send data");
-        close(sock);
-        exit(1);
+    if (up->outgoing || up->status != BB_SESSION_ESTABLISHED ||
+        tropic_decode_caps(up->peer_caps.app, up->peer_caps.app_len, &caps) < 0 ||
+        caps.node[0] == '\0') {
+        return -1;
     }
+    memcpy(name, caps.node, TROPIC_NODE_NAME_LEN);
+    return 0;
+}
 
-    // Receive handshake response
-    if (recv(sock, buffer, sizeof(struct bb_session_start_req), 0) <= 0) {
-        perror("failed to receive data");
-        close(sock);
-        exit(1);
+/**
+ * Resolve the slot of a key or memory command in relay mode
+ * ecc-gen and mem-store place a new slot on the ring owner among our own
+ * and the connected upstream nodes; every other command goes to the node
+ * the slot was placed on
+ *
+ * @param phys - Set to the command with the slot number of the owning chip
+ * @param node - Set to the upstream session to send it to, NULL to run it here
+ * @param placed - Set to 1 if this command placed the slot
+ * @param slot - Set to the route of the slot
+ * @return 1 if the command was resolved, 0 if it addresses no slot or we
+ *         do not relay, -1 with resp set if it cannot run
+ */
+static int shard_route(const struct tropic_message* msg, struct tropic_message* phys,
+                       bb_session** node, int* placed, struct tropic_route** slot,
+                       struct tropic_response* resp) {
+    char names[BB_MAX_SESSIONS + 1][TROPIC_NODE_NAME_LEN];
+    const char* nodes[BB_MAX_SESSIONS + 1];
+    bb_session* sessions[BB_MAX_SESSIONS + 1] = {NULL};
+    uint16_t logical;
+    int effect, count = 0;
+
+    int kind = relaying ? tropic_slot_command(msg->command, &logical, &effect) : -1;
+    if (kind < 0) return 0;
+
+    // Our own node first, then every connected upstream node
+    memcpy(names[count++], node_name, TROPIC_NODE_NAME_LEN);
+    for (int i = 0; i < BB_MAX_SESSIONS; i++) {
+        if (relay_node_name(&server.sessions.slots[i], names[count]) == 0) {
+            sessions[count++] = &server.sessions.slots[i];
+        }
     }
-    
-    // Process handshake response and derive session key
-    bb_session_start_rx(&state, buffer);
-    printf("Handshake complete, key:\n");
-    print_buf(state.key, sizeof(state.key));
+    for (int i = 0; i < count; i++) {
+        nodes[i] = names[i];
+    }
+
+    *placed = 0;
+    struct tropic_route* route = tropic_route_find(&routes, kind, logical);
+    if (!route && effect != TROPIC_SLOT_FILL) {
+        format_response(resp, "ERROR: Slot is empty", NULL, 0);
+        return -1;
+    }
+    if (!route) {
+        int owner = tropic_ring_owner(nodes, count, kind, logical);
+        route = tropic_route_place(&routes, kind, logical, nodes[owner]);
+        if (!route) {
+            format_response(resp, "ERROR: No free slot on its node", NULL, 0);
+            return -1;
+        }
+        *placed = 1;
+    }
+
+    int i = 0;
+    while (i < count && strcmp(nodes[i], route->node) != 0) i++;
+    if (i == count) {
+        if (*placed) tropic_route_drop(route);
+        format_response(resp, "ERROR: Node of the slot is not connected", NULL, 0);
+        return -1;
+    }
+    *node = sessions[i];
+    *slot = route;
+    tropic_slot_rewrite(msg, route->physical, phys);
+    return 1;
+}
+
+/**
+ * Update the routing table with the outcome of a resolved command: a slot
+ * stays placed once its command succeeded and is freed when it is cleared
+ *
+ * @param placed - 1 if the command placed the slot, see shard_route()
+ */
+static void shard_done(const struct tropic_message* msg, const struct tropic_response* resp,
+                       int placed) {
+    uint16_t logical;
+    int effect;
+
+    int kind = relaying ? tropic_slot_command(msg->command, &logical, &effect) : -1;
+    struct tropic_route* route = kind < 0 ? NULL : tropic_route_find(&routes, kind, logical);
+    if (!route) return;
+
+    int ok = strncmp(resp->status, "OK", 2) == 0;
+    if (placed && !ok) {
+        tropic_route_drop(route);
+        return;
+    }
+    if (effect == TROPIC_SLOT_EMPTY && ok) {
+        tropic_route_drop(route);
+    } else if (!placed) {
+        return;
+    }
+    routes_save();
+}
+
+/**
+ * Keep the slot of a command whose node went away before answering: the
+ * command may or may not have run, so its chip slot is neither freed nor
+ * handed out again until a probe of the chip settles it, see shard_settle()
+ * Commands that only use a slot, or fill one that was already placed,
+ * leave it as it was either way
+ *
+ * @param peer - Peripheral that sent the command, its retry gets the outcome
+ * @param placed - 1 if the command placed the slot, see shard_route()
+ */
+static void shard_lost(const char* peer, const struct tropic_message* msg, int placed) {
+    uint16_t logical;
+    int effect;
+
+    int kind = relaying ? tropic_slot_command(msg->command, &logical, &effect) : -1;
+    struct tropic_route* route = kind < 0 ? NULL : tropic_route_find(&routes, kind, logical);
+    if (!route || effect == TROPIC_SLOT_USE || (effect == TROPIC_SLOT_FILL && !placed)) return;
+
+    struct lost_command* l = &lost[route - routes.entries];
+    snprintf(l->peer, sizeof(l->peer), "%s", peer);
+    l->msg = *msg;
+    l->effect = effect;
+    route->unknown = 1;
+    routes_save();
+}
+
+/**
+ * Settle a slot left unknown by shard_lost() with the answer of a probe:
+ * a slot the chip holds stays placed, an empty one is freed
+ * The lost command is answered from the cache when it is retried, with
+ * the response it had if the chip shows it ran
+ */
+static void shard_settle(struct tropic_route* route, const struct tropic_response* found) {
+    static const char* ran[2][3] = {
+        [TROPIC_SLOT_ECC] = {[TROPIC_SLOT_FILL] = "OK - ECC key generated",
+                             [TROPIC_SLOT_EMPTY] = "OK - ECC slot cleared"},
+        [TROPIC_SLOT_MEM] = {[TROPIC_SLOT_FILL] = "OK - Data stored",
+                             [TROPIC_SLOT_EMPTY] = "OK - Memory slot erased"},
+    };
+    struct lost_command* l = &lost[route - routes.entries];
+    struct tropic_response resp;
+
+    // Two commands may have probed it
+    if (!route->unknown) return;
+
+    int held = strncmp(found->status, "OK", 2) == 0;
+    if (l->peer[0] != '\0' && held == (l->effect == TROPIC_SLOT_FILL)) {
+        format_response(&resp, ran[route->kind][l->effect], NULL, 0);
+        tropic_cache_put(&cache, l->peer, &l->msg, &resp, bb_now_ms());
+    }
+    printf("Slot %u on %s is %s\n", route->logical, route->node, held ? "held" : "empty");
+    memset(l, 0, sizeof(*l));
+    if (held) {
+        route->unknown = 0;
+    } else {
+        tropic_route_drop(route);
+    }
+    routes_save();
+}
+
+static int process_keyed_command(bb_session* s, const struct tropic_message* msg,
+                                 struct tropic_response* resp, const bb_deferred* d);
+
+/**
+ * Answer a relayed command with the response of its upstream node
+ * If the node failed or went away, a stateless command runs here instead;
+ * a slot command may or may not have run, so its error is not cached and
+ * its slot is kept, see shard_lost()
+ * The answer to a probe settles its slot, then the command waiting for it runs
+ */
+static void relay_done(bb_session* up, uint32_t id, void* arg, const uint8_t* resp,
+                       ssize_t len) {
+    struct relay_request* r = arg;
+    struct relay_request done = *r;
+    struct tropic_response response;
+    uint8_t wire[TROPIC_WIRE_MAX];
+    (void)id;
+
+    r->d.s = NULL;
+    int answered = len >= 0 && tropic_decode_response(resp, (size_t)len, &response) == 0;
+    if (done.probe && answered) {
+        shard_settle(done.probe, &response);
+        // A peripheral that went away meanwhile sends the command again
+        if (done.d.s->status != BB_SESSION_ESTABLISHED ||
+            done.d.s->generation != done.d.generation) {
+            return;
+        }
+        if (process_keyed_command(done.d.s, &done.msg, &response, &done.d)) return;
+    } else if (done.probe) {
+        format_response(&response, "ERROR: Node of the slot failed", NULL, 0);
+    } else if (!answered && relay_is_stateless(&done.msg)) {
+        printf("[%s] Upstream node failed, running here: %s\n", up->peer, done.msg.command);
+        process_command(&done.msg, &response);
+        tropic_cache_put(&cache, bb_server_peer_name(&server, done.d.s), &done.msg, &response,
+                         bb_now_ms());
+    } else if (!answered) {
+        format_response(&response, "ERROR: Node of the slot failed", NULL, 0);
+        shard_lost(bb_server_peer_name(&server, done.d.s), &done.msg, done.placed);
+    } else {
+        shard_done(&done.msg, &response, done.placed);
+        tropic_cache_put(&cache, bb_server_peer_name(&server, done.d.s), &done.msg, &response,
+                         bb_now_ms());
+        publish_slot_change(done.d.s, &done.msg, &response);
+    }
+
+    size_t wire_len = tropic_encode_response(&response, wire, sizeof(wire));
+    if (bb_server_respond(&server, &done.d, wire, wire_len) < 0) {
+        printf("[%s] Relayed response dropped, the peripheral resends\n", done.d.s->peer);
+    }
+}
+
+/**
+ * Forward a command to an upstream node, relay_done() answers the
+ * peripheral once the node responded
+ * Upstream nodes are centrals with a secure element of their own that
+ * connected to our relay address, see main()
+ *
+ * @param d - The peripheral's request, see bb_server_defer()
+ * @param msg - Command as the peripheral sent it
+ * @param phys - Command as the node runs it
+ * @param placed - 1 if the command placed its slot, see shard_route()
+ * @param probe - Slot phys probes before msg runs, NULL if phys is msg
+ * @return 1 if the command was sent, 0 if there is no room for it
+ */
+static int relay_forward(const bb_deferred* d, const struct tropic_message* msg,
+                         const struct tropic_message* phys, bb_session* up, int placed,
+                         struct tropic_route* probe) {
+    struct relay_request* r = NULL;
+    uint8_t wire[TROPIC_WIRE_MAX];
+
+    for (int i = 0; i < RELAY_PENDING && !r; i++) {
+        if (relayed[i].d.s == NULL) r = &relayed[i];
+    }
+    size_t len = tropic_encode_message(phys, wire, sizeof(wire));
+    if (!r || len == 0) return 0;
+
+    r->d = *d;
+    r->msg = *msg;
+    r->placed = placed;
+    r->probe = probe;
+    if (bb_server_request(&server, up, d->channel, wire, len, relay_done, r) == 0) {
+        r->d.s = NULL;
+        return 0;
+    }
+    printf("[%s] %s %s: %s\n", d->s->peer, probe ? "Probing slot on" : "Relayed to",
+           up->peer, phys->command);
+    return 1;
+}
+
+/**
+ * Execute a command, or answer a retried one from the cache
+ * A peripheral resending a command after a link drop gives it the key of
+ * the first attempt; if that attempt ran, the secure element is not used
+ * again
+ * In relay mode key and memory commands run on the node holding their
+ * slot, stateless ones on the node expected to answer first
+ *
+ * A slot whose last command got no answer is probed first, see shard_lost()
+ *
+ * @param s - Session the command arrived on, its peer scopes the key; all
+ *            alternative addresses of the peer share it, see bb_server_peer_name()
+ * @param d - Where an upstream node's answer goes, NULL inside a batch
+ * @return 1 if the command was forwarded and is answered later, 0 if resp is set
+ */
+static int process_keyed_command(bb_session* s, const struct tropic_message* msg,
+                                 struct tropic_response* resp, const bb_deferred* d) {
+    uint64_t now = bb_now_ms();
+    const char* scope = bb_server_peer_name(&server, s);
+    const struct tropic_response* cached = tropic_cache_get(&cache, scope, msg, now);
+    struct tropic_message phys = *msg;
+    struct tropic_route* route = NULL;
+    bb_session* up = NULL;
+    int placed = 0;
+
+    if (cached) {
+        printf("[%s] Answered retried command from cache: %s\n", s->peer, msg->command);
+        *resp = *cached;
+        return 0;
+    }
+    if (handle_subscription(s, msg, resp)) return 0;
 
-    // Start processing commands from peripheral device
-    // This is the main loop that handles encrypted TROPIC01 commands
-    process_commands(sock, &state);
+    int routed = shard_route(msg, &phys, &up, &placed, &route, resp);
+    if (routed < 0) return 0;
+    if (routed && route->unknown) {
+        struct tropic_message probe;
+        struct tropic_response found;
 
-    close(sock);
+        tropic_slot_probe(route, &probe);
+        if (!up) {
+            process_command(&probe, &found);
+            shard_settle(route, &found);
+            return process_keyed_command(s, msg, resp, d);
+        }
+        if (d && relay_forward(d, msg, &probe, up, 0, route)) return 1;
+        format_response(resp, d ? "ERROR: Node of the slot is busy" :
+                        "ERROR: Slot is on another node, send it on its own", NULL, 0);
+        return 0;
+    }
+    if (d) {
+        if (!routed && relay_is_stateless(msg)) up = relay_pick(d->channel, msg);
+        if (up && relay_forward(d, msg, &phys, up, placed, NULL)) return 1;
+    }
+    if (up && routed) {
+        // Only the chip holding the slot can run the command
+        format_response(resp, d ? "ERROR: Node of the slot is busy" :
+                        "ERROR: Slot is on another node, send it on its own", NULL, 0);
+        shard_done(msg, resp, placed);
+        return 0;
+    }
+
+    process_command(&phys, resp);
+    if (relay_is_stateless(msg)) {
+        uint32_t sample = (uint32_t)(bb_now_ms() - now);
+        local_latency_ms = local_latency_ms ? (local_latency_ms * 7 + sample) / 8 : sample;
+    }
+    shard_done(msg, resp, placed);
+    tropic_cache_put(&cache, scope, msg, resp, now);
+    publish_slot_change(s, msg, resp);
     return 0;
+}
+
+/**
+ * Execute every command of a batch and answer with one batch response
+ * Commands run in order; a command that cannot be decoded gets an error
+ * response of its own and does not stop the batch
+ *
+ * @return Length of the batch response written to out
+ */
+static size_t handle_batch(bb_session* s, const uint8_t* req, size_t req_len,
+                           uint8_t* out, size_t out_cap) {
+    struct tropic_message msg;
+    struct tropic_response resp;
+    const uint8_t* item;
+    size_t item_len, pos = 0;
+    int count = 0;
+
+    size_t out_len = tropic_batch_begin(out, out_cap);
+    while (count < TROPIC_BATCH_MAX &&
+           tropic_batch_next(req, req_len, &pos, &item, &item_len) > 0) {
+        if (tropic_decode_message(item, item_len, &msg) < 0) {
+            format_response(&resp, "ERROR: Unsupported message format", NULL, 0);
+        } else {
+            process_keyed_command(s, &msg, &resp, NULL);
+        }
+
+        // Responses that no longer fit are left out, the peripheral
+        // counts them as failed
+        size_t next = tropic_batch_add_response(out, out_len, out_cap, &resp);
+        if (next == 0) break;
+        out_len = next;
+        count++;
+    }
+    printf("[%s] Executed batch of %d command(s)\n", s->peer, count);
+    return out_len;
+}
+
+/**
+ * Request handler for the session server
+ * Called for every decrypted frame of every established session:
+ * decodes the command, executes it and returns the encoded response
+ * 
+ * @param s - Session the command arrived on
+ * @return Length of the response written to out, 0 to send no response,
+ *         BB_RESPONSE_DEFERRED if an upstream node answers it
+ */
+size_t handle_request(bb_session* s, const uint8_t* req, size_t req_len,
+                      uint8_t* out, size_t out_cap) {
+    struct tropic_message msg;
+    struct tropic_response resp;
+    bb_deferred d;
+
+    if (tropic_is_batch(req, req_len)) {
+        return handle_batch(s, req, req_len, out, out_cap);
+    }
+
+    // Extract command structure from the wire format
+    if (tropic_decode_message(req, req_len, &msg) < 0) {
+        printf("[%s] Invalid or unsupported message\n", s->peer);
+        format_response(&resp, "ERROR: Unsupported message format", NULL, 0);
+        return tropic_encode_response(&resp, out, out_cap);
+    }
+    printf("[%s] Received command: %s\n", s->peer, msg.command);
+
+    bb_server_defer(&server, s, &d);
+    if (process_keyed_command(s, &msg, &resp, &d)) return BB_RESPONSE_DEFERRED;
+
+    return tropic_encode_response(&resp, out, out_cap);
+}
+
+/**
+ * Main function - implements Bluetooth L2CAP client for TROPIC01 hardware interface
+ * This device acts as a central that:
+ * 1. Connects to every configured peripheral device via L2CAP
+ * 2. Performs a secure handshake with each of them to establish a per-session key
+ * 3. Serves encrypted commands of all sessions from one epoll loop and
+ *    executes TROPIC01 hardware operations
+ * 4. Sends encrypted responses back to the requesting peripheral
+ *
+ * Usage: central [-r|--relay relay-address] [-n|--node name] [peripheral-address ...]
+ * Addresses are transport specs (see bb_transport.h), e.g.
+ * "AA:BB:CC:DD:EE:FF@hci1", "unix:/tmp/bb.sock" or "tcp:127.0.0.1:7000".
+ * Without peripheral addresses L2CAP_SERVER_BLUETOOTH_ADDR is used.
+ * Other centrals connecting to the relay address (as to a peripheral)
+ * become upstream nodes that take a share of the stateless commands and
+ * hold a share of the key and memory slots; nodes tell each other apart by
+ * name (default: the host name).
+ */
+int
+main(int argc, char** argv)
+{
+    bb_keys keys = {public_key, private_key, remote_public_key};
+
+    if (bb_server_init(&server, &keys, handle_request) < 0) {
+        exit(1);
+    }
+
+
+    // Options: "--relay addr" lets upstream nodes connect with the
+    // peripheral's keys they expect, "--node name" names our secure element
+    int first = 1;
+    gethostname(node_name, sizeof(node_name) - 1);
+    while (first + 1 < argc && argv[first][0] == '-') {
+        const char* opt = argv[first];
+        const char* value = argv[first + 1];
+
+        if (strcmp(opt, "-r") == 0 || strcmp(opt, "--relay") == 0) {
+            bb_keys relay_keys = {remote_public_key, relay_private_key, public_key};
+
+            bb_server_set_listen_keys(&server, &relay_keys);
+            if (bb_server_listen(&server, value) < 0) {
+                printf("Invalid relay address: %s\n", value);
+                exit(1);
+            }
+            printf("Relaying commands to upstream nodes connecting to %s\n", value);
+            relaying = 1;
+        } else if (strcmp(opt, "-n") == 0 || strcmp(opt, "--node") == 0) {
+            snprintf(node_name, sizeof(node_name), "%s", value);
+        } else {
+            break;
+        }
+        first += 2;
+    }
+    if (relaying) {
+        routes_load();
+    }
+
+    // Tell peripherals which commands we handle, they check before sending;
+    // relays learn which node we are
+    uint8_t caps[TROPIC_CAPS_LEN + TROPIC_NODE_NAME_LEN];
+    bb_server_set_caps(&server, caps,
+                       tropic_encode_caps(TROPIC_OPS_TROPIC01, node_name, caps, sizeof(caps)));
+
+    // One session per peripheral, each with its own handshake and key;
+    // "addr|addr|..." races alternative addresses of one peripheral
+    for (int i = first; i < argc; i++) {
+        printf("Start client, server addr %s\n", argv[i]);
+        if (bb_server_add_race(&server, argv[i]) < 0) {
+            printf("Invalid peripheral address: %s\n", argv[i]);
+            exit(1);
+        }
+    }
+    if (first >= argc) {
+        printf("Start Bluetooth L2CAP client, server addr %s\n",
+               L2CAP_SERVER_BLUETOOTH_ADDR);
+        bb_server_add_peer(&server, "l2cap:" L2CAP_SERVER_BLUETOOTH_ADDR);
+    }
+
+    // Serve commands of all peripherals; reconnects are handled by the server
+    printf("Central: Waiting for commands...\n");
+    return bb_server_run(&server) < 0 ? 1 : 0;
 }
\ No newline at end of file
@@ -0,0 +1,517 @@
+#include <stdlib.h>
+#include "tropic_simple.h"
+
+// Arguments a command takes after its name
+#define ARG_COUNT 0x01  // "<count>"
+#define ARG_SLOT 0x02   // "<slot>"
+#define ARG_DATA 0x04   // "<slot> <data>", data is the rest of the line
+
+static const struct {
+    const char* name;
+    uint8_t opcode;
+    uint8_t args;
+} commands[] = {
+    {"random", TROPIC_OP_RANDOM, ARG_COUNT},
+    {"ecc-gen", TROPIC_OP_ECC_GEN, ARG_SLOT},
+    {"ecc-download", TROPIC_OP_ECC_DOWNLOAD, ARG_SLOT},
+    {"ecc-clear", TROPIC_OP_ECC_CLEAR, ARG_SLOT},
+    {"ecc-sign", TROPIC_OP_ECC_SIGN, ARG_SLOT | ARG_DATA},
+    {"mem-store", TROPIC_OP_MEM_STORE, ARG_SLOT | ARG_DATA},
+    {"mem-read", TROPIC_OP_MEM_READ, ARG_SLOT},
+    {"mem-erase", TROPIC_OP_MEM_ERASE, ARG_SLOT},
+    {"corev_random", TROPIC_OP_COREV_RANDOM, ARG_COUNT},
+    {"subscribe", TROPIC_OP_SUBSCRIBE, ARG_SLOT},
+    {"unsubscribe", TROPIC_OP_UNSUBSCRIBE, ARG_SLOT},
+};
+
+#define NUM_COMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+static size_t put_tlv(uint8_t* out, size_t pos, size_t cap, uint8_t tag,
+                      const void* value, size_t len)
+{
+    if (pos == 0 || len > 0xffff || pos + 3 + len > cap) return 0;
+
+    out[pos] = tag;
+    out[pos + 1] = (uint8_t)(len >> 8);
+    out[pos + 2] = (uint8_t)len;
+    memcpy(out + pos + 3, value, len);
+    return pos + 3 + len;
+}
+
+/**
+ * Step to the next TLV of an encoded message
+ *
+ * @return 1 if a TLV was read, 0 at the end, -1 if it overruns the message
+ */
+static int next_tlv(const uint8_t* in, size_t len, size_t* pos, uint8_t* tag,
+                    const uint8_t** value, size_t* value_len)
+{
+    if (*pos == len) return 0;
+    if (*pos + 3 > len) return -1;
+
+    *tag = in[*pos];
+    *value_len = ((size_t)in[*pos + 1] << 8) | in[*pos + 2];
+    if (*pos + 3 + *value_len > len) return -1;
+
+    *value = in + *pos + 3;
+    *pos += 3 + *value_len;
+    return 1;
+}
+
+/**
+ * Parse a decimal argument in range 0..255 ending at a space or the end
+ *
+ * @return Value, -1 if the argument is not such a number
+ */
+static int parse_byte(const char* str, const char** end)
+{
+    char* stop;
+
+    if (*str < '0' || *str > '9') return -1;
+    long value = strtol(str, &stop, 10);
+    if (value > 255 || (*stop != '\0' && *stop != ' ')) return -1;
+
+    *end = stop;
+    return (int)value;
+}
+
+size_t tropic_encode_message(const struct tropic_message* msg, uint8_t* out, size_t cap)
+{
+    const char* args = strchr(msg->command, ' ');
+    size_t name_len = args ? (size_t)(args - msg->command) : strlen(msg->command);
+    size_t pos = 0;
+
+    if (cap < 2) return 0;
+    out[0] = TROPIC_WIRE_VERSION;
+    out[1] = TROPIC_OP_TEXT;
+    pos = 2;
+
+    for (size_t i = 0; args && i < NUM_COMMANDS; i++) {
+        if (strlen(commands[i].name) != name_len ||
+            strncmp(msg->command, commands[i].name, name_len) != 0) {
+            continue;
+        }
+
+        // Arguments the opcode cannot carry keep the text form, so the
+        // central reports the same errors it would for the typed command
+        const char* end;
+        int value = parse_byte(args + 1, &end);
+        if (value < 0) break;
+        if ((commands[i].args & ARG_DATA) && *end != ' ') break;
+        if (!(commands[i].args & ARG_DATA) && *end != '\0') break;
+
+        uint8_t byte = (uint8_t)value;
+        out[1] = commands[i].opcode;
+        pos = put_tlv(out, pos, cap, commands[i].args & ARG_COUNT ? TROPIC_TAG_COUNT : TROPIC_TAG_SLOT,
+                      &byte, 1);
+        if (commands[i].args & ARG_DATA) {
+            pos = put_tlv(out, pos, cap, TROPIC_TAG_ARG, end + 1, strlen(end + 1));
+        }
+        break;
+    }
+
+    if (out[1] == TROPIC_OP_TEXT) {
+        pos = put_tlv(out, pos, cap, TROPIC_TAG_TEXT, msg->command, strlen(msg->command));
+    }
+    if (msg->data_len > 0 && msg->data_len <= sizeof(msg->data)) {
+        pos = put_tlv(out, pos, cap, TROPIC_TAG_DATA, msg->data, msg->data_len);
+    }
+    if (msg->key) {
+        uint8_t key[8];
+        for (int i = 0; i < 8; i++) {
+            key[i] = (uint8_t)(msg->key >> (56 - 8 * i));
+        }
+        pos = put_tlv(out, pos, cap, TROPIC_TAG_KEY, key, sizeof(key));
+    }
+    return pos;
+}
+
+int tropic_decode_message(const uint8_t* in, size_t len, struct tropic_message* msg)
+{
+    const uint8_t* value;
+    size_t value_len, pos = 2;
+    uint8_t tag;
+    int byte = -1;
+    const uint8_t* arg = NULL;
+    size_t arg_len = 0;
+    int rc;
+
+    memset(msg, 0, sizeof(*msg));
+    if (len < 2 || in[0] != TROPIC_WIRE_VERSION) return -1;
+
+    while ((rc = next_tlv(in, len, &pos, &tag, &value, &value_len)) > 0) {
+        switch (tag) {
+        case TROPIC_TAG_TEXT:
+            if (value_len >= sizeof(msg->command)) return -1;
+            memcpy(msg->command, value, value_len);
+            break;
+        case TROPIC_TAG_SLOT:
+        case TROPIC_TAG_COUNT:
+            if (value_len != 1) return -1;
+            byte = value[0];
+            break;
+        case TROPIC_TAG_ARG:
+            arg = value;
+            arg_len = value_len;
+            break;
+        case TROPIC_TAG_DATA:
+            if (value_len > sizeof(msg->data)) return -1;
+            memcpy(msg->data, value, value_len);
+            msg->data_len = value_len;
+            break;
+        case TROPIC_TAG_KEY:
+            if (value_len != 8) return -1;
+            for (int i = 0; i < 8; i++) {
+                msg->key = (msg->key << 8) | value[i];
+            }
+            break;
+        default:
+            // Unknown tags are skipped, newer peers may add fields
+            break;
+        }
+    }
+    if (rc < 0) return -1;
+    if (in[1] == TROPIC_OP_TEXT) return 0;
+
+    // Rebuild the command string the central dispatches on
+    for (size_t i = 0; i < NUM_COMMANDS; i++) {
+        if (commands[i].opcode != in[1]) continue;
+        if (byte < 0 || ((commands[i].args & ARG_DATA) && !arg)) return -1;
+
+        int n = snprintf(msg->command, sizeof(msg->command), "%s %d", commands[i].name, byte);
+        if (arg) {
+            if (n + 1 + arg_len >= sizeof(msg->command)) return -1;
+            msg->command[n] = ' ';
+            memcpy(msg->command + n + 1, arg, arg_len);
+        }
+        return 0;
+    }
+    return -1;
+}
+
+size_t tropic_encode_response(const struct tropic_response* resp, uint8_t* out, size_t cap)
+{
+    size_t pos;
+
+    if (cap < 1) return 0;
+    out[0] = TROPIC_WIRE_VERSION;
+    pos = put_tlv(out, 1, cap, TROPIC_TAG_STATUS, resp->status,
+                  strnlen(resp->status, sizeof(resp->status)));
+    if (resp->data_len > 0 && resp->data_len <= sizeof(resp->data)) {
+        pos = put_tlv(out, pos, cap, TROPIC_TAG_DATA, resp->data, resp->data_len);
+    }
+    return pos;
+}
+
+int tropic_decode_response(const uint8_t* in, size_t len, struct tropic_response* resp)
+{
+    const uint8_t* value;
+    size_t value_len, pos = 1;
+    uint8_t tag;
+    int rc;
+
+    memset(resp, 0, sizeof(*resp));
+    if (len < 1 || in[0] != TROPIC_WIRE_VERSION) return -1;
+
+    while ((rc = next_tlv(in, len, &pos, &tag, &value, &value_len)) > 0) {
+        if (tag == TROPIC_TAG_STATUS) {
+            if (value_len >= sizeof(resp->status)) return -1;
+            memcpy(resp->status, value, value_len);
+        } else if (tag == TROPIC_TAG_DATA) {
+            if (value_len > sizeof(resp->data)) return -1;
+            memcpy(resp->data, value, value_len);
+            resp->data_len = value_len;
+        }
+    }
+    return rc < 0 ? -1 : 0;
+}
+
+size_t tropic_batch_begin(uint8_t* out, size_t cap)
+{
+    if (cap < 2) return 0;
+    out[0] = TROPIC_WIRE_VERSION;
+    out[1] = TROPIC_OP_BATCH;
+    return 2;
+}
+
+/**
+ * Wrap the len bytes encoded at out + pos + 3 into an ITEM TLV
+ */
+static size_t batch_close_item(uint8_t* out, size_t pos, size_t len)
+{
+    if (len == 0 || len > 0xffff) return 0;
+
+    out[pos] = TROPIC_TAG_ITEM;
+    out[pos + 1] = (uint8_t)(len >> 8);
+    out[pos + 2] = (uint8_t)len;
+    return pos + 3 + len;
+}
+
+size_t tropic_batch_add_message(uint8_t* out, size_t pos, size_t cap,
+                                const struct tropic_message* msg)
+{
+    if (pos == 0 || pos + 3 > cap) return 0;
+    return batch_close_item(out, pos, tropic_encode_message(msg, out + pos + 3, cap - pos - 3));
+}
+
+size_t tropic_batch_add_response(uint8_t* out, size_t pos, size_t cap,
+                                 const struct tropic_response* resp)
+{
+    if (pos == 0 || pos + 3 > cap) return 0;
+    return batch_close_item(out, pos, tropic_encode_response(resp, out + pos + 3, cap - pos - 3));
+}
+
+int tropic_is_batch(const uint8_t* in, size_t len)
+{
+    return len >= 2 && in[0] == TROPIC_WIRE_VERSION && in[1] == TROPIC_OP_BATCH;
+}
+
+int tropic_batch_next(const uint8_t* in, size_t len, size_t* pos,
+                      const uint8_t** item, size_t* item_len)
+{
+    uint8_t tag;
+    int rc;
+
+    if (*pos == 0) {
+        if (!tropic_is_batch(in, len)) return -1;
+        *pos = 2;
+    }
+
+    // Skip tags a newer peer may add next to the items
+    while ((rc = next_tlv(in, len, pos, &tag, item, item_len)) > 0) {
+        if (tag == TROPIC_TAG_ITEM) return 1;
+    }
+    return rc;
+}
+
+size_t tropic_encode_caps(uint16_t opcodes, const char* node, uint8_t* out, size_t cap)
+{
+    size_t node_len = node ? strlen(node) : 0;
+
+    if (node_len >= TROPIC_NODE_NAME_LEN || cap < TROPIC_CAPS_LEN + node_len) return 0;
+
+    out[0] = TROPIC_WIRE_VERSION;
+    out[1] = (uint8_t)(opcodes >> 8);
+    out[2] = (uint8_t)opcodes;
+    out[3] = TROPIC_BATCH_MAX;
+    memcpy(out + TROPIC_CAPS_LEN, node, node_len);
+    return TROPIC_CAPS_LEN + node_len;
+}
+
+int tropic_decode_caps(const uint8_t* in, size_t len, struct tropic_caps* caps)
+{
+    // The node name follows the fields of the first version
+    if (len < TROPIC_CAPS_LEN || in[0] == 0) return -1;
+
+    caps->version = in[0];
+    caps->opcodes = (uint16_t)((in[1] << 8) | in[2]);
+    caps->batch_max = in[3];
+
+    size_t node_len = len - TROPIC_CAPS_LEN;
+    if (node_len >= TROPIC_NODE_NAME_LEN) return -1;
+    memcpy(caps->node, in + TROPIC_CAPS_LEN, node_len);
+    caps->node[node_len] = '\0';
+    return 0;
+}
+
+int tropic_caps_supports(const struct tropic_caps* caps, const uint8_t* req, size_t len)
+{
+    if (len < 2 || req[0] > caps->version || req[1] >= 16 ||
+        !(caps->opcodes & TROPIC_OP_BIT(req[1]))) {
+        return 0;
+    }
+    if (!tropic_is_batch(req, len)) return 1;
+
+    const uint8_t* item;
+    size_t pos = 0, item_len;
+    int count = 0, rc;
+
+    while ((rc = tropic_batch_next(req, len, &pos, &item, &item_len)) > 0) {
+        if (++count > caps->batch_max || !tropic_caps_supports(caps, item, item_len)) return 0;
+    }
+    return rc == 0;
+}
+
+const struct tropic_response* tropic_cache_get(const struct tropic_cache* cache,
+                                               const char* scope,
+                                               const struct tropic_message* msg,
+                                               uint64_t now_ms)
+{
+    if (msg->key == 0) return NULL;
+
+    for (int i = 0; i < TROPIC_CACHE_SIZE; i++) {
+        const struct tropic_cache_entry* e = &cache->entries[i];
+        if (e->key == msg->key && e->expires_ms > now_ms && strcmp(e->scope, scope) == 0 &&
+            strcmp(e->command, msg->command) == 0) {
+            return &e->resp;
+        }
+    }
+    return NULL;
+}
+
+void tropic_cache_put(struct tropic_cache* cache, const char* scope,
+                      const struct tropic_message* msg, const struct tropic_response* resp,
+                      uint64_t now_ms)
+{
+    struct tropic_cache_entry* e = &cache->entries[0];
+
+    if (msg->key == 0) return;
+
+    // Unused and expired entries have the earliest expiry of all
+    for (int i = 1; i < TROPIC_CACHE_SIZE && e->key != 0; i++) {
+        if (cache->entries[i].key == 0 || cache->entries[i].expires_ms < e->expires_ms) {
+            e = &cache->entries[i];
+        }
+    }
+
+    snprintf(e->scope, sizeof(e->scope), "%s", scope);
+    snprintf(e->command, sizeof(e->command), "%s", msg->command);
+    e->key = msg->key;
+    e->expires_ms = now_ms + TROPIC_CACHE_TTL_MS;
+    e->resp = *resp;
+}
+
+int tropic_slot_command(const char* command, uint16_t* slot, int* effect)
+{
+    const char* args = strchr(command, ' ');
+    size_t name_len = args ? (size_t)(args - command) : 0;
+    char* end;
+
+    for (size_t i = 0; args && i < NUM_COMMANDS; i++) {
+        if (!(commands[i].args & ARG_SLOT) || strlen(commands[i].name) != name_len ||
+            strncmp(command, commands[i].name, name_len) != 0) {
+            continue;
+        }
+
+        int kind, op = commands[i].opcode;
+        if (op >= TROPIC_OP_ECC_GEN && op <= TROPIC_OP_ECC_SIGN) {
+            kind = TROPIC_SLOT_ECC;
+        } else if (op >= TROPIC_OP_MEM_STORE && op <= TROPIC_OP_MEM_ERASE) {
+            kind = TROPIC_SLOT_MEM;
+        } else {
+            return -1;
+        }
+
+        if (args[1] < '0' || args[1] > '9') return -1;
+        long value = strtol(args + 1, &end, 10);
+        if (value > 0xffff || (*end != '\0' && *end != ' ')) return -1;
+
+        *slot = (uint16_t)value;
+        *effect = op == TROPIC_OP_ECC_GEN || op == TROPIC_OP_MEM_STORE ? TROPIC_SLOT_FILL :
+                  op == TROPIC_OP_ECC_CLEAR || op == TROPIC_OP_MEM_ERASE ? TROPIC_SLOT_EMPTY :
+                  TROPIC_SLOT_USE;
+        return kind;
+    }
+    return -1;
+}
+
+int tropic_slot_rewrite(const struct tropic_message* msg, uint16_t slot,
+                        struct tropic_message* out)
+{
+    uint16_t old;
+    int effect;
+
+    if (tropic_slot_command(msg->command, &old, &effect) < 0) return -1;
+
+    // The slot number follows the first space, and ends at the next one
+    const char* args = strchr(msg->command, ' ') + 1;
+    const char* rest = args + strspn(args, "0123456789");
+    *out = *msg;
+    snprintf(out->command, sizeof(out->command), "%.*s%u%s", (int)(args - msg->command),
+             msg->command, slot, rest);
+    return 0;
+}
+
+/**
+ * Position on the ring: FNV-1a of the bytes, spread over all 32 bits
+ */
+static uint32_t ring_hash(const void* data, size_t len)
+{
+    const uint8_t* p = data;
+    uint32_t h = 2166136261u;
+
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    return h ^ (h >> 16);
+}
+
+int tropic_ring_owner(const char* const* nodes, int count, uint8_t kind, uint16_t logical)
+{
+    uint8_t key[3] = {kind, (uint8_t)(logical >> 8), (uint8_t)logical};
+    uint32_t slot = ring_hash(key, sizeof(key));
+    uint32_t best = 0;
+    int owner = -1;
+
+    // The point reached first going clockwise from the slot, the ring is
+    // small enough to walk instead of keeping it sorted
+    for (int n = 0; n < count; n++) {
+        char point[TROPIC_NODE_NAME_LEN + 8];
+        for (int i = 0; i < TROPIC_RING_POINTS; i++) {
+            int len = snprintf(point, sizeof(point), "%s#%d", nodes[n], i);
+            uint32_t distance = ring_hash(point, (size_t)len) - slot;
+            if (owner < 0 || distance < best) {
+                best = distance;
+                owner = n;
+            }
+        }
+    }
+    return owner;
+}
+
+struct tropic_route* tropic_route_find(struct tropic_routes* routes, uint8_t kind,
+                                       uint16_t logical)
+{
+    for (int i = 0; i < TROPIC_ROUTES; i++) {
+        struct tropic_route* r = &routes->entries[i];
+        if (r->node[0] != '\0' && r->kind == kind && r->logical == logical) return r;
+    }
+    return NULL;
+}
+
+struct tropic_route* tropic_route_place(struct tropic_routes* routes, uint8_t kind,
+                                        uint16_t logical, const char* node)
+{
+    int slots = kind == TROPIC_SLOT_ECC ? TROPIC_ECC_SLOTS : TROPIC_MEM_SLOTS;
+    struct tropic_route* free_entry = NULL;
+
+    if (strlen(node) >= TROPIC_NODE_NAME_LEN) return NULL;
+    for (int i = 0; i < TROPIC_ROUTES && !free_entry; i++) {
+        if (routes->entries[i].node[0] == '\0') free_entry = &routes->entries[i];
+    }
+    if (!free_entry) return NULL;
+
+    for (int physical = 0; physical < slots; physical++) {
+        int used = 0;
+        for (int i = 0; i < TROPIC_ROUTES && !used; i++) {
+            const struct tropic_route* r = &routes->entries[i];
+            used = r->node[0] != '\0' && r->kind == kind && r->physical == physical &&
+                   strcmp(r->node, node) == 0;
+        }
+        if (used) continue;
+
+        snprintf(free_entry->node, sizeof(free_entry->node), "%s", node);
+        free_entry->kind = kind;
+        free_entry->logical = logical;
+        free_entry->physical = (uint16_t)physical;
+        free_entry->unknown = 0;
+        return free_entry;
+    }
+    return NULL;
+}
+
+void tropic_route_drop(struct tropic_route* route)
+{
+    memset(route, 0, sizeof(*route));
+}
+
+void tropic_slot_probe(const struct tropic_route* route, struct tropic_message* out)
+{
+    memset(out, 0, sizeof(*out));
+    snprintf(out->command, sizeof(out->command), "%s %u",
+             route->kind == TROPIC_SLOT_ECC ? "ecc-download" : "mem-read", route->physical);
+}
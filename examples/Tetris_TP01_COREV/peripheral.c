@@ -8,8 +8,7 @@
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/l2cap.h>
 #include "bbstate.h"
-#include <bluetooth/hci.h>     // For HCI functions
-#include <bluetooth/hci_lib.h> // For HCI functions
+#include "bb_server.h"
 #include "tropic_simple.h"
 #include <ncurses.h>
 #include <sys/time.h>
@@ -18,6 +17,9 @@
 /* L2CAP server channel - must match client configuration */
 #define L2CAP_SERVER_PORT_NUM 0x0235
 
+// Resumption tickets from centrals, kept across restarts
+#define TICKET_FILE "bb_tickets.bin"
+
 #define ROWS 20
 #define COLS 15
 #define TRUE 1
@@ -40,8 +42,8 @@ static uint8_t remote_public_key[32] = {
     0x70, 0xdf, 0xe9, 0x44, 0x98, 0x5f, 0x31, 0xe9, 0x54, 0x77, 0x7e,
     0xb9, 0xba, 0xd6, 0x3d, 0xa0, 0xec, 0xf7, 0x4f, 0x6f, 0x61};
 
-// Global state for the secure communication session
-static bbstate state;
+// Sessions with all connected central devices
+static bb_server server;
 
 // Random number generation mode
 typedef enum {
@@ -75,14 +77,43 @@ const Shape ShapesArray[7]= {
     {(char *[]){(char []){0,0,0,0}, (char []){1,1,1,1}, (char []){0,0,0,0}, (char []){0,0,0,0}}, 4} //long bar shape
 };
 
+// Random bytes are fetched ahead of time with pipelined requests, so a
+// new shape rarely has to wait for a radio round trip
+#define RNG_POOL_SIZE 64
+#define RNG_CHUNK 16            // Random bytes asked for per request
+#define RNG_TIMEOUT_MS 5000     // Wait this long for the first shape, later ones never wait
+
+// A lost link or centrals that stop answering pause the game until random
+// bytes arrive again; only a stall this long ends it
+#define LINK_GIVE_UP_MS 60000
+
+// Link to the centrals as seen by the game
+typedef enum {
+    LINK_UP,          // At least one session is established
+    LINK_RECOVERING   // All sessions lost, waiting for a central to reconnect
+} tetris_link_state;
+
 // BB Protocol random number generator context
 typedef struct {
-    int socket;
-    bbstate* state;
+    bb_server* server;
+    uint8_t pool[RNG_POOL_SIZE]; // Received, not yet used random bytes
+    size_t pool_len;
+    int inflight;                // Requests sent, response not yet received
+    int lost;                    // Requests failed with their session, to be sent again
+    int replayed;                // Requests sent again after the last outage
+    tetris_link_state link;
+    uint64_t lost_ms;            // Start of the current outage
+    uint64_t recovery_ms;        // Length of the last outage, 0 if none yet
+    int resumed;                 // Last recovery used session resumption
+    uint64_t stalled_ms;         // Since when the next shape waits for random bytes
+    bb_buf tx;                   // Request being sent
 } tetris_rng_ctx;
 
 static tetris_rng_ctx g_rng_ctx;
 
+// A new shape is due but its random bytes have not arrived yet
+static char ShapePending = FALSE;
+
 /**
  * Print buffer contents in hexadecimal format
  */
@@ -94,41 +125,113 @@ void print_buf(void* buf, size_t buf_len) {
     printf("\n");
 }
 
+/**
+ * Add the random bytes of one response to the pool
+ */
+static void rng_on_response(bb_session* s, uint32_t id, void* arg,
+                            const uint8_t* data, ssize_t len) {
+    tetris_rng_ctx* ctx = (tetris_rng_ctx*)arg;
+    struct tropic_response resp;
+
+    ctx->inflight--;
+    if (len < 0) {
+        // Session lost before the answer came, ask the next session
+        ctx->lost++;
+        return;
+    }
+    if (tropic_decode_response(data, len, &resp) < 0) return;
+
+    size_t n = resp.data_len;
+    if (n > sizeof(ctx->pool) - ctx->pool_len) n = sizeof(ctx->pool) - ctx->pool_len;
+
+    memcpy(ctx->pool + ctx->pool_len, resp.data, n);
+    ctx->pool_len += n;
+}
+
+/**
+ * Keep enough requests outstanding to fill the pool
+ * Requests are spread over all connected centrals
+ */
+static void rng_refill(tetris_rng_ctx* ctx) {
+    struct tropic_message msg = {0};
+    struct tropic_caps caps;
+
+    while (ctx->pool_len + (ctx->inflight + 1) * RNG_CHUNK <= sizeof(ctx->pool)) {
+        bb_session* session = bb_server_ready_session(ctx->server, BB_CHANNEL_INTERACTIVE);
+        if (!session) break;
+
+        // Use the selected random number generation mode; a central that
+        // announced no CORE-V support gets TROPIC01 requests instead
+        int corev = g_rng_mode == RNG_MODE_COREV;
+        if (corev && tropic_decode_caps(session->peer_caps.app, session->peer_caps.app_len,
+                                        &caps) == 0 &&
+            !(caps.opcodes & TROPIC_OP_BIT(TROPIC_OP_COREV_RANDOM))) {
+            corev = 0;
+        }
+        snprintf(msg.command, sizeof(msg.command), "%s %d", corev ? "corev_random" : "random",
+                 RNG_CHUNK);
+
+        // Encoded straight into the send buffer, encryption then runs in place
+        size_t len = tropic_encode_message(&msg, BB_BUF_PAYLOAD(&ctx->tx), BB_MAX_MESSAGE);
+        if (!bb_server_request_buf(ctx->server, session, BB_CHANNEL_INTERACTIVE, &ctx->tx, len,
+                                   rng_on_response, ctx)) {
+            // Window full or session dropped, try again on the next call
+            break;
+        }
+        ctx->inflight++;
+        if (ctx->lost > 0) {
+            ctx->lost--;
+            ctx->replayed++;
+        }
+    }
+}
+
+/**
+ * Track the link to the centrals
+ * When the last session drops the game keeps running; bb_server accepts
+ * the reconnecting central, which resumes its session from a ticket or
+ * runs a full handshake, and the random requests lost with the old
+ * session are sent again on the new one
+ */
+static void link_update(tetris_rng_ctx* ctx) {
+    bb_session* s = bb_server_any_session(ctx->server);
+
+    if (ctx->link == LINK_UP && !s) {
+        ctx->link = LINK_RECOVERING;
+        ctx->lost_ms = bb_now_ms();
+        ctx->replayed = 0;
+    } else if (ctx->link == LINK_RECOVERING && s) {
+        ctx->link = LINK_UP;
+        ctx->recovery_ms = bb_now_ms() - ctx->lost_ms;
+        ctx->resumed = s->resumed;
+        rng_refill(ctx);
+    }
+}
+
 /**
  * Get random bytes from central device using BB protocol
+ * Bytes come from the prefetched pool; only when it runs dry do we wait,
+ * for at most wait_ms, for the outstanding responses
  * Returns 0 on success, -1 on failure
  */
-static int get_random_bytes_from_central(tetris_rng_ctx* ctx, uint8_t* out, uint8_t count) {
-    struct tropic_message msg = {0};
-    struct tropic_response resp = {0};
-    uint8_t encrypted_msg[2048];
-    uint8_t decrypted_resp[2048];
-    
-    // Use the selected random number generation mode
-    if (g_rng_mode == RNG_MODE_TROPIC) {
-        snprintf(msg.command, sizeof(msg.command), "random %d", count);
-    } else {
-        snprintf(msg.command, sizeof(msg.command), "corev_random %d", count);
+static int get_random_bytes_from_central(tetris_rng_ctx* ctx, uint8_t* out, uint8_t count,
+                                         uint32_t wait_ms) {
+    uint64_t deadline = bb_now_ms() + wait_ms;
+
+    while (ctx->pool_len < count) {
+        rng_refill(ctx);
+        link_update(ctx);
+        if (ctx->link != LINK_UP) return -1;
+        if (bb_now_ms() >= deadline) return -1;
+        if (bb_server_poll(ctx->server, BB_SERVER_TICK_MS) < 0) return -1;
     }
-    msg.data_len = 0;
-    
-    // Encrypt and send using BB protocol
-    size_t enc_len = aead_encrypt(encrypted_msg, ctx->state->key, ctx->state->counter++,
-                                 NULL, 0, (uint8_t*)&msg, sizeof(msg));
-    if (send(ctx->socket, encrypted_msg, enc_len, 0) <= 0) return -1;
-    
-    // Receive and decrypt using BB protocol
-    ssize_t recv_len = recv(ctx->socket, encrypted_msg, sizeof(encrypted_msg), 0);
-    if (recv_len <= 0) return -1;
-    
-    size_t dec_len = aead_decrypt(decrypted_resp, ctx->state->key, ctx->state->counter++,
-                                 NULL, 0, encrypted_msg, recv_len);
-    if (dec_len < sizeof(resp)) return -1;
-    
-    memcpy(&resp, decrypted_resp, sizeof(resp));
-    if (resp.data_len < count) return -1;
-    
-    memcpy(out, resp.data, count);
+
+    memcpy(out, ctx->pool, count);
+    ctx->pool_len -= count;
+    memmove(ctx->pool, ctx->pool + count, ctx->pool_len);
+
+    // Fetch the next bytes while the player moves this shape
+    rng_refill(ctx);
     return 0;
 }
 
@@ -174,11 +277,16 @@ int CheckPosition(Shape shape) {
 void SetNewRandomShape() {
     uint8_t rbytes[2];
     // Strictly use BB protocol for randomness - no fallback
-    if (get_random_bytes_from_central(&g_rng_ctx, rbytes, 2) != 0) {
-        printf("Failed to get random bytes from central device\n");
-        GameOn = FALSE;
+    // Only the first shape waits for the centrals; the game loop retries a
+    // stalled shape from the pool on every pass without blocking the screen
+    uint32_t wait_ms = current.array || ShapePending ? 0 : RNG_TIMEOUT_MS;
+    if (get_random_bytes_from_central(&g_rng_ctx, rbytes, 2, wait_ms) != 0) {
+        // Retried from the game loop; the stall counts from the first failure
+        if (!ShapePending) g_rng_ctx.stalled_ms = bb_now_ms();
+        ShapePending = TRUE;
         return;
-    }    
+    }
+    ShapePending = FALSE;    
     memcpy(&glob_rbytes, rbytes, sizeof(glob_rbytes));
     Shape new_shape = CopyShape(ShapesArray[rbytes[0] % 7]);
     new_shape.col = rbytes[1] % (COLS-new_shape.width+1);
@@ -256,6 +364,17 @@ void PrintTable() {
         printw("\n");
     }
     printw("\nScore: %d\n", score);
+    if (g_rng_ctx.link == LINK_RECOVERING) {
+        printw("Link lost, reconnecting... %llu s\n",
+               (unsigned long long)((bb_now_ms() - g_rng_ctx.lost_ms) / 1000));
+    } else if (ShapePending) {
+        printw("Waiting for random bytes... %llu s\n",
+               (unsigned long long)((bb_now_ms() - g_rng_ctx.stalled_ms) / 1000));
+    } else if (g_rng_ctx.recovery_ms) {
+        printw("Link recovered in %llu ms (%s), %d request(s) replayed\n",
+               (unsigned long long)g_rng_ctx.recovery_ms,
+               g_rng_ctx.resumed ? "resumed" : "full handshake", g_rng_ctx.replayed);
+    }
     printw("Random: %02x %02x\n", glob_rbytes[0], glob_rbytes[1]);
 }
 
@@ -306,6 +425,8 @@ void print_usage(const char* program_name) {
     printf("Options:\n");
     printf("  -c, --corev     Use CORE-V random number generation (default)\n");
     printf("  -t, --tropic    Use TROPIC01 hardware random number generation\n");
+    printf("  -l, --listen <addr>  Listen address (default l2cap:hci0),\n");
+    printf("                  e.g. l2cap:hci1, unix:/tmp/bb.sock, tcp::7000\n");
     printf("  -h, --help      Show this help message\n\n");
     printf("Controls:\n");
     printf("  w - Rotate piece\n");
@@ -318,24 +439,20 @@ void print_usage(const char* program_name) {
  * Main function - implements Bluetooth L2CAP server for Tetris
  */
 int main(int argc, char** argv) {
-    struct sockaddr_l2 loc_addr = {0}, rem_addr = {0};
-    uint8_t buffer[128] = {0};
-    int server_socket, client_socket, bytes_read;
-    unsigned int opt = sizeof(rem_addr);
-
-    bdaddr_t local_bdaddr = {0};
-    int dev_id = 0;
+    const char* listen_spec = "l2cap:hci0"; // First Bluetooth adapter by default
+    bb_keys keys = {public_key, private_key, remote_public_key};
 
     // Parse command line arguments
     static struct option long_options[] = {
         {"corev",   no_argument, 0, 'c'},
         {"tropic",  no_argument, 0, 't'},
+        {"listen",  required_argument, 0, 'l'},
         {"help",    no_argument, 0, 'h'},
         {0, 0, 0, 0}
     };
 
     int opt_char, option_index = 0;
-    while ((opt_char = getopt_long(argc, argv, "cth", long_options, &option_index)) != -1) {
+    while ((opt_char = getopt_long(argc, argv, "ctl:h", long_options, &option_index)) != -1) {
         switch (opt_char) {
             case 'c':
                 g_rng_mode = RNG_MODE_COREV;
@@ -345,6 +462,9 @@ int main(int argc, char** argv) {
                 g_rng_mode = RNG_MODE_TROPIC;
                 printf("Selected: TROPIC01 hardware random number generation\n");
                 break;
+            case 'l':
+                listen_spec = optarg;
+                break;
             case 'h':
                 print_usage(argv[0]);
                 exit(0);
@@ -360,102 +480,34 @@ int main(int argc, char** argv) {
     printf("Random number source: %s\n", 
            g_rng_mode == RNG_MODE_TROPIC ? "TROPIC01 Hardware" : "CORE-V File");
 
-    // Get the local Bluetooth address of hci0 adapter
-    int hci_sock = hci_open_dev(dev_id);
-    if (hci_sock < 0) {
-        perror("failed to open HCI device hci0");
-        exit(1);
-    }
-
-    if (hci_read_bd_addr(hci_sock, &local_bdaddr, 0) < 0) {
-        perror("failed to read local Bluetooth address for hci0 device");
-        close(hci_sock);
+    // Session server on the selected transport (hci0 and the L2CAP PSM by default)
+    // Every central gets its own session with isolated keys and counters
+    if (bb_server_init(&server, &keys, NULL) < 0) {
         exit(1);
     }
-
-    char local_addr_str[18];
-    ba2str(&local_bdaddr, local_addr_str);
-    printf("Using local HCI device: hci%d (%s)\n", dev_id, local_addr_str);
-
-    // Enable device discoverability
-    uint8_t param = (SCAN_PAGE | SCAN_INQUIRY);
-    if (hci_send_cmd(hci_sock, OGF_HOST_CTL, OCF_WRITE_SCAN_ENABLE, 1, &param) < 0) {
-        perror("Failed to send HCI_Write_Scan_Enable command");
-        return -1;
-    }
-    close(hci_sock);
-
-    // Create L2CAP socket for server
-    server_socket = socket(AF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
-    if (server_socket < 0) {
-        perror("failed to create socket");
-        exit(1);
-    }
-
-    // Bind socket to local Bluetooth adapter and specified port
-    loc_addr.l2_family = AF_BLUETOOTH;
-    bacpy(&loc_addr.l2_bdaddr, &local_bdaddr);
-    loc_addr.l2_psm = htobs(L2CAP_SERVER_PORT_NUM);
+    bb_server_set_ticket_file(&server, TICKET_FILE);
 
     printf("Binding to Bluetooth address...\n");
-    if (bind(server_socket, (struct sockaddr*)&loc_addr, sizeof(loc_addr)) < 0) {
-        perror("failed to bind");
-        close(server_socket);
+    if (bb_server_listen(&server, listen_spec) < 0) {
         exit(1);
     }
 
+    // Wait until the first central completes its handshake
     printf("Listening for central device...\n");
-    listen(server_socket, 2);
-
-    // Accept connection from central device
-    client_socket = accept(server_socket, (struct sockaddr*)&rem_addr, &opt);
-    if (client_socket < 0) {
-        perror("accept");
-        close(server_socket);
-        return client_socket;
-    }
-
-    // Display connected client information
-    char buf[18];
-    ba2str(&rem_addr.l2_bdaddr, buf);
-    printf("Connected from %s\n", buf);
-
-    // Initialize secure session state as peripheral device
-    bbstate_init(&state, BB_ROLE_PERIPHERAL, public_key, private_key,
-                 remote_public_key, NULL);
-
-    // Receive handshake initiation from central device
-    bytes_read = recv(client_socket, buffer, sizeof(struct bb_session_start_req), 0);
-    if (bytes_read <= 0) {
-        perror("Error handshake initiation\n");
-        close(client_socket);
-        close(server_socket);
-        exit(1);
-    }
-
-    // Process the received handshake request
-    bb_session_start_rx(&state, buffer);
-
-    // Prepare handshake response
-    bb_session_start_rsp(&state, buffer);
-
-    // Send handshake response to complete key exchange
-    int rc = send(client_socket, buffer, sizeof(struct bb_session_start_req), 0);
-    if (rc <= 0) {
-        perror("Error sending");
-        close(client_socket);
-        close(server_socket);
-        exit(1);
+    while (!bb_server_any_session(&server)) {
+        if (bb_server_poll(&server, BB_SERVER_TICK_MS) < 0) {
+            bb_server_close(&server);
+            exit(1);
+        }
     }
-
-    // Handshake complete
     printf("BB Protocol handshake complete\n");
-    printf("Session key: ");
-    print_buf(state.key, 32);
 
     // Set up RNG context for Tetris
-    g_rng_ctx.socket = client_socket;
-    g_rng_ctx.state = &state;
+    g_rng_ctx.server = &server;
+
+    // Further centrals are accepted while playing; keep their
+    // connection messages off the ncurses screen
+    server.log = NULL;
 
     // Initialize Tetris game
     printf("Starting Tetris with random numbers...\n");
@@ -469,6 +521,29 @@ int main(int argc, char** argv) {
     
     // Main Tetris game loop
     while(GameOn) {
+        // Accept new centrals and notice disconnects without blocking the game
+        bb_server_poll(&server, 0);
+        tetris_link_state link = g_rng_ctx.link;
+        link_update(&g_rng_ctx);
+
+        if (ShapePending) {
+            // Hold the game until the next shape's random bytes arrive,
+            // whether the link is down or the centrals do not answer
+            if (g_rng_ctx.link == LINK_UP) {
+                SetNewRandomShape();
+                gettimeofday(&before_now, NULL);
+            }
+            if (ShapePending && bb_now_ms() - g_rng_ctx.stalled_ms >= LINK_GIVE_UP_MS) {
+                GameOn = FALSE;
+                break;
+            }
+            PrintTable();
+            bb_server_poll(&server, BB_SERVER_TICK_MS);
+            continue;
+        }
+        if (link != g_rng_ctx.link) {
+            PrintTable();
+        }
         if ((c = getch()) != ERR) {
             ManipulateCurrent(c);
         }
@@ -492,10 +567,14 @@ int main(int argc, char** argv) {
         printf("\n");
     }
     printf("\nGame Over!\n");
+    if (g_rng_ctx.link == LINK_RECOVERING) {
+        printf("No central reconnected within %d s\n", LINK_GIVE_UP_MS / 1000);
+    } else if (ShapePending) {
+        printf("No random bytes arrived within %d s\n", LINK_GIVE_UP_MS / 1000);
+    }
     printf("Final Score: %d\n", score);
 
     // Cleanup connections
-    close(client_socket);
-    close(server_socket);
+    bb_server_close(&server);
     return 0;
 }
\ No newline at end of file
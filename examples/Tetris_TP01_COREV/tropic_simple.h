@@ -5,23 +5,361 @@
 #include <string.h>
 #include <stdio.h>
 
+// Largest data payload of a command or response (a full 444-byte memory
+// slot fits); the link fragments messages longer than its MTU
+#define TROPIC_DATA_MAX 1024
+
 // Simple command structure - just send the command string
 struct tropic_message {
     char command[128];  // Command string (e.g., "random 10", "ecc-gen 1")
-    uint8_t data[256];  // Optional data payload
+    uint8_t data[TROPIC_DATA_MAX];  // Optional data payload
     uint16_t data_len;  // Length of data
+    uint64_t key;       // Idempotency key, 0 for none, see tropic_cache
 };
 
 // Simple response structure
 struct tropic_response {
     char status[64];    // "OK" or "ERROR: message"
-    uint8_t data[256];  // Response data
+    uint8_t data[TROPIC_DATA_MAX];  // Response data
     uint16_t data_len;  // Length of response data
 };
 
+/*
+ * Wire format (version 1)
+ *
+ * The structures above are only the in-memory form; on the link every
+ * message is encoded with the bytes it actually uses:
+ *
+ *   request:  [version][opcode] TLV...
+ *   response: [version] TLV...
+ *   TLV:      [tag][length, 2 bytes big-endian][value]
+ *
+ * Known commands are sent as an opcode with SLOT / COUNT / DATA fields,
+ * anything else as TROPIC_OP_TEXT with the command string.
+ *
+ * A batch carries several commands in one frame, under one AEAD tag:
+ *
+ *   batch request:  [version][TROPIC_OP_BATCH] ITEM...  (each an encoded request)
+ *   batch response: [version][TROPIC_OP_BATCH] ITEM...  (each an encoded response)
+ *
+ * Responses are in request order; the central may answer fewer items if
+ * they do not fit, the missing ones count as failed.
+ */
+#define TROPIC_WIRE_VERSION 1
+
+// Largest encoded message (text command, key and full data payload plus headers)
+#define TROPIC_WIRE_MAX (2 + 3 + 128 + 3 + 8 + 3 + TROPIC_DATA_MAX)
+
+// Most commands in one batch
+#define TROPIC_BATCH_MAX 16
+
+enum tropic_opcode {
+    TROPIC_OP_TEXT = 0,         // Command string, TROPIC_TAG_TEXT
+    TROPIC_OP_RANDOM = 1,       // random <count>
+    TROPIC_OP_ECC_GEN = 2,      // ecc-gen <slot>
+    TROPIC_OP_ECC_DOWNLOAD = 3, // ecc-download <slot>
+    TROPIC_OP_ECC_CLEAR = 4,    // ecc-clear <slot>
+    TROPIC_OP_ECC_SIGN = 5,     // ecc-sign <slot> <data>
+    TROPIC_OP_MEM_STORE = 6,    // mem-store <slot> <data>
+    TROPIC_OP_MEM_READ = 7,     // mem-read <slot>
+    TROPIC_OP_MEM_ERASE = 8,    // mem-erase <slot>
+    TROPIC_OP_COREV_RANDOM = 9, // corev_random <count>
+    TROPIC_OP_BATCH = 10,       // TROPIC_TAG_ITEM per command
+    TROPIC_OP_SUBSCRIBE = 11,   // subscribe <topic>
+    TROPIC_OP_UNSUBSCRIBE = 12, // unsubscribe <topic>
+};
+
+/*
+ * Events a central pushes to subscribed peripherals as link notifications
+ * of the topic, each encoded as a response whose status describes it
+ */
+enum tropic_topic {
+    TROPIC_TOPIC_SLOTS = 0,     // A key or memory slot was changed, "ecc-gen 1: OK"
+};
+
+// Bit of an opcode in tropic_caps.opcodes
+#define TROPIC_OP_BIT(op) (1u << (op))
+
+// Opcodes every TROPIC01 central handles
+#define TROPIC_OPS_TROPIC01 \
+    (TROPIC_OP_BIT(TROPIC_OP_TEXT) | TROPIC_OP_BIT(TROPIC_OP_RANDOM) | \
+     TROPIC_OP_BIT(TROPIC_OP_ECC_GEN) | TROPIC_OP_BIT(TROPIC_OP_ECC_DOWNLOAD) | \
+     TROPIC_OP_BIT(TROPIC_OP_ECC_CLEAR) | TROPIC_OP_BIT(TROPIC_OP_ECC_SIGN) | \
+     TROPIC_OP_BIT(TROPIC_OP_MEM_STORE) | TROPIC_OP_BIT(TROPIC_OP_MEM_READ) | \
+     TROPIC_OP_BIT(TROPIC_OP_MEM_ERASE) | TROPIC_OP_BIT(TROPIC_OP_BATCH) | \
+     TROPIC_OP_BIT(TROPIC_OP_SUBSCRIBE) | TROPIC_OP_BIT(TROPIC_OP_UNSUBSCRIBE))
+
+/*
+ * Capabilities of a central, announced once per session as the
+ * application part of the link's capabilities message:
+ *
+ *   [version][opcodes, 2 bytes big-endian][largest batch][node name]
+ *
+ * A peripheral checks commands against them before sending, instead of
+ * waiting for "ERROR: Unknown command". The node name (the rest of the
+ * message, may be empty) tells a relaying central which secure element
+ * it reaches through the session, see tropic_routes.
+ */
+#define TROPIC_CAPS_LEN 4
+
+// Longest node name, terminator included
+#define TROPIC_NODE_NAME_LEN 24
+
+struct tropic_caps {
+    uint8_t version;    // Highest wire version the central decodes
+    uint16_t opcodes;   // TROPIC_OP_BIT() of each opcode it handles
+    uint8_t batch_max;  // Most commands it takes in one batch
+    char node[TROPIC_NODE_NAME_LEN]; // Its secure element node, "" if unnamed
+};
+
+enum tropic_tag {
+    TROPIC_TAG_TEXT = 1,        // Command string
+    TROPIC_TAG_SLOT = 2,        // 1 byte
+    TROPIC_TAG_COUNT = 3,       // 1 byte
+    TROPIC_TAG_ARG = 4,         // Command argument bytes (data to sign/store)
+    TROPIC_TAG_DATA = 5,        // tropic_message/tropic_response data
+    TROPIC_TAG_STATUS = 6,      // Response status string
+    TROPIC_TAG_ITEM = 7,        // One encoded request/response of a batch
+    TROPIC_TAG_KEY = 8,         // Idempotency key, 8 bytes big-endian
+};
+
+/*
+ * Responses of keyed commands, kept by the central for a while
+ *
+ * A peripheral that sends a command again after losing the link gives it
+ * the key of the first attempt. If that attempt already ran, the central
+ * answers from here instead of running the command twice, so a retried
+ * key generation or memory write changes the secure element only once.
+ */
+#define TROPIC_CACHE_SIZE 32
+#define TROPIC_CACHE_TTL_MS (5 * 60 * 1000)
+#define TROPIC_CACHE_SCOPE_LEN 64
+
+struct tropic_cache_entry {
+    char scope[TROPIC_CACHE_SCOPE_LEN]; // Peer the key belongs to
+    uint64_t key;                       // 0 when the entry is unused
+    uint64_t expires_ms;
+    char command[128];                  // Must match, guards against stray keys
+    struct tropic_response resp;
+};
+
+struct tropic_cache {
+    struct tropic_cache_entry entries[TROPIC_CACHE_SIZE];
+};
+
+/*
+ * Key and memory slots of several secure element nodes as one namespace
+ *
+ * A relaying central places each new logical slot by consistent hashing:
+ * every node owns TROPIC_RING_POINTS points on a 32-bit ring derived from
+ * its name, and a slot goes to the node of the first point at or after
+ * the slot's own hash. A node that joins only takes the slots falling just
+ * before its points, about 1/n of the new ones.
+ *
+ * Placed slots are pinned in a routing table, since a key never leaves
+ * the chip it was generated on: later commands go straight to the node
+ * recorded there, with the slot number it was given on that chip.
+ */
+#define TROPIC_RING_POINTS 16
+#define TROPIC_ECC_SLOTS 32         // Key slots of one chip
+#define TROPIC_MEM_SLOTS 512        // Data slots of one chip
+#define TROPIC_ROUTES 256           // Placed slots a central keeps track of
+
+enum tropic_slot_kind {
+    TROPIC_SLOT_ECC = 0,
+    TROPIC_SLOT_MEM = 1,
+};
+
+// What a slot command does to its slot
+enum tropic_slot_effect {
+    TROPIC_SLOT_USE = 0,        // Reads or signs, the slot must be placed
+    TROPIC_SLOT_FILL = 1,       // ecc-gen, mem-store: places the slot if it is not yet
+    TROPIC_SLOT_EMPTY = 2,      // ecc-clear, mem-erase: frees the slot on success
+};
+
+struct tropic_route {
+    char node[TROPIC_NODE_NAME_LEN]; // Owning node, "" when the entry is unused
+    uint8_t kind;                    // tropic_slot_kind
+    uint16_t logical;                // Slot number peripherals use
+    uint16_t physical;               // Slot number on the node's chip
+    uint8_t unknown;                 // 1 while it is not known whether the chip
+                                     // holds the slot, see tropic_slot_probe()
+};
+
+struct tropic_routes {
+    struct tropic_route entries[TROPIC_ROUTES];
+};
+
 // Helper functions
 void parse_command(const char* input, struct tropic_message* msg);
 void format_response(struct tropic_response* resp, const char* status, const uint8_t* data, uint16_t len);
 void print_hex(const uint8_t* data, size_t len);
 
+/**
+ * Encode a command for the link
+ *
+ * @return Encoded length, 0 if out is too small
+ */
+size_t tropic_encode_message(const struct tropic_message* msg, uint8_t* out, size_t cap);
+
+/**
+ * Decode a command received from the link
+ *
+ * @return 0 on success, -1 on a malformed message or unsupported version
+ */
+int tropic_decode_message(const uint8_t* in, size_t len, struct tropic_message* msg);
+
+/**
+ * Encode a response for the link
+ *
+ * @return Encoded length, 0 if out is too small
+ */
+size_t tropic_encode_response(const struct tropic_response* resp, uint8_t* out, size_t cap);
+
+/**
+ * Decode a response received from the link
+ *
+ * @return 0 on success, -1 on a malformed message or unsupported version
+ */
+int tropic_decode_response(const uint8_t* in, size_t len, struct tropic_response* resp);
+
+/**
+ * Start a batch request or response
+ *
+ * @return Length of the batch header, 0 if out is too small
+ */
+size_t tropic_batch_begin(uint8_t* out, size_t cap);
+
+/**
+ * Append a command to a batch request, encoded in place
+ *
+ * @param pos - Current batch length
+ * @return New batch length, 0 if the command does not fit
+ */
+size_t tropic_batch_add_message(uint8_t* out, size_t pos, size_t cap,
+                                const struct tropic_message* msg);
+
+/**
+ * Append a response to a batch response, encoded in place
+ *
+ * @return New batch length, 0 if the response does not fit
+ */
+size_t tropic_batch_add_response(uint8_t* out, size_t pos, size_t cap,
+                                 const struct tropic_response* resp);
+
+/**
+ * Check whether an encoded message is a batch
+ */
+int tropic_is_batch(const uint8_t* in, size_t len);
+
+/**
+ * Step to the next item of a batch
+ * Items are encoded requests or responses for the single-message decoders
+ *
+ * @param pos - 0 before the first call, advanced past each item
+ * @return 1 if an item was read, 0 at the end, -1 on a malformed batch
+ */
+int tropic_batch_next(const uint8_t* in, size_t len, size_t* pos,
+                      const uint8_t** item, size_t* item_len);
+
+/**
+ * Encode our capabilities: this wire version, the given opcodes,
+ * TROPIC_BATCH_MAX and the name of our node
+ *
+ * @param opcodes - TROPIC_OP_BIT() of each handled opcode
+ * @param node - Node name, shorter than TROPIC_NODE_NAME_LEN, NULL for none
+ * @return Encoded length, 0 if out is too small
+ */
+size_t tropic_encode_caps(uint16_t opcodes, const char* node, uint8_t* out, size_t cap);
+
+/**
+ * Look up the response to an earlier run of a keyed command
+ *
+ * @param scope - Peer the command came from
+ * @param now_ms - Current time, entries past their TTL are not returned
+ * @return Cached response, NULL if the command has no key or did not run
+ */
+const struct tropic_response* tropic_cache_get(const struct tropic_cache* cache,
+                                               const char* scope,
+                                               const struct tropic_message* msg,
+                                               uint64_t now_ms);
+
+/**
+ * Remember the response to a keyed command for TROPIC_CACHE_TTL_MS
+ * When the cache is full the entry closest to expiry is replaced
+ */
+void tropic_cache_put(struct tropic_cache* cache, const char* scope,
+                      const struct tropic_message* msg, const struct tropic_response* resp,
+                      uint64_t now_ms);
+
+/**
+ * Decode the capabilities a central announced
+ *
+ * @return 0 on success, -1 if none or malformed ones were announced
+ */
+int tropic_decode_caps(const uint8_t* in, size_t len, struct tropic_caps* caps);
+
+/**
+ * Check whether an encoded request, or each command of a batch, is
+ * something the announcing central handles
+ *
+ * @return 1 if supported, 0 if not
+ */
+int tropic_caps_supports(const struct tropic_caps* caps, const uint8_t* req, size_t len);
+
+/**
+ * Find the slot a key or memory command addresses
+ *
+ * @param slot - Set to the slot number
+ * @param effect - Set to what the command does to the slot, tropic_slot_effect
+ * @return tropic_slot_kind, -1 if the command addresses no slot
+ */
+int tropic_slot_command(const char* command, uint16_t* slot, int* effect);
+
+/**
+ * Rewrite a slot command for another slot number, the rest stays the same
+ *
+ * @return 0 on success, -1 if the command addresses no slot
+ */
+int tropic_slot_rewrite(const struct tropic_message* msg, uint16_t slot,
+                        struct tropic_message* out);
+
+/**
+ * Consistent hash ring: node a new logical slot is placed on
+ *
+ * @param nodes - Names of the nodes to choose from
+ * @return Index into nodes, -1 if count is 0
+ */
+int tropic_ring_owner(const char* const* nodes, int count, uint8_t kind, uint16_t logical);
+
+/**
+ * Look up where a logical slot was placed
+ *
+ * @return Route, NULL if the slot is not placed
+ */
+struct tropic_route* tropic_route_find(struct tropic_routes* routes, uint8_t kind,
+                                       uint16_t logical);
+
+/**
+ * Place a logical slot on a node, in the lowest slot of its chip no other
+ * route uses
+ *
+ * @return New route, NULL if the node's chip or the table is full
+ */
+struct tropic_route* tropic_route_place(struct tropic_routes* routes, uint8_t kind,
+                                        uint16_t logical, const char* node);
+
+/**
+ * Free a route, the slot of the node's chip can be placed again
+ */
+void tropic_route_drop(struct tropic_route* route);
+
+/**
+ * Command that finds out whether the chip holds a slot: it answers OK if
+ * the slot holds a key or data
+ * Used when the node went away before it answered a command that fills or
+ * empties the slot; the slot is neither reused nor freed until then
+ */
+void tropic_slot_probe(const struct tropic_route* route, struct tropic_message* out);
+
 #endif 
\ No newline at end of file
@@ -0,0 +1,36 @@
+#ifndef BB_KDF_H
+#define BB_KDF_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "bbstate.h"
+
+// Key derivation labels
+#define BB_KDF_RESUMPTION 1  // Session key -> resumption secret
+#define BB_KDF_RESUME_KEY 2  // Resumption secret + both nonces -> session key
+#define BB_KDF_CONFIRM 3     // Resumed session key -> key confirmation
+#define BB_KDF_KEY_C2P 4     // Session key -> key of central to peripheral frames
+#define BB_KDF_KEY_P2C 5     // Session key -> key of peripheral to central frames
+#define BB_KDF_RATCHET 6     // Direction key -> its successor, see bb_session_send()
+
+/**
+ * Derive a key from a key, a label and a fixed-length context
+ * Keyed BLAKE2b-256 over the label (8 bytes big-endian) and the context.
+ * It shares nothing with the AEAD, so a derived key never depends on which
+ * nonces the input key has encrypted under
+ *
+ * @param out - Derived key (KEY_LEN bytes), may alias key
+ * @param key - Input key (KEY_LEN bytes)
+ * @param label - One of the BB_KDF_* labels
+ * @param ctx - Context, NULL when ctx_len is 0
+ */
+void bb_kdf(uint8_t* out, const uint8_t* key, uint64_t label, const uint8_t* ctx, size_t ctx_len);
+
+/**
+ * Fill a buffer from the kernel random number generator
+ *
+ * @return 0 on success, -1 on failure
+ */
+int bb_random(void* buf, size_t len);
+
+#endif
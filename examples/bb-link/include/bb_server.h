@@ -0,0 +1,326 @@
+#ifndef BB_SERVER_H
+#define BB_SERVER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "bb_session.h"
+#include "bb_ticket.h"
+
+// Delay before reconnecting to a peer after a failed connect
+#define BB_RECONNECT_MS 2000
+
+// Delay before the first reconnect after an established session dropped,
+// most link losses are short and the peer resumes within one round trip
+#define BB_RECONNECT_FAST_MS 100
+
+// Separates the alternative addresses of one peripheral, see bb_server_add_race()
+#define BB_RACE_SEP '|'
+
+// Upper bound of one epoll_wait, so pending reconnects are not delayed
+#define BB_SERVER_TICK_MS 500
+
+// Defaults of the link timers, see bb_server_set_timeouts()
+#define BB_HEARTBEAT_MS 1000        // Idle time before we send a heartbeat
+#define BB_LINK_TIMEOUT_MS 4000     // Silence after which the peer is considered dead
+#define BB_REQUEST_TIMEOUT_MS 10000 // Time a request may wait for its response
+
+// Default coalescing budget of the bulk channel, see bb_server_set_coalescing()
+#define BB_COALESCE_US 1000
+
+// Default key ratchet interval, see bb_server_set_ratchet()
+#define BB_RATCHET_MESSAGES 65536
+#define BB_RATCHET_MS (10 * 60 * 1000)
+
+// Bulk requests waiting for the handler, across all sessions
+// Every queue slot backs one credit granted to a peer
+#define BB_BULK_QUEUE 16
+
+// Bulk credits a session is granted at most, more are granted once it
+// holds half of that or less
+#define BB_BULK_CREDITS BB_BULK_WINDOW
+
+// Returned by a request handler that answers later, see bb_server_defer()
+#define BB_RESPONSE_DEFERRED ((size_t)-1)
+
+/**
+ * Request handler called for every decrypted request of an established session
+ *
+ * @param s - Session the request arrived on
+ * @param req - Decrypted request
+ * @param req_len - Length of the request
+ * @param resp - Buffer for the plaintext response
+ * @param resp_cap - Size of the response buffer
+ * @return Length of the response to send back (tagged with the request id),
+ *         0 to send nothing, BB_RESPONSE_DEFERRED to answer with
+ *         bb_server_respond()
+ */
+typedef size_t (*bb_request_handler)(bb_session* s, const uint8_t* req, size_t req_len,
+                                     uint8_t* resp, size_t resp_cap);
+
+/**
+ * Handler called for every notification pushed by a peer
+ *
+ * @param s - Session the notification arrived on
+ * @param topic - Its topic, below BB_TOPICS
+ * @param msg - Decrypted notification
+ */
+typedef void (*bb_notify_handler)(bb_session* s, uint32_t topic, const uint8_t* msg,
+                                  size_t len);
+
+// Request answered after its handler returned, see bb_server_defer()
+typedef struct {
+    bb_session* s;               // Session to answer on
+    uint32_t generation;         // s->generation when the request arrived
+    uint8_t channel;
+    uint32_t id;
+} bb_deferred;
+
+// Bulk request received but not handled yet
+typedef struct {
+    bb_session* s;               // Session to answer on
+    uint32_t id;
+    size_t len;
+    uint8_t req[BB_MAX_MESSAGE];
+} bb_queued_request;
+
+// Event-driven server multiplexing many sessions over one epoll instance.
+// Sessions are either outgoing (central role, bb_server_add_peer) or
+// accepted from a listening socket (peripheral role, bb_server_listen).
+// Control and interactive requests are handled as soon as they arrive,
+// bulk requests are queued and handled one per bb_server_poll(), so a
+// request arriving behind a batch of slow ones does not wait for all of them.
+// Peers may only queue as many bulk requests as they were granted credits.
+typedef struct {
+    int epfd;
+    int listen_fd;               // Listening socket, -1 when not listening
+    bb_session_table sessions;
+    bb_keys keys;
+    bb_keys listen_keys;         // Keys of accepted sessions, see bb_server_set_listen_keys()
+    const bb_transport* listen_transport;  // Transport of listen_fd
+    bb_request_handler handler;  // NULL when the application only sends requests
+    bb_notify_handler notify;    // NULL when the application takes no notifications
+    FILE* log;                   // Connection events are logged here, NULL to silence
+    bb_ticket_issuer issuer;     // Central: seals tickets for our peripherals
+    bb_ticket_store tickets;     // Peripheral: tickets received from centrals
+    const char* ticket_file;     // Peripheral: where tickets are kept, NULL for memory only
+    bb_buf tx;                   // Response being sent, requests are handled one at a time
+    uint8_t serving_channel;     // Channel and id of the request being handled
+    uint32_t serving_id;
+    int races;                   // Race groups handed out so far
+    uint32_t heartbeat_ms;       // Link timers, see bb_server_set_timeouts()
+    uint32_t link_timeout_ms;
+    uint32_t request_timeout_ms;
+    uint32_t coalesce_us[BB_CHANNELS];  // Coalescing budget per channel, 0 = off
+    uint32_t ratchet_msgs;
+    uint32_t ratchet_ms;
+    uint8_t caps[BB_CAPS_APP_MAX];  // Application capabilities announced to peers
+    size_t caps_len;
+    bb_queued_request bulk[BB_BULK_QUEUE];  // Ring of queued bulk requests
+    int bulk_head;               // Oldest queued request
+    int bulk_count;
+} bb_server;
+
+/**
+ * Initialize the server and its epoll instance
+ *
+ * @return 0 on success, -1 on failure
+ */
+int bb_server_init(bb_server* srv, const bb_keys* keys, bb_request_handler handler);
+
+/**
+ * Set the link timers of all sessions
+ * Established sessions send a heartbeat after heartbeat_ms without
+ * traffic, so both sides hear from each other at least that often; a peer
+ * silent for link_timeout_ms is disconnected and its requests fail. A
+ * connect or handshake not done within link_timeout_ms fails the same way
+ * and is retried later, or leaves its race to the other addresses.
+ *
+ * @param heartbeat_ms - Heartbeat interval, 0 to send none
+ * @param link_timeout_ms - Dead peer timeout, 0 to wait for the transport
+ * @param request_timeout_ms - Deadline of new requests, 0 for none,
+ *                             see bb_session_set_deadline() for single requests
+ */
+void bb_server_set_timeouts(bb_server* srv, uint32_t heartbeat_ms, uint32_t link_timeout_ms,
+                            uint32_t request_timeout_ms);
+
+/**
+ * Let small messages of a channel wait up to budget_us for others to share
+ * a frame with, see bb_session_send_buf()
+ * On by default for the bulk channel only, where the throughput of many
+ * small requests matters more than the latency of each
+ *
+ * @param budget_us - Longest delay of a message, 0 to send every message at once
+ */
+void bb_server_set_coalescing(bb_server* srv, uint8_t channel, uint32_t budget_us);
+
+/**
+ * Use other keys for accepted sessions than for the ones we connect,
+ * e.g. to serve centrals with a peripheral identity next to our own peers
+ * By default both use the keys given to bb_server_init()
+ */
+void bb_server_set_listen_keys(bb_server* srv, const bb_keys* keys);
+
+/**
+ * Take notifications pushed by peers, see bb_server_notify()
+ * Without a handler they are logged and dropped
+ */
+void bb_server_set_notify_handler(bb_server* srv, bb_notify_handler notify);
+
+/**
+ * Set the application capabilities announced to every peer once its
+ * session is established, see bb_session_send_caps()
+ * The peer finds them in its s->peer_caps.app
+ *
+ * @return 0 on success, -1 if caps is longer than BB_CAPS_APP_MAX
+ */
+int bb_server_set_caps(bb_server* srv, const uint8_t* caps, size_t len);
+
+/**
+ * Set how often each direction of a session moves to its next key
+ * The step is a key derivation done in-band by the sender, far cheaper
+ * than a new handshake, so sessions may run indefinitely
+ *
+ * @param msgs - Messages sent under one key, 0 for no limit; keep it above
+ *               BB_REPLAY_WINDOW so late messages still find their key
+ * @param ms - Time one key is used for, 0 for no limit
+ */
+void bb_server_set_ratchet(bb_server* srv, uint32_t msgs, uint32_t ms);
+
+/**
+ * Keep resumption tickets in a file, so a restarted peripheral can still
+ * skip the full handshake; tickets saved by a previous run are loaded
+ */
+void bb_server_set_ticket_file(bb_server* srv, const char* path);
+
+/**
+ * Register a peripheral to connect to as central
+ * The connection is opened by bb_server_poll() and re-opened after a disconnect
+ *
+ * @param peer - Transport spec of the peer, see bb_transport.h
+ * @return 0 on success, -1 for an unknown transport or a full session table
+ */
+int bb_server_add_peer(bb_server* srv, const char* peer);
+
+/**
+ * Register alternative addresses of one peripheral, such as the same
+ * device through several local adapters or several devices offering the
+ * same service. All of them are connected in parallel; the first to
+ * complete its handshake wins and the others are cancelled. When the
+ * winner's session drops, all of them race again.
+ *
+ * @param spec - Transport specs separated by BB_RACE_SEP, e.g.
+ *               "l2cap:AA:BB:CC:DD:EE:FF@hci0|l2cap:AA:BB:CC:DD:EE:FF@hci1";
+ *               a single spec is the same as bb_server_add_peer()
+ * @return 0 on success, -1 for an unknown transport or a full session table
+ */
+int bb_server_add_race(bb_server* srv, const char* spec);
+
+/**
+ * Name of the peer behind a session that stays the same across reconnects
+ * All alternative addresses of a race share one name, so whatever is kept
+ * per peer is found again when a retry wins on another alternative
+ *
+ * @return First address of the session's race, else its own address
+ */
+const char* bb_server_peer_name(const bb_server* srv, const bb_session* s);
+
+/**
+ * Accept connections from centrals
+ * Every accepted connection gets its own session and handshake
+ *
+ * @param spec - Local transport spec, e.g. "l2cap:hci0" or "unix:/tmp/bb.sock"
+ * @return 0 on success, -1 on failure
+ */
+int bb_server_listen(bb_server* srv, const char* spec);
+
+/**
+ * Run one round of the event loop: start due reconnects, run the link
+ * timers of established sessions, wait up to
+ * timeout_ms for socket events and dispatch them, then handle the oldest
+ * queued bulk request; the wait is skipped while bulk requests are queued
+ *
+ * @return Number of handled events, -1 on failure
+ */
+int bb_server_poll(bb_server* srv, int timeout_ms);
+
+/**
+ * Serve all sessions until an unrecoverable error occurs
+ *
+ * @return -1 on failure (never returns otherwise)
+ */
+int bb_server_run(bb_server* srv);
+
+/**
+ * Drop the connection of a session
+ * Outgoing sessions are reconnected later, accepted ones are released
+ */
+void bb_server_disconnect(bb_server* srv, bb_session* s);
+
+/**
+ * Close every session, the listening socket and the epoll instance
+ */
+void bb_server_close(bb_server* srv);
+
+/**
+ * Send a pipelined request on an established session, see bb_session_send_request()
+ * The session is disconnected if sending fails
+ *
+ * @return Request id, 0 if the window is full or the request could not be sent
+ */
+uint32_t bb_server_request(bb_server* srv, bb_session* s, uint8_t channel,
+                           const void* req, size_t len, bb_response_cb cb, void* arg);
+
+/**
+ * bb_server_request() for a request built in BB_BUF_PAYLOAD(buf), see
+ * bb_session_send_request_buf()
+ */
+uint32_t bb_server_request_buf(bb_server* srv, bb_session* s, uint8_t channel,
+                               bb_buf* buf, size_t len, bb_response_cb cb, void* arg);
+
+/**
+ * Push a notification to every established session subscribed to a topic
+ * Sessions that fail to send are disconnected
+ *
+ * @param except - Session to leave out (typically the one that caused
+ *                 the event and hears of it in a response), NULL for none
+ * @return Number of sessions notified
+ */
+int bb_server_notify(bb_server* srv, bb_session* except, uint32_t topic,
+                     const void* msg, size_t len);
+
+/**
+ * Take the request being handled, so it can be answered after the handler
+ * returned BB_RESPONSE_DEFERRED, e.g. once another node worked on it
+ * Only valid inside the request handler
+ *
+ * @param s - Session the request arrived on
+ * @param d - Filled with what bb_server_respond() needs
+ */
+void bb_server_defer(bb_server* srv, bb_session* s, bb_deferred* d);
+
+/**
+ * Answer a deferred request
+ * The session is disconnected if sending fails
+ *
+ * @return 0 on success, -1 if the session dropped since the request
+ *         arrived (the peer resends it) or sending failed
+ */
+int bb_server_respond(bb_server* srv, const bb_deferred* d, const void* resp, size_t len);
+
+/**
+ * First established session, used by applications that talk to any peer
+ *
+ * @return Established session or NULL when none is connected
+ */
+bb_session* bb_server_any_session(bb_server* srv);
+
+/**
+ * Established session with the fewest outstanding requests
+ *
+ * @param channel - Channel of the request to send, see bb_session_window_open()
+ * @return Session with room in its window, NULL if none has
+ */
+bb_session* bb_server_ready_session(bb_server* srv, uint8_t channel);
+
+#endif
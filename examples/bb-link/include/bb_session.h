@@ -0,0 +1,467 @@
+#ifndef BB_SESSION_H
+#define BB_SESSION_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "bbstate.h"
+#include "bb_transport.h"
+
+// Maximum number of peers a single process keeps sessions with
+#define BB_MAX_SESSIONS 8
+
+// Length of a textual peer address, a transport spec such as
+// "l2cap:AA:BB:CC:DD:EE:FF@hci1#0x0235" or "tcp:host:port"
+#define BB_ADDR_STRLEN 64
+
+// Largest message exchanged after the handshake
+// Messages longer than the transport MTU are encrypted as a whole and the
+// ciphertext is sent in several frames, see bb_session_send()
+#define BB_MAX_MESSAGE 4096
+
+// Requests a session may have outstanding before a response arrives
+#define BB_WINDOW 8
+
+// Logical channels sharing one connection. Requests are answered in
+// arrival order within a channel; the central serves control and
+// interactive requests as they arrive and queues bulk ones behind them.
+#define BB_CHANNEL_CONTROL 0     // Session upkeep (tickets)
+#define BB_CHANNEL_INTERACTIVE 1 // Small requests someone is waiting on
+#define BB_CHANNEL_BULK 2        // Slow secure element work and large transfers
+#define BB_CHANNELS 3
+
+// Window slots bulk requests may take, the rest stay free so an
+// interactive request can always be sent
+#define BB_BULK_WINDOW (BB_WINDOW - 2)
+
+// Bulk requests additionally need a credit from the peer that handles
+// them: it grants credits for the queue space it holds for us and grants
+// more as it works through them (BB_FRAME_CREDIT). Control and
+// interactive requests are handled on arrival and need no credits.
+
+// Cleartext frame header: type (1 byte), channel (1 byte), request id
+// (4 bytes) and message counter (8 bytes), big-endian. The counter is the
+// nonce of the message. The header is authenticated as associated data
+// of the AEAD
+#define BB_FRAME_HDR_LEN 14
+
+// Counters a receiver still accepts below the highest one seen, so
+// messages may arrive out of order but each is accepted at most once
+#define BB_REPLAY_WINDOW 64
+
+// Frame types, a response carries the id of the request it answers
+#define BB_FRAME_REQUEST 0
+#define BB_FRAME_RESPONSE 1
+#define BB_FRAME_TICKET 2      // Resumption ticket, always id 0, once per session key
+#define BB_FRAME_CREDIT 3      // Bulk credits granted (2 bytes, big-endian), always id 0
+#define BB_FRAME_HEARTBEAT 4   // Sent on an idle link to show we are alive (1 byte), id 0
+#define BB_FRAME_BUNDLE 5      // Small messages of one channel sent together, id 0
+#define BB_FRAME_CAPS 6        // Capabilities of the sender, always id 0, once per session key
+#define BB_FRAME_NOTIFY 7      // Unsolicited event, id is its topic (below BB_TOPICS)
+
+// Notification topics a peer may subscribe to, their meaning is up to the
+// application
+#define BB_TOPICS 32
+
+// Each message in a bundle: type (1 byte), request id (4 bytes) and
+// length (2 bytes), big-endian, followed by the message
+#define BB_BUNDLE_ITEM_HDR 7
+
+// Largest message that is held back for a bundle, longer ones go out on their own
+#define BB_COALESCE_MAX 256
+
+// Version of this link protocol, announced in BB_FRAME_CAPS
+#define BB_LINK_VERSION 1
+
+// Link features a peer announces, used towards it only once announced
+#define BB_CAP_BUNDLE 0x01     // Understands BB_FRAME_BUNDLE
+#define BB_CAP_RATCHET 0x02    // Follows BB_FRAME_PHASE key steps
+#define BB_CAP_NOTIFY 0x04     // Takes BB_FRAME_NOTIFY
+#define BB_CAPS_LOCAL (BB_CAP_BUNDLE | BB_CAP_RATCHET | BB_CAP_NOTIFY)
+
+// Capabilities message: version (1 byte), features (1 byte), largest frame
+// and largest message received (2 bytes each), big-endian, followed by up
+// to BB_CAPS_APP_MAX bytes the application defines
+#define BB_CAPS_LEN 6
+#define BB_CAPS_APP_MAX 32
+
+// Set in the type byte of every fragment but the last of a message
+// Not authenticated itself: a message cut short or run together with
+// another one fails authentication as a whole
+#define BB_FRAME_MORE 0x80
+
+// Key phase of the frame, flipped by the sender each time it moves its key
+// one step along the ratchet. Part of the authenticated header
+#define BB_FRAME_PHASE 0x40
+
+// Type reported by bb_session_recv() for a fragment that did not complete a message
+#define BB_FRAME_INCOMPLETE 0xff
+
+// Fresh random contribution of each side to a resumed session key
+#define BB_RESUME_NONCE_LEN 16
+
+// Message buffer laid out as the frame it becomes: room for the header in
+// front of the payload and for the AEAD tag behind it. A message built in
+// BB_BUF_PAYLOAD() is encrypted in place and sent from here without a copy,
+// and received messages are decrypted where they landed.
+typedef struct {
+    uint8_t frame[BB_FRAME_HDR_LEN + BB_MAX_MESSAGE + TAG_LEN];
+} bb_buf;
+
+// Payload area of a bb_buf, BB_MAX_MESSAGE bytes
+#define BB_BUF_PAYLOAD(buf) ((buf)->frame + BB_FRAME_HDR_LEN)
+
+// Lifecycle of one entry in the session table
+typedef enum {
+    BB_SESSION_FREE,        // Slot unused
+    BB_SESSION_IDLE,        // Known outgoing peer, currently disconnected
+    BB_SESSION_CONNECTING,  // Non-blocking connect in progress
+    BB_SESSION_HANDSHAKE,   // Connected, bb_session_start exchange in progress
+    BB_SESSION_ESTABLISHED  // Session key derived, ready for commands
+} bb_session_status;
+
+// Pre-shared keys used for the bb_session_start handshake
+typedef struct {
+    uint8_t* public_key;
+    uint8_t* private_key;
+    uint8_t* remote_public_key;
+} bb_keys;
+
+// Capabilities announced by a peer
+typedef struct {
+    uint8_t version;             // Link version both sides speak, 0 until announced
+    uint8_t features;            // BB_CAP_* bits
+    uint16_t max_frame;          // Largest frame it receives
+    uint16_t max_message;        // Largest message it receives
+    uint8_t app[BB_CAPS_APP_MAX]; // Application capabilities
+    size_t app_len;
+} bb_caps;
+
+typedef struct bb_session bb_session;
+
+/**
+ * Completion of a pipelined request
+ *
+ * @param s - Session the request was sent on
+ * @param id - Request id returned by bb_session_send_request()
+ * @param arg - Argument given with the request
+ * @param resp - Decrypted response, NULL on failure
+ * @param len - Length of the response, -1 if the session went down or
+ *              the deadline of the request passed first
+ */
+typedef void (*bb_response_cb)(bb_session* s, uint32_t id, void* arg,
+                               const uint8_t* resp, ssize_t len);
+
+// Request waiting for its response
+typedef struct {
+    uint32_t id;                 // 0 when the slot is unused
+    uint8_t channel;             // BB_CHANNEL_* the request was sent on
+    bb_response_cb cb;
+    void* arg;
+    uint64_t sent_ms;            // For latency reporting
+    uint64_t deadline_ms;        // When the request fails unanswered, 0 for never
+} bb_pending;
+
+// One secure session with a remote peer
+struct bb_session {
+    bb_session_status status;
+    int fd;                      // Connected socket, -1 when disconnected
+    char peer[BB_ADDR_STRLEN];   // Remote address, key of the session table
+    const bb_transport* transport;  // How frames reach the peer
+    bb_io io;                    // Frames the socket did not take or deliver whole yet
+    int tx_watched;              // 1 while epoll watches the socket for room to send
+    int outgoing;                // 1 if we connect (central), 0 if accepted
+    int race;                    // Outgoing: group of alternative addresses, 0 if none
+    bbstate state;               // Keys and counters of this session only
+    uint8_t tx_key[KEY_LEN];     // Key of the frames we send
+    uint8_t rx_key[KEY_LEN];     // Key of the frames we receive
+    uint64_t tx_seq;             // Counter (nonce) of the next message we send
+    uint64_t rx_top;             // One past the highest counter received
+    uint64_t rx_window;          // Bit i set: counter rx_top - 1 - i was received
+    uint8_t rx_prev_key[KEY_LEN]; // rx_key of the previous phase, for late messages
+    uint64_t rx_phase_seq;       // Lowest counter seen under rx_key after a step
+    uint8_t rx_phase;            // BB_FRAME_PHASE of frames under rx_key
+    uint8_t tx_phase;            // BB_FRAME_PHASE of frames under tx_key
+    uint32_t tx_phase_msgs;      // Messages sent under tx_key
+    uint64_t tx_phase_ms;        // When tx_key came into use
+    uint32_t ratchet_msgs;       // Step tx_key after this many messages, 0 for never
+    uint32_t ratchet_ms;         // Step tx_key after this much time, 0 for never
+    uint32_t tx_ratchets;        // Steps taken by tx_key
+    uint32_t rx_ratchets;        // Steps taken by rx_key
+    uint64_t next_attempt_ms;    // When to retry connecting (outgoing peers)
+    uint32_t rx_frames;          // Frames received on this session
+    uint32_t tx_frames;          // Frames sent on this session
+    uint64_t last_rx_ms;         // When the last authentic message arrived
+    uint64_t last_tx_ms;         // When we last sent a message
+    int resumed;                 // 1 if the key was derived from a ticket
+    uint64_t connect_ms;         // When the connect started, it fails after link_timeout_ms
+    uint64_t handshake_ms;       // When the handshake started, for reporting
+    uint8_t resume_rms[KEY_LEN]; // Secret of the ticket we presented, then of
+                                 // this session until its ticket is issued
+    uint8_t resume_nonce[BB_RESUME_NONCE_LEN]; // Our nonce of that resumption
+    uint32_t next_id;            // Id of the next request we send
+    uint32_t request_timeout_ms; // Deadline given to new requests, 0 for none
+    int inflight;                // Used slots of pending
+    uint32_t latency_ms;         // Smoothed response time of our requests, 0 until measured
+    int bulk_inflight;           // Of those, requests on BB_CHANNEL_BULK
+    int bulk_credits;            // Bulk requests the peer still accepts from us
+    int bulk_granted;            // Bulk requests we accept from the peer, queued ones included
+    bb_pending pending[BB_WINDOW];
+    bb_buf rx;                   // Message being received, reassembled in place
+    size_t rx_len;               // Ciphertext received so far, 0 if none
+    uint8_t rx_channel;          // Channel of the last message received
+    bb_buf tx;                   // Copy of messages given to bb_session_send()
+    uint32_t coalesce_us[BB_CHANNELS]; // How long small messages may wait for a bundle, 0 = off
+    bb_buf bundle;               // Small messages waiting to go out together
+    size_t bundle_len;           // Bytes in BB_BUF_PAYLOAD(&bundle), 0 if none wait
+    int bundle_count;            // Messages in the bundle
+    uint8_t bundle_channel;      // Channel they were sent on
+    uint64_t bundle_deadline_us; // When the bundle goes out at the latest
+    uint32_t tx_bundles;         // Bundles sent
+    uint32_t tx_bundled;         // Messages sent inside them
+    bb_caps peer_caps;           // What the peer announced for this session key
+    uint32_t subscriptions;      // Bit t set: the peer wants notifications of topic t
+    uint32_t generation;         // Counts closes, tells a deferred response its request is gone
+};
+
+// Fixed-size table of sessions, keyed by peer address
+typedef struct {
+    bb_session slots[BB_MAX_SESSIONS];
+} bb_session_table;
+
+/**
+ * Monotonic clock in milliseconds, used for retry and timeout bookkeeping
+ */
+uint64_t bb_now_ms(void);
+
+/**
+ * Monotonic clock in microseconds, used for coalescing budgets
+ */
+uint64_t bb_now_us(void);
+
+/**
+ * Reset every slot of a session table to BB_SESSION_FREE
+ */
+void bb_session_table_init(bb_session_table* table);
+
+/**
+ * Find the session kept for a peer address
+ *
+ * @return Matching session or NULL when the peer is unknown
+ */
+bb_session* bb_session_table_find(bb_session_table* table, const char* peer);
+
+/**
+ * Allocate a session for a peer address (or return the existing one)
+ *
+ * @return Session in BB_SESSION_IDLE state, or NULL when the table is full
+ */
+bb_session* bb_session_table_add(bb_session_table* table, const char* peer);
+
+/**
+ * Number of sessions in BB_SESSION_ESTABLISHED state
+ */
+int bb_session_table_established(const bb_session_table* table);
+
+/**
+ * Close the socket of a session and mark it BB_SESSION_IDLE
+ * The slot stays allocated so the peer can be reconnected later
+ */
+void bb_session_close(bb_session* s);
+
+/**
+ * Close a session and give its slot back to the table
+ */
+void bb_session_release(bb_session* s);
+
+/**
+ * Derive the per-direction keys from the session key and restart both
+ * message counters, once the handshake has set state.key
+ * Each direction has its own key and counter, so both sides may send at
+ * any time without coordinating nonces.
+ */
+void bb_session_set_keys(bb_session* s);
+
+/**
+ * Encrypt the message in a buffer in place and send it
+ * A request, response or notification of at most BB_COALESCE_MAX bytes on
+ * a channel with a coalesce_us budget is copied into the session's bundle
+ * instead; the bundle goes out as one frame when the budget of its first
+ * message is used up (bb_session_flush), when it is full, or before any
+ * other message.
+ * The nonce is the number of messages sent before in this direction and is
+ * carried in the header, so requests and responses may interleave freely
+ * in both directions.
+ * After ratchet_msgs messages or ratchet_ms under tx_key, the key is first
+ * replaced by its successor (BB_KDF_RATCHET) and the old one wiped; the
+ * flipped BB_FRAME_PHASE tells the receiver to follow. No extra message or
+ * round trip is needed.
+ * A message that does not fit the transport MTU is encrypted once and
+ * its ciphertext split over several frames with the same header.
+ * The buffer holds ciphertext afterwards.
+ *
+ * @param type - BB_FRAME_REQUEST or BB_FRAME_RESPONSE
+ * @param channel - BB_CHANNEL_*, responses use the channel of their request
+ * @param id - Request id (for responses: id of the answered request)
+ * @param buf - Message in BB_BUF_PAYLOAD(buf)
+ * @param len - Message length, at most BB_MAX_MESSAGE
+ * @return Number of bytes sent (the message length if it was bundled),
+ *         -1 on failure
+ */
+ssize_t bb_session_send_buf(bb_session* s, uint8_t type, uint8_t channel, uint32_t id,
+                            bb_buf* buf, size_t len);
+
+/**
+ * Send the bundle of small messages if its budget is used up
+ *
+ * @param force - Send it whatever is left of its budget
+ * @return 0 on success or if nothing was due, -1 if sending failed
+ */
+int bb_session_flush(bb_session* s, int force);
+
+/**
+ * Push an event to the peer without it asking, on the interactive channel
+ * Subscriptions are kept by the application in s->subscriptions, the
+ * session only checks the peer announced BB_CAP_NOTIFY
+ *
+ * @param topic - Topic of the event, below BB_TOPICS
+ * @return Length sent, -1 if the peer does not take notifications or
+ *         sending failed
+ */
+ssize_t bb_session_notify(bb_session* s, uint32_t topic, const void* msg, size_t len);
+
+/**
+ * Announce our capabilities, right after the session key is in place
+ * Until the peer's announcement arrives only the features every version
+ * has are used towards it
+ *
+ * @param app - Application capabilities, passed to the peer as they are
+ * @return 0 on success, -1 if app is too long or sending failed
+ */
+int bb_session_send_caps(bb_session* s, const uint8_t* app, size_t app_len);
+
+/**
+ * Step to the next message of a received bundle
+ *
+ * @param pos - Read position, 0 before the first call
+ * @param type - Set to the type of the message
+ * @param id - Set to its request id
+ * @param msg - Set to the message inside the bundle
+ * @param msg_len - Set to its length
+ * @return 1 if a message was read, 0 at the end, -1 if the bundle is malformed
+ */
+int bb_bundle_next(const uint8_t* bundle, size_t len, size_t* pos, uint8_t* type,
+                   uint32_t* id, const uint8_t** msg, size_t* msg_len);
+
+/**
+ * Receive one frame into the session buffer and decrypt the message it
+ * completes in place, its channel is left in s->rx_channel
+ * Credit frames are applied to s->bulk_credits here and capabilities to
+ * s->peer_caps, callers may ignore both
+ * A message in the next key phase moves rx_key one step along the ratchet
+ * once it authenticates; the previous key is kept for messages of the old
+ * phase still arriving out of order.
+ *
+ * @param type - Set to the frame type, BB_FRAME_INCOMPLETE if the frame
+ *               was a fragment and more are needed, or if only part of a
+ *               frame has arrived so far
+ * @param id - Set to the request id of the frame
+ * @param msg - Set to the plaintext, valid until the next receive
+ * @return Length of the plaintext, 0 if the message is incomplete, failed
+ *         authentication or was replayed, -1 if the connection was closed
+ *         or errored
+ */
+ssize_t bb_session_recv_buf(bb_session* s, uint8_t* type, uint32_t* id,
+                            const uint8_t** msg);
+
+/**
+ * bb_session_send_buf() for a message held elsewhere, copied once
+ */
+ssize_t bb_session_send(bb_session* s, uint8_t type, uint8_t channel, uint32_t id,
+                        const void* msg, size_t len);
+
+/**
+ * bb_session_recv_buf() copying the plaintext out
+ *
+ * @return As bb_session_recv_buf(), 0 also if the message exceeds cap
+ */
+ssize_t bb_session_recv(bb_session* s, uint8_t* type, uint32_t* id,
+                        void* out, size_t cap);
+
+/**
+ * Check whether the window has room for a request on a channel
+ *
+ * @return 1 if bb_session_send_request() may send it now, 0 otherwise
+ */
+int bb_session_window_open(const bb_session* s, uint8_t channel);
+
+/**
+ * Send a request without waiting for its response
+ * Up to BB_WINDOW requests may be outstanding, BB_BULK_WINDOW of them on
+ * the bulk channel as far as the peer granted credits; cb runs when the
+ * response with the same id arrives (bb_session_complete) or the session fails
+ *
+ * @param channel - BB_CHANNEL_INTERACTIVE or BB_CHANNEL_BULK
+ * @return Request id, 0 if the window is full or sending failed
+ */
+uint32_t bb_session_send_request(bb_session* s, uint8_t channel, const void* req, size_t len,
+                                 bb_response_cb cb, void* arg);
+
+/**
+ * bb_session_send_request() for a request built in BB_BUF_PAYLOAD(buf),
+ * which is encrypted in place
+ */
+uint32_t bb_session_send_request_buf(bb_session* s, uint8_t channel, bb_buf* buf, size_t len,
+                                     bb_response_cb cb, void* arg);
+
+/**
+ * Let the peer send more bulk requests
+ *
+ * @param n - Credits to add to what the peer already holds
+ * @return 0 on success, -1 if sending failed
+ */
+int bb_session_grant(bb_session* s, int n);
+
+/**
+ * Change the deadline of an outstanding request
+ *
+ * @param timeout_ms - Time from now the response may take, 0 for no deadline
+ * @return 0 on success, -1 if no request with this id is outstanding
+ */
+int bb_session_set_deadline(bb_session* s, uint32_t id, uint32_t timeout_ms);
+
+/**
+ * Fail the outstanding requests whose deadline has passed (callbacks get len -1)
+ *
+ * @return Number of failed requests
+ */
+int bb_session_expire(bb_session* s, uint64_t now_ms);
+
+/**
+ * Send a heartbeat, which only refreshes the peer's last_rx_ms
+ *
+ * @return 0 on success, -1 if sending failed
+ */
+int bb_session_heartbeat(bb_session* s);
+
+/**
+ * Hand a received response to the callback of its request
+ *
+ * @return 0 on success, -1 if no request with this id is outstanding
+ */
+int bb_session_complete(bb_session* s, uint32_t id, const uint8_t* resp, size_t len);
+
+/**
+ * Expected time until a new request is answered: the outstanding requests
+ * and the new one, each at the smoothed latency of the session
+ * A session without a measured latency is assumed to answer at once, so
+ * it is tried and measured
+ */
+uint64_t bb_session_load_ms(const bb_session* s);
+
+/**
+ * Fail every outstanding request of a session (callbacks get len -1)
+ */
+void bb_session_fail_pending(bb_session* s);
+
+#endif
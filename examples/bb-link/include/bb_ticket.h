@@ -0,0 +1,98 @@
+#ifndef BB_TICKET_H
+#define BB_TICKET_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include "bbstate.h"
+#include "bb_session.h"
+#include "bb_kdf.h"
+
+// Ticket: sequence number (8) + encrypted resumption secret and expiry + tag
+#define BB_TICKET_LEN (8 + KEY_LEN + 8 + TAG_LEN)
+
+// Tickets are accepted this long after they were issued
+#define BB_TICKET_LIFETIME_S (24 * 3600)
+
+// Length of the key confirmation sent with a successful resumption
+#define BB_RESUME_CONFIRM_LEN 16
+
+// Issues and opens tickets, kept by the side that answers handshakes (central)
+// The ticket key never leaves the process, tickets are opaque to their holder
+typedef struct {
+    uint8_t key[KEY_LEN];
+    uint64_t seq;                // Nonce of the next ticket
+} bb_ticket_issuer;
+
+/**
+ * Pick a fresh random ticket key
+ *
+ * @return 0 on success, -1 if no randomness was available
+ */
+int bb_ticket_issuer_init(bb_ticket_issuer* issuer);
+
+/**
+ * Seal the resumption secret of a session into a ticket
+ *
+ * @param rms - Resumption secret, derived when the session was established
+ * @param ticket - Output, BB_TICKET_LEN bytes
+ */
+void bb_ticket_issue(bb_ticket_issuer* issuer, const uint8_t* rms, uint8_t* ticket);
+
+/**
+ * Check a presented ticket and recover its resumption secret
+ *
+ * @param rms - Output, KEY_LEN bytes
+ * @return 0 on success, -1 if the ticket is forged, foreign or expired
+ */
+int bb_ticket_open(bb_ticket_issuer* issuer, const uint8_t* ticket, uint8_t* rms);
+
+// Ticket received from a central, together with its resumption secret
+typedef struct {
+    char peer[BB_ADDR_STRLEN];   // Empty when the slot is unused
+    uint8_t ticket[BB_TICKET_LEN];
+    uint8_t rms[KEY_LEN];
+    time_t received;
+} bb_ticket_entry;
+
+// Tickets held by the side that presents them (peripheral)
+typedef struct {
+    bb_ticket_entry entries[BB_MAX_SESSIONS];
+} bb_ticket_store;
+
+/**
+ * Keep the ticket a peer issued for the current session, together with the
+ * resumption secret derived when the session was established
+ */
+void bb_ticket_store_put(bb_ticket_store* store, const char* peer, const uint8_t* ticket,
+                         const uint8_t* rms);
+
+/**
+ * Ticket to present to a peer
+ * Falls back to the newest ticket when the peer has none, since peers
+ * without a stable address (TCP, Unix sockets) get a new name per connection
+ *
+ * @return Entry, or NULL if no usable ticket is stored
+ */
+bb_ticket_entry* bb_ticket_store_get(bb_ticket_store* store, const char* peer);
+
+/**
+ * Forget a ticket that was rejected
+ */
+void bb_ticket_store_drop(bb_ticket_entry* entry);
+
+/**
+ * Load tickets saved by a previous run
+ *
+ * @return 0 on success, -1 if the file is missing or invalid
+ */
+int bb_ticket_store_load(bb_ticket_store* store, const char* path);
+
+/**
+ * Save all tickets, the file is only readable by its owner
+ *
+ * @return 0 on success, -1 on failure
+ */
+int bb_ticket_store_save(const bb_ticket_store* store, const char* path);
+
+#endif
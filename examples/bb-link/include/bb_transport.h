@@ -0,0 +1,126 @@
+#ifndef BB_TRANSPORT_H
+#define BB_TRANSPORT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Default L2CAP PSM of the examples (L2CAP_SERVER_PORT_NUM)
+#define BB_L2CAP_PSM 0x0235
+
+// Largest frame any transport carries, longer messages are fragmented
+#define BB_MAX_FRAME 2048
+
+// Default L2CAP MTU of BR/EDR channels, no larger MTU is negotiated
+#define BB_L2CAP_MTU 672
+
+// Most iovec entries sendv()/recvv() accept
+#define BB_MAX_IOV 4
+
+// Length in front of a frame on a stream and of a frame waiting in bb_io,
+// 2 bytes big-endian
+#define BB_FRAME_PREFIX 2
+
+// Frames a connection holds for a peer that does not take them yet; a peer
+// that falls further behind is dropped instead of stalling the others
+#define BB_TX_QUEUE_FRAMES 24
+
+// What did not get through the socket of one connection in a single call:
+// the part of an incoming frame read so far and the outgoing frames the
+// socket had no room for, each behind its BB_FRAME_PREFIX
+typedef struct {
+    uint8_t rx[BB_FRAME_PREFIX + BB_MAX_FRAME];
+    size_t rx_len;
+    uint8_t tx[BB_TX_QUEUE_FRAMES * (BB_FRAME_PREFIX + BB_MAX_FRAME)];
+    size_t tx_len;               // Bytes queued, 0 if the socket took everything
+} bb_io;
+
+/**
+ * Message transport carrying handshake messages and encrypted frames
+ *
+ * Addresses are given as "scheme:address":
+ *   l2cap:AA:BB:CC:DD:EE:FF[@hciN][#psm]  connect over Bluetooth L2CAP
+ *   l2cap:[hciN][#psm]                    listen on a local adapter
+ *   unix:/path/to/socket                  AF_UNIX SOCK_SEQPACKET
+ *   tcp:host:port                         TCP, frames are length-prefixed
+ * A bare Bluetooth address selects L2CAP.
+ *
+ * Every send()/recv() moves exactly one frame, whatever the socket type.
+ * sendv()/recvv() do the same with the frame gathered from / scattered
+ * into several buffers, so a header and a payload kept apart need no copy.
+ *
+ * Sockets are non-blocking and none of the calls waits for the peer: a
+ * frame the socket has no room for is queued in the bb_io of the
+ * connection until flush() gets it out, and a frame that arrived in part
+ * is kept there until the rest follows.
+ */
+typedef struct {
+    const char* name;
+    size_t mtu;                  // Largest frame send() carries, at most BB_MAX_FRAME
+
+    /**
+     * Create a listening socket and describe the address it is bound to
+     * @return Listening socket, -1 on failure with errno set
+     */
+    int (*listen)(const char* addr, int backlog, char* local, size_t local_len);
+
+    /**
+     * Accept one connection and describe its peer
+     * @return Connected socket in O_NONBLOCK mode, -1 on failure
+     */
+    int (*accept)(int listen_fd, char* peer, size_t peer_len);
+
+    /**
+     * Start a non-blocking connect, completion is signalled as writable
+     * @return Socket in O_NONBLOCK mode, -1 on failure
+     */
+    int (*connect)(const char* addr);
+
+    /**
+     * Send one frame, or queue it behind the frames still waiting
+     * @return Number of payload bytes sent or queued, -1 on failure or
+     *         if the queue is full
+     */
+    ssize_t (*send)(int fd, bb_io* io, const void* buf, size_t len);
+
+    /**
+     * Receive one frame
+     * @return Frame length, 0 if the connection was closed, -1 on failure
+     *         or with errno EAGAIN while no whole frame has arrived
+     */
+    ssize_t (*recv)(int fd, bb_io* io, void* buf, size_t cap);
+
+    /**
+     * Send one frame made of up to BB_MAX_IOV buffers, as send()
+     * @return Number of payload bytes sent or queued, -1 on failure
+     */
+    ssize_t (*sendv)(int fd, bb_io* io, const struct iovec* iov, int iovcnt);
+
+    /**
+     * Receive one frame into up to BB_MAX_IOV buffers, filled in order
+     * @return As recv()
+     */
+    ssize_t (*recvv)(int fd, bb_io* io, const struct iovec* iov, int iovcnt);
+
+    /**
+     * Send queued frames as far as the socket takes them
+     * @return 1 if frames are still queued, 0 if none are, -1 on failure
+     */
+    int (*flush)(int fd, bb_io* io);
+} bb_transport;
+
+extern const bb_transport bb_transport_l2cap;
+extern const bb_transport bb_transport_unix;
+extern const bb_transport bb_transport_tcp;
+
+/**
+ * Select the transport of an address
+ *
+ * @param spec - "scheme:address" or a bare Bluetooth address
+ * @param addr - Set to the address part of spec
+ * @return Transport, or NULL for an unknown scheme
+ */
+const bb_transport* bb_transport_lookup(const char* spec, const char** addr);
+
+#endif
@@ -0,0 +1,38 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/random.h>
+#include "blake2b.h"
+#include "bb_kdf.h"
+
+void bb_kdf(uint8_t* out, const uint8_t* key, uint64_t label, const uint8_t* ctx, size_t ctx_len)
+{
+    blake2b_ctx h;
+    uint8_t l[8];
+
+    for (int i = 0; i < 8; i++) {
+        l[i] = label >> (56 - 8 * i);
+    }
+
+    // The key is copied into the state first, so out may alias it
+    blake2b_init(&h, KEY_LEN, key, KEY_LEN);
+    blake2b_update(&h, l, sizeof(l));
+    if (ctx_len) blake2b_update(&h, ctx, ctx_len);
+    blake2b_final(&h, out);
+    memset(&h, 0, sizeof(h));
+}
+
+int bb_random(void* buf, size_t len)
+{
+    uint8_t* p = (uint8_t*)buf;
+
+    while (len > 0) {
+        ssize_t n = getrandom(p, len, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
@@ -0,0 +1,1015 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "bb_server.h"
+
+// Handshake message types, each message is the type byte and its body
+#define BB_HS_HELLO 1       // Peripheral has no ticket
+#define BB_HS_RESUME 2      // Peripheral: ticket and nonce
+#define BB_HS_START_REQ 3   // Central: bb_session_start request
+#define BB_HS_START_RSP 4   // Peripheral: bb_session_start response
+#define BB_HS_RESUME_OK 5   // Central: nonce and key confirmation
+
+// Largest handshake message
+#define BB_HS_MAX (1 + sizeof(struct bb_session_start_req) + BB_TICKET_LEN + BB_RESUME_NONCE_LEN)
+
+static void server_log(bb_server* srv, const char* fmt, ...)
+{
+    va_list ap;
+
+    if (!srv->log) return;
+    va_start(ap, fmt);
+    vfprintf(srv->log, fmt, ap);
+    va_end(ap);
+    fflush(srv->log);
+}
+
+static void server_log_key(bb_server* srv, const uint8_t* key, size_t len)
+{
+    if (!srv->log) return;
+    for (size_t i = 0; i < len; i++) {
+        fprintf(srv->log, "%02x", key[i]);
+    }
+    fprintf(srv->log, "\n");
+}
+
+void bb_server_disconnect(bb_server* srv, bb_session* s)
+{
+    server_log(srv, "[%s] Connection closed or error\n", s->peer);
+    if (s->fd >= 0) {
+        epoll_ctl(srv->epfd, EPOLL_CTL_DEL, s->fd, NULL);
+    }
+
+    // Queued requests cannot be answered on a new connection
+    int kept = 0;
+    for (int i = 0; i < srv->bulk_count; i++) {
+        bb_queued_request* q = &srv->bulk[(srv->bulk_head + i) % BB_BULK_QUEUE];
+        if (q->s == s) continue;
+        if (kept != i) srv->bulk[(srv->bulk_head + kept) % BB_BULK_QUEUE] = *q;
+        kept++;
+    }
+    srv->bulk_count = kept;
+
+    if (s->outgoing) {
+        int was_established = s->status == BB_SESSION_ESTABLISHED;
+        bb_session_close(s);
+        s->next_attempt_ms = bb_now_ms() + (was_established ? BB_RECONNECT_FAST_MS : BB_RECONNECT_MS);
+        if (was_established && s->race) {
+            // The race winner is gone, every alternative runs again
+            for (int i = 0; i < BB_MAX_SESSIONS; i++) {
+                bb_session* alt = &srv->sessions.slots[i];
+                if (alt != s && alt->race == s->race && alt->status == BB_SESSION_IDLE) {
+                    alt->next_attempt_ms = s->next_attempt_ms;
+                }
+            }
+        }
+    } else {
+        bb_session_release(s);
+    }
+}
+
+/**
+ * Start a non-blocking connect to the peer of a session
+ * Completion is reported by epoll as EPOLLOUT
+ */
+static void server_connect(bb_server* srv, bb_session* s)
+{
+    struct epoll_event ev = {0};
+    const char* addr;
+
+    bb_transport_lookup(s->peer, &addr);
+    s->fd = s->transport->connect(addr);
+    if (s->fd < 0) {
+        server_log(srv, "[%s] failed to connect: %s\n", s->peer, strerror(errno));
+        s->next_attempt_ms = bb_now_ms() + BB_RECONNECT_MS;
+        return;
+    }
+
+    ev.events = EPOLLOUT;
+    ev.data.ptr = s;
+    epoll_ctl(srv->epfd, EPOLL_CTL_ADD, s->fd, &ev);
+    s->status = BB_SESSION_CONNECTING;
+    s->connect_ms = bb_now_ms();
+    server_log(srv, "[%s] Connecting...\n", s->peer);
+}
+
+/**
+ * Send one handshake message: type byte followed by its body
+ *
+ * @return 0 on success, -1 (session disconnected) on failure
+ */
+static int server_send_handshake(bb_server* srv, bb_session* s, uint8_t type,
+                                 const uint8_t* body, size_t len)
+{
+    uint8_t msg[BB_HS_MAX];
+
+    msg[0] = type;
+    memcpy(msg + 1, body, len);
+    if (s->transport->send(s->fd, &s->io, msg, 1 + len) <= 0) {
+        server_log(srv, "[%s] failed to send data: %s\n", s->peer, strerror(errno));
+        bb_server_disconnect(srv, s);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Hand out free bulk queue slots as credits to the sessions running low
+ * Only a server with a request handler accepts requests at all
+ */
+static void server_grant_bulk(bb_server* srv)
+{
+    int free_slots = BB_BULK_QUEUE;
+
+    if (!srv->handler) return;
+    for (int i = 0; i < BB_MAX_SESSIONS; i++) {
+        free_slots -= srv->sessions.slots[i].bulk_granted;
+    }
+
+    for (int i = 0; i < BB_MAX_SESSIONS && free_slots > 0; i++) {
+        bb_session* s = &srv->sessions.slots[i];
+        if (s->status != BB_SESSION_ESTABLISHED || s->bulk_granted > BB_BULK_CREDITS / 2) continue;
+
+        int n = BB_BULK_CREDITS - s->bulk_granted;
+        if (n > free_slots) n = free_slots;
+        if (bb_session_grant(s, n) < 0) {
+            bb_server_disconnect(srv, s);
+            continue;
+        }
+        free_slots -= n;
+    }
+}
+
+/**
+ * A session won its race: stop the connects and handshakes of its
+ * alternatives, they stay parked until the winner drops
+ */
+static void server_cancel_race(bb_server* srv, bb_session* winner)
+{
+    for (int i = 0; i < BB_MAX_SESSIONS; i++) {
+        bb_session* s = &srv->sessions.slots[i];
+        if (s == winner || s->race != winner->race || s->status == BB_SESSION_FREE) continue;
+
+        if (s->status != BB_SESSION_IDLE) {
+            server_log(srv, "[%s] Cancelled, %s connected first\n", s->peer, winner->peer);
+        }
+        if (s->fd >= 0) {
+            epoll_ctl(srv->epfd, EPOLL_CTL_DEL, s->fd, NULL);
+        }
+        bb_session_close(s);
+        s->next_attempt_ms = UINT64_MAX;
+    }
+}
+
+/**
+ * Session key is in place: report it and, on the central side, give the
+ * peer a ticket to resume this session with
+ */
+static void server_on_established(bb_server* srv, bb_session* s, int resumed)
+{
+    s->status = BB_SESSION_ESTABLISHED;
+    s->resumed = resumed;
+    s->request_timeout_ms = srv->request_timeout_ms;
+    memcpy(s->coalesce_us, srv->coalesce_us, sizeof(s->coalesce_us));
+    s->ratchet_msgs = srv->ratchet_msgs;
+    s->ratchet_ms = srv->ratchet_ms;
+    server_log(srv, "[%s] Handshake complete (%s, %llu ms), key:\n", s->peer,
+               resumed ? "resumed" : "full",
+               (unsigned long long)(bb_now_ms() - s->handshake_ms));
+    server_log_key(srv, s->state.key, sizeof(s->state.key));
+    bb_session_set_keys(s);
+    if (s->race) server_cancel_race(srv, s);
+    server_log(srv, "%d session(s) established\n",
+               bb_session_table_established(&srv->sessions));
+
+    // The peripheral keeps the resumption secret until the ticket arrives
+    if (s->outgoing) {
+        uint8_t ticket[BB_TICKET_LEN];
+        bb_ticket_issue(&srv->issuer, s->resume_rms, ticket);
+        explicit_bzero(s->resume_rms, sizeof(s->resume_rms));
+        if (bb_session_send(s, BB_FRAME_TICKET, BB_CHANNEL_CONTROL, 0, ticket, sizeof(ticket)) < 0) {
+            bb_server_disconnect(srv, s);
+            return;
+        }
+    }
+    if (bb_session_send_caps(s, srv->caps, srv->caps_len) < 0) {
+        bb_server_disconnect(srv, s);
+        return;
+    }
+    server_grant_bulk(srv);
+}
+
+/**
+ * Central: start the full bb_session_start handshake
+ */
+static void server_start_full(bb_server* srv, bb_session* s)
+{
+    uint8_t buffer[BB_HS_MAX];
+
+    // Initialize secure session state as central device
+    bbstate_init(&s->state, BB_ROLE_CENTRAL, srv->keys.public_key, srv->keys.private_key,
+                 srv->keys.remote_public_key, NULL);
+    bb_session_start_req(&s->state, buffer);
+    server_send_handshake(srv, s, BB_HS_START_REQ, buffer, sizeof(struct bb_session_start_req));
+}
+
+/**
+ * Central: derive the session key from a presented ticket
+ *
+ * @return 0 if the session was resumed, -1 if the ticket was not accepted
+ */
+static int server_resume(bb_server* srv, bb_session* s, const uint8_t* body)
+{
+    uint8_t rms[KEY_LEN];
+    uint8_t nonces[2 * BB_RESUME_NONCE_LEN];
+    uint8_t reply[BB_RESUME_NONCE_LEN + KEY_LEN];
+
+    if (bb_ticket_open(&srv->issuer, body, rms) < 0) return -1;
+
+    // Key = KDF(resumption secret, peripheral nonce || central nonce)
+    memcpy(nonces, body + BB_TICKET_LEN, BB_RESUME_NONCE_LEN);
+    if (bb_random(nonces + BB_RESUME_NONCE_LEN, BB_RESUME_NONCE_LEN) < 0) {
+        memset(rms, 0, sizeof(rms));
+        return -1;
+    }
+    memset(&s->state, 0, sizeof(s->state));
+    bb_kdf(s->state.key, rms, BB_KDF_RESUME_KEY, nonces, sizeof(nonces));
+    memset(rms, 0, sizeof(rms));
+
+    // Reply with our nonce and a confirmation that we hold the same key
+    memcpy(reply, nonces + BB_RESUME_NONCE_LEN, BB_RESUME_NONCE_LEN);
+    bb_kdf(reply + BB_RESUME_NONCE_LEN, s->state.key, BB_KDF_CONFIRM, NULL, 0);
+    if (server_send_handshake(srv, s, BB_HS_RESUME_OK, reply,
+                              BB_RESUME_NONCE_LEN + BB_RESUME_CONFIRM_LEN) == 0) {
+        server_on_established(srv, s, 1);
+    }
+    return 0;
+}
+
+/**
+ * Peripheral: open the handshake, presenting a ticket when we hold one
+ */
+static void server_send_hello(bb_server* srv, bb_session* s)
+{
+    uint8_t body[BB_TICKET_LEN + BB_RESUME_NONCE_LEN];
+    bb_ticket_entry* t = bb_ticket_store_get(&srv->tickets, s->peer);
+
+    if (t && bb_random(s->resume_nonce, sizeof(s->resume_nonce)) == 0) {
+        memcpy(body, t->ticket, BB_TICKET_LEN);
+        memcpy(body + BB_TICKET_LEN, s->resume_nonce, BB_RESUME_NONCE_LEN);
+        memcpy(s->resume_rms, t->rms, KEY_LEN);
+        server_send_handshake(srv, s, BB_HS_RESUME, body, sizeof(body));
+    } else {
+        server_send_handshake(srv, s, BB_HS_HELLO, NULL, 0);
+    }
+}
+
+/**
+ * Peripheral: check the central's answer to our ticket and derive the key
+ *
+ * @return 0 on success, -1 if the key confirmation does not match
+ */
+static int server_on_resume_ok(bb_session* s, const uint8_t* body)
+{
+    uint8_t nonces[2 * BB_RESUME_NONCE_LEN];
+    uint8_t confirm[KEY_LEN];
+
+    memcpy(nonces, s->resume_nonce, BB_RESUME_NONCE_LEN);
+    memcpy(nonces + BB_RESUME_NONCE_LEN, body, BB_RESUME_NONCE_LEN);
+    memset(&s->state, 0, sizeof(s->state));
+    bb_kdf(s->state.key, s->resume_rms, BB_KDF_RESUME_KEY, nonces, sizeof(nonces));
+    memset(s->resume_rms, 0, sizeof(s->resume_rms));
+
+    bb_kdf(confirm, s->state.key, BB_KDF_CONFIRM, NULL, 0);
+    return memcmp(confirm, body + BB_RESUME_NONCE_LEN, BB_RESUME_CONFIRM_LEN) == 0 ? 0 : -1;
+}
+
+/**
+ * Connect finished: watch the socket for frames and wait for the
+ * peripheral to open the handshake
+ */
+static void server_on_connected(bb_server* srv, bb_session* s)
+{
+    struct epoll_event ev = {0};
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+        server_log(srv, "[%s] Connect failed: %s\n", s->peer, strerror(err));
+        bb_server_disconnect(srv, s);
+        return;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = s;
+    epoll_ctl(srv->epfd, EPOLL_CTL_MOD, s->fd, &ev);
+
+    server_log(srv, "[%s] connected...\n", s->peer);
+    s->status = BB_SESSION_HANDSHAKE;
+    s->handshake_ms = bb_now_ms();
+}
+
+/**
+ * Accept a connection from a central and open the handshake
+ * A peer that reconnects replaces its stale session
+ */
+static void server_on_accept(bb_server* srv)
+{
+    struct epoll_event ev = {0};
+    char peer[BB_ADDR_STRLEN];
+
+    int client_socket = srv->listen_transport->accept(srv->listen_fd, peer, sizeof(peer));
+    if (client_socket < 0) {
+        server_log(srv, "accept: %s\n", strerror(errno));
+        return;
+    }
+
+    bb_session* s = bb_session_table_find(&srv->sessions, peer);
+    if (s && s->fd >= 0) {
+        bb_server_disconnect(srv, s);
+    }
+    s = bb_session_table_add(&srv->sessions, peer);
+    if (!s) {
+        server_log(srv, "[%s] Session table full, rejecting connection\n", peer);
+        close(client_socket);
+        return;
+    }
+
+    s->fd = client_socket;
+    s->transport = srv->listen_transport;
+    s->outgoing = 0;
+    s->status = BB_SESSION_HANDSHAKE;
+    s->handshake_ms = bb_now_ms();
+    server_log(srv, "[%s] Connected\n", peer);
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = s;
+    epoll_ctl(srv->epfd, EPOLL_CTL_ADD, s->fd, &ev);
+
+    server_send_hello(srv, s);
+}
+
+/**
+ * Handshake message received
+ *
+ * Peripheral              Central
+ *   HELLO          ->                  no ticket: full handshake
+ *                  <-  START_REQ
+ *   START_RSP      ->
+ * or
+ *   RESUME(ticket) ->                  one exchange, no X25519
+ *                  <-  RESUME_OK       (or START_REQ if the ticket is rejected)
+ *
+ * The central then sends a new ticket as the first frame of the session.
+ */
+static void server_on_handshake(bb_server* srv, bb_session* s)
+{
+    uint8_t buffer[BB_HS_MAX];
+    size_t start_len = sizeof(struct bb_session_start_req);
+
+    ssize_t len = s->transport->recv(s->fd, &s->io, buffer, sizeof(buffer));
+    if (len < 0 && errno == EAGAIN) {
+        // Only part of the message arrived, the rest is kept in s->io
+        return;
+    }
+    if (len <= 0) {
+        server_log(srv, "[%s] Error during handshake\n", s->peer);
+        bb_server_disconnect(srv, s);
+        return;
+    }
+
+    uint8_t type = buffer[0];
+    const uint8_t* body = buffer + 1;
+    size_t body_len = len - 1;
+
+    if (s->outgoing && type == BB_HS_HELLO) {
+        server_start_full(srv, s);
+    } else if (s->outgoing && type == BB_HS_RESUME &&
+               body_len == BB_TICKET_LEN + BB_RESUME_NONCE_LEN) {
+        if (server_resume(srv, s, body) < 0) {
+            server_log(srv, "[%s] Ticket not accepted, full handshake\n", s->peer);
+            server_start_full(srv, s);
+        }
+    } else if (s->outgoing && type == BB_HS_START_RSP && body_len == start_len) {
+        bb_session_start_rx(&s->state, buffer + 1);
+        server_on_established(srv, s, 0);
+    } else if (!s->outgoing && type == BB_HS_START_REQ && body_len == start_len) {
+        // Our ticket (if any) was not accepted, do not present it again
+        bb_ticket_entry* t = bb_ticket_store_get(&srv->tickets, s->peer);
+        if (t && strcmp(t->peer, s->peer) == 0 &&
+            memcmp(t->rms, s->resume_rms, KEY_LEN) == 0) {
+            bb_ticket_store_drop(t);
+        }
+
+        // Initialize secure session state as peripheral device
+        bbstate_init(&s->state, BB_ROLE_PERIPHERAL, srv->listen_keys.public_key,
+                     srv->listen_keys.private_key, srv->listen_keys.remote_public_key, NULL);
+        bb_session_start_rx(&s->state, buffer + 1);
+
+        // Send handshake response to complete key exchange
+        bb_session_start_rsp(&s->state, buffer + 1);
+        if (server_send_handshake(srv, s, BB_HS_START_RSP, buffer + 1, start_len) == 0) {
+            server_on_established(srv, s, 0);
+        }
+    } else if (!s->outgoing && type == BB_HS_RESUME_OK &&
+               body_len == BB_RESUME_NONCE_LEN + BB_RESUME_CONFIRM_LEN) {
+        if (server_on_resume_ok(s, body) < 0) {
+            server_log(srv, "[%s] Resumption key mismatch\n", s->peer);
+            bb_server_disconnect(srv, s);
+            return;
+        }
+        server_on_established(srv, s, 1);
+    } else {
+        server_log(srv, "[%s] Unexpected handshake message\n", s->peer);
+        bb_server_disconnect(srv, s);
+    }
+}
+
+/**
+ * Run the handler for a request and send the encrypted response with the
+ * same id on the same channel
+ */
+static void server_serve(bb_server* srv, bb_session* s, uint8_t channel, uint32_t id,
+                         const uint8_t* req, size_t len)
+{
+    // The response is written straight into the buffer it is sent from
+    srv->serving_channel = channel;
+    srv->serving_id = id;
+    size_t resp_len = srv->handler(s, req, len, BB_BUF_PAYLOAD(&srv->tx), BB_MAX_MESSAGE);
+    if (resp_len > 0 && resp_len != BB_RESPONSE_DEFERRED &&
+        bb_session_send_buf(s, BB_FRAME_RESPONSE, channel, id, &srv->tx, resp_len) < 0) {
+        bb_server_disconnect(srv, s);
+    }
+}
+
+/**
+ * Handle the oldest queued bulk request, if any
+ */
+static void server_serve_bulk(bb_server* srv)
+{
+    if (srv->bulk_count == 0) return;
+
+    bb_queued_request* q = &srv->bulk[srv->bulk_head];
+    srv->bulk_head = (srv->bulk_head + 1) % BB_BULK_QUEUE;
+    srv->bulk_count--;
+
+    // The slot is free again, server_grant_bulk() hands it out
+    q->s->bulk_granted--;
+    server_serve(srv, q->s, BB_CHANNEL_BULK, q->id, q->req, q->len);
+}
+
+/**
+ * Queue a bulk request behind the ones already waiting
+ * Every request must use a credit, so the queue cannot overflow
+ */
+static void server_queue_bulk(bb_server* srv, bb_session* s, uint32_t id,
+                              const uint8_t* req, size_t len)
+{
+    int queued = 0;
+    for (int i = 0; i < srv->bulk_count; i++) {
+        if (srv->bulk[(srv->bulk_head + i) % BB_BULK_QUEUE].s == s) queued++;
+    }
+    if (queued >= s->bulk_granted) {
+        server_log(srv, "[%s] Bulk request without credit\n", s->peer);
+        bb_server_disconnect(srv, s);
+        return;
+    }
+
+    bb_queued_request* q = &srv->bulk[(srv->bulk_head + srv->bulk_count) % BB_BULK_QUEUE];
+    srv->bulk_count++;
+    q->s = s;
+    q->id = id;
+    q->len = len;
+    memcpy(q->req, req, len);
+}
+
+/**
+ * Handle a request (bulk ones are queued), or complete the pending request
+ * a response answers
+ */
+static void server_on_message(bb_server* srv, bb_session* s, uint8_t type, uint32_t id,
+                              const uint8_t* msg, size_t len)
+{
+    if (type == BB_FRAME_RESPONSE) {
+        if (bb_session_complete(s, id, msg, len) < 0) {
+            server_log(srv, "[%s] Response to unknown request %u\n", s->peer, id);
+        }
+        return;
+    }
+
+    if (type == BB_FRAME_NOTIFY) {
+        if (srv->notify) {
+            srv->notify(s, id, msg, len);
+        } else {
+            server_log(srv, "[%s] Notification of topic %u ignored\n", s->peer, id);
+        }
+        return;
+    }
+
+    if (type != BB_FRAME_REQUEST || !srv->handler) {
+        server_log(srv, "[%s] Unexpected or invalid message\n", s->peer);
+        return;
+    }
+
+    if (s->rx_channel == BB_CHANNEL_BULK) {
+        server_queue_bulk(srv, s, id, msg, len);
+    } else {
+        server_serve(srv, s, s->rx_channel, id, msg, len);
+    }
+}
+
+/**
+ * Decrypt one frame and handle the message it completes, or each message
+ * of a bundle
+ */
+static void server_on_frame(bb_server* srv, bb_session* s)
+{
+    const uint8_t* frame;
+    uint8_t type;
+    uint32_t id;
+
+    ssize_t len = bb_session_recv_buf(s, &type, &id, &frame);
+    if (len < 0) {
+        bb_server_disconnect(srv, s);
+        return;
+    }
+    if (len == 0) {
+        if (type != BB_FRAME_INCOMPLETE) {
+            server_log(srv, "[%s] Unexpected or invalid message\n", s->peer);
+        }
+        return;
+    }
+
+    if (type == BB_FRAME_TICKET) {
+        // One ticket per session, its secret is wiped once stored
+        static const uint8_t no_rms[KEY_LEN];
+        if (!s->outgoing && len == BB_TICKET_LEN &&
+            memcmp(s->resume_rms, no_rms, KEY_LEN) != 0) {
+            bb_ticket_store_put(&srv->tickets, s->peer, frame, s->resume_rms);
+            explicit_bzero(s->resume_rms, sizeof(s->resume_rms));
+            if (srv->ticket_file && bb_ticket_store_save(&srv->tickets, srv->ticket_file) < 0) {
+                server_log(srv, "failed to save tickets to %s\n", srv->ticket_file);
+            }
+        }
+        return;
+    }
+
+    if (type == BB_FRAME_CAPS) {
+        server_log(srv, "[%s] Peer speaks link v%u (features 0x%02x, frames up to %u bytes)\n",
+                   s->peer, s->peer_caps.version, s->peer_caps.features,
+                   s->peer_caps.max_frame);
+        return;
+    }
+
+    if (type == BB_FRAME_CREDIT || type == BB_FRAME_HEARTBEAT) {
+        // Already applied by bb_session_recv_buf()
+        return;
+    }
+
+    if (type == BB_FRAME_BUNDLE) {
+        const uint8_t* msg;
+        size_t pos = 0, msg_len;
+        int rc = 0;
+
+        // Handled one by one as if they had come in frames of their own;
+        // stop if handling one dropped the session
+        while (s->fd >= 0 &&
+               (rc = bb_bundle_next(frame, len, &pos, &type, &id, &msg, &msg_len)) > 0) {
+            server_on_message(srv, s, type, id, msg, msg_len);
+        }
+        if (s->fd >= 0 && rc < 0) {
+            server_log(srv, "[%s] Invalid bundle\n", s->peer);
+        }
+        return;
+    }
+
+    server_on_message(srv, s, type, id, frame, len);
+}
+
+static void server_on_event(bb_server* srv, bb_session* s, uint32_t events)
+{
+    if (!s) {
+        server_on_accept(srv);
+        return;
+    }
+    if (s->fd < 0) {
+        // Session was dropped earlier in the same epoll batch
+        return;
+    }
+
+    if (s->status == BB_SESSION_CONNECTING) {
+        // Connect result (success or error) is reported as writable
+        server_on_connected(srv, s);
+        return;
+    }
+
+    if ((events & EPOLLOUT) && s->transport->flush(s->fd, &s->io) < 0) {
+        server_log(srv, "[%s] failed to send data: %s\n", s->peer, strerror(errno));
+        bb_server_disconnect(srv, s);
+        return;
+    }
+
+    if (events & EPOLLIN) {
+        if (s->status == BB_SESSION_HANDSHAKE) {
+            server_on_handshake(srv, s);
+        } else if (s->status == BB_SESSION_ESTABLISHED) {
+            server_on_frame(srv, s);
+        }
+    } else if (events & (EPOLLHUP | EPOLLERR)) {
+        bb_server_disconnect(srv, s);
+    }
+}
+
+int bb_server_init(bb_server* srv, const bb_keys* keys, bb_request_handler handler)
+{
+    memset(srv, 0, sizeof(*srv));
+    bb_session_table_init(&srv->sessions);
+    srv->keys = *keys;
+    srv->listen_keys = *keys;
+    srv->handler = handler;
+    srv->listen_fd = -1;
+    srv->log = stdout;
+    bb_server_set_timeouts(srv, BB_HEARTBEAT_MS, BB_LINK_TIMEOUT_MS, BB_REQUEST_TIMEOUT_MS);
+    srv->coalesce_us[BB_CHANNEL_BULK] = BB_COALESCE_US;
+    bb_server_set_ratchet(srv, BB_RATCHET_MESSAGES, BB_RATCHET_MS);
+
+    if (bb_ticket_issuer_init(&srv->issuer) < 0) {
+        server_log(srv, "getrandom: %s\n", strerror(errno));
+        return -1;
+    }
+
+    srv->epfd = epoll_create1(0);
+    if (srv->epfd < 0) {
+        server_log(srv, "epoll_create1: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+void bb_server_set_timeouts(bb_server* srv, uint32_t heartbeat_ms, uint32_t link_timeout_ms,
+                            uint32_t request_timeout_ms)
+{
+    srv->heartbeat_ms = heartbeat_ms;
+    srv->link_timeout_ms = link_timeout_ms;
+    srv->request_timeout_ms = request_timeout_ms;
+}
+
+void bb_server_set_coalescing(bb_server* srv, uint8_t channel, uint32_t budget_us)
+{
+    if (channel >= BB_CHANNELS) return;
+
+    srv->coalesce_us[channel] = budget_us;
+    for (int i = 0; i < BB_MAX_SESSIONS; i++) {
+        srv->sessions.slots[i].coalesce_us[channel] = budget_us;
+    }
+}
+
+void bb_server_set_listen_keys(bb_server* srv, const bb_keys* keys)
+{
+    srv->listen_keys = *keys;
+}
+
+void bb_server_set_notify_handler(bb_server* srv, bb_notify_handler notify)
+{
+    srv->notify = notify;
+}
+
+int bb_server_set_caps(bb_server* srv, const uint8_t* caps, size_t len)
+{
+    if (len > sizeof(srv->caps)) return -1;
+
+    memcpy(srv->caps, caps, len);
+    srv->caps_len = len;
+    return 0;
+}
+
+void bb_server_set_ratchet(bb_server* srv, uint32_t msgs, uint32_t ms)
+{
+    srv->ratchet_msgs = msgs;
+    srv->ratchet_ms = ms;
+    for (int i = 0; i < BB_MAX_SESSIONS; i++) {
+        srv->sessions.slots[i].ratchet_msgs = msgs;
+        srv->sessions.slots[i].ratchet_ms = ms;
+    }
+}
+
+void bb_server_set_ticket_file(bb_server* srv, const char* path)
+{
+    srv->ticket_file = path;
+    if (bb_ticket_store_load(&srv->tickets, path) == 0) {
+        server_log(srv, "Loaded resumption tickets from %s\n", path);
+    }
+}
+
+int bb_server_add_peer(bb_server* srv, const char* peer)
+{
+    const char* addr;
+    const bb_transport* transport = bb_transport_lookup(peer, &addr);
+    if (!transport) {
+        server_log(srv, "Unknown transport, ignoring %s\n", peer);
+        return -1;
+    }
+
+    bb_session* s = bb_session_table_add(&srv->sessions, peer);
+    if (!s) {
+        server_log(srv, "Session table full, ignoring %s\n", peer);
+        return -1;
+    }
+    s->transport = transport;
+    s->outgoing = 1;
+    s->next_attempt_ms = 0;
+    return 0;
+}
+
+int bb_server_add_race(bb_server* srv, const char* spec)
+{
+    char specs[BB_MAX_SESSIONS * BB_ADDR_STRLEN];
+    char* save;
+    int race = strchr(spec, BB_RACE_SEP) ? ++srv->races : 0;
+
+    if (strlen(spec) >= sizeof(specs)) return -1;
+    strcpy(specs, spec);
+
+    const char sep[] = {BB_RACE_SEP, '\0'};
+    for (char* peer = strtok_r(specs, sep, &save); peer; peer = strtok_r(NULL, sep, &save)) {
+        if (bb_server_add_peer(srv, peer) < 0) return -1;
+        bb_session_table_find(&srv->sessions, peer)->race = race;
+    }
+    return 0;
+}
+
+const char* bb_server_peer_name(const bb_server* srv, const bb_session* s)
+{
+    // Outgoing slots are never released, the first one of a race stays first
+    for (int i = 0; s->race && i < BB_MAX_SESSIONS; i++) {
+        const bb_session* alt = &srv->sessions.slots[i];
+        if (alt->race == s->race && alt->status != BB_SESSION_FREE) return alt->peer;
+    }
+    return s->peer;
+}
+
+int bb_server_listen(bb_server* srv, const char* spec)
+{
+    struct epoll_event ev = {0};
+    const char* addr;
+    char local[64];
+
+    srv->listen_transport = bb_transport_lookup(spec, &addr);
+    if (!srv->listen_transport) {
+        server_log(srv, "Unknown transport: %s\n", spec);
+        return -1;
+    }
+
+    // Backlog sized to the session table, every slot may connect at once
+    srv->listen_fd = srv->listen_transport->listen(addr, BB_MAX_SESSIONS, local, sizeof(local));
+    if (srv->listen_fd < 0) {
+        server_log(srv, "failed to listen on %s: %s\n", spec, strerror(errno));
+        return -1;
+    }
+    server_log(srv, "Listening on %s:%s\n", srv->listen_transport->name, local);
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(srv->epfd, EPOLL_CTL_ADD, srv->listen_fd, &ev);
+    return 0;
+}
+
+/**
+ * Have epoll report room to send exactly while frames wait in the queue of
+ * a socket; a connect in progress is already watched for it
+ */
+static void server_watch_tx(bb_server* srv, bb_session* s)
+{
+    struct epoll_event ev = {0};
+    int queued = s->io.tx_len > 0;
+
+    if (s->fd < 0 || s->status == BB_SESSION_CONNECTING || queued == s->tx_watched) return;
+
+    ev.events = EPOLLIN | (queued ? EPOLLOUT : 0);
+    ev.data.ptr = s;
+    epoll_ctl(srv->epfd, EPOLL_CTL_MOD, s->fd, &ev);
+    s->tx_watched = queued;
+}
+
+/**
+ * Send heartbeats on idle sessions, drop silent ones and fail requests
+ * past their deadline; a connect and a handshake each get as long as a
+ * silent peer
+ */
+static void server_run_timers(bb_server* srv, uint64_t now)
+{
+    for (int i = 0; i < BB_MAX_SESSIONS; i++) {
+        bb_session* s = &srv->sessions.slots[i];
+        if (s->status == BB_SESSION_CONNECTING && srv->link_timeout_ms &&
+            now - s->connect_ms >= srv->link_timeout_ms) {
+            // An address that never answers must not hold up its race
+            server_log(srv, "[%s] Connect timed out\n", s->peer);
+            bb_server_disconnect(srv, s);
+            continue;
+        }
+        if (s->status == BB_SESSION_HANDSHAKE && srv->link_timeout_ms &&
+            now - s->handshake_ms >= srv->link_timeout_ms) {
+            server_log(srv, "[%s] Handshake timed out\n", s->peer);
+            bb_server_disconnect(srv, s);
+            continue;
+        }
+        if (s->status != BB_SESSION_ESTABLISHED) continue;
+
+        if (srv->link_timeout_ms && now - s->last_rx_ms >= srv->link_timeout_ms) {
+            server_log(srv, "[%s] Peer silent for %llu ms\n", s->peer,
+                       (unsigned long long)(now - s->last_rx_ms));
+            bb_server_disconnect(srv, s);
+            continue;
+        }
+        if (bb_session_flush(s, 0) < 0 ||
+            (srv->heartbeat_ms && now - s->last_tx_ms >= srv->heartbeat_ms &&
+             bb_session_heartbeat(s) < 0)) {
+            bb_server_disconnect(srv, s);
+            continue;
+        }
+        bb_session_expire(s, now);
+    }
+}
+
+int bb_server_poll(bb_server* srv, int timeout_ms)
+{
+    struct epoll_event events[BB_MAX_SESSIONS + 1];
+
+    // Timers first: a connect started below is stamped after now, and
+    // must not look as if it had been waiting for ages
+    uint64_t now = bb_now_ms();
+    server_run_timers(srv, now);
+
+    // (Re)connect every known peer that is due for another attempt
+    for (int i = 0; i < BB_MAX_SESSIONS; i++) {
+        bb_session* s = &srv->sessions.slots[i];
+        if (s->status == BB_SESSION_IDLE && s->outgoing && now >= s->next_attempt_ms) {
+            server_connect(srv, s);
+        }
+    }
+
+    // Queued work is due now, only pick up what already arrived; a waiting
+    // bundle is due when its budget is used up, rounded up to epoll's
+    // millisecond resolution
+    if (srv->bulk_count > 0) timeout_ms = 0;
+    uint64_t now_us = bb_now_us();
+    for (int i = 0; i < BB_MAX_SESSIONS; i++) {
+        bb_session* s = &srv->sessions.slots[i];
+        if (s->bundle_len == 0) continue;
+
+        uint64_t left_ms = s->bundle_deadline_us > now_us ?
+                           (s->bundle_deadline_us - now_us + 999) / 1000 : 0;
+        if (timeout_ms < 0 || left_ms < (uint64_t)timeout_ms) timeout_ms = (int)left_ms;
+    }
+
+    // Whatever was sent since the last wait may have been queued
+    for (int i = 0; i < BB_MAX_SESSIONS; i++) {
+        server_watch_tx(srv, &srv->sessions.slots[i]);
+    }
+
+    int n = epoll_wait(srv->epfd, events, BB_MAX_SESSIONS + 1, timeout_ms);
+    if (n < 0) {
+        if (errno == EINTR) return 0;
+        server_log(srv, "epoll_wait: %s\n", strerror(errno));
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        server_on_event(srv, (bb_session*)events[i].data.ptr, events[i].events);
+    }
+
+    // Anything that arrived meanwhile was handled first, interactive
+    // requests wait for at most one bulk request
+    server_serve_bulk(srv);
+    server_grant_bulk(srv);
+
+    for (int i = 0; i < BB_MAX_SESSIONS; i++) {
+        bb_session* s = &srv->sessions.slots[i];
+        if (s->status == BB_SESSION_ESTABLISHED && bb_session_flush(s, 0) < 0) {
+            bb_server_disconnect(srv, s);
+        }
+    }
+    return n;
+}
+
+int bb_server_run(bb_server* srv)
+{
+    while (bb_server_poll(srv, BB_SERVER_TICK_MS) >= 0) {
+    }
+    return -1;
+}
+
+/**
+ * A request could not be sent although the window had room: the send
+ * itself failed, so the connection is gone
+ */
+static void server_request_failed(bb_server* srv, bb_session* s, uint8_t channel)
+{
+    if (bb_session_window_open(s, channel)) {
+        bb_server_disconnect(srv, s);
+    }
+}
+
+uint32_t bb_server_request(bb_server* srv, bb_session* s, uint8_t channel,
+                           const void* req, size_t len, bb_response_cb cb, void* arg)
+{
+    uint32_t id = bb_session_send_request(s, channel, req, len, cb, arg);
+    if (id == 0) server_request_failed(srv, s, channel);
+    return id;
+}
+
+uint32_t bb_server_request_buf(bb_server* srv, bb_session* s, uint8_t channel,
+                               bb_buf* buf, size_t len, bb_response_cb cb, void* arg)
+{
+    uint32_t id = bb_session_send_request_buf(s, channel, buf, len, cb, arg);
+    if (id == 0) server_request_failed(srv, s, channel);
+    return id;
+}
+
+int bb_server_notify(bb_server* srv, bb_session* except, uint32_t topic,
+                     const void* msg, size_t len)
+{
+    int count = 0;
+
+    if (topic >= BB_TOPICS) return 0;
+
+    for (int i = 0; i < BB_MAX_SESSIONS; i++) {
+        bb_session* s = &srv->sessions.slots[i];
+        if (s == except || s->status != BB_SESSION_ESTABLISHED ||
+            !(s->subscriptions & ((uint32_t)1 << topic)) ||
+            !(s->peer_caps.features & BB_CAP_NOTIFY)) {
+            continue;
+        }
+
+        if (bb_session_notify(s, topic, msg, len) < 0) {
+            bb_server_disconnect(srv, s);
+        } else {
+            count++;
+        }
+    }
+    return count;
+}
+
+bb_session* bb_server_any_session(bb_server* srv)
+{
+    for (int i = 0; i < BB_MAX_SESSIONS; i++) {
+        if (srv->sessions.slots[i].status == BB_SESSION_ESTABLISHED) {
+            return &srv->sessions.slots[i];
+        }
+    }
+    return NULL;
+}
+
+bb_session* bb_server_ready_session(bb_server* srv, uint8_t channel)
+{
+    bb_session* best = NULL;
+
+    for (int i = 0; i < BB_MAX_SESSIONS; i++) {
+        bb_session* s = &srv->sessions.slots[i];
+        if (bb_session_window_open(s, channel) &&
+            (!best || s->inflight < best->inflight)) {
+            best = s;
+        }
+    }
+    return best;
+}
+
+void bb_server_defer(bb_server* srv, bb_session* s, bb_deferred* d)
+{
+    d->s = s;
+    d->generation = s->generation;
+    d->channel = srv->serving_channel;
+    d->id = srv->serving_id;
+}
+
+int bb_server_respond(bb_server* srv, const bb_deferred* d, const void* resp, size_t len)
+{
+    // A session that closed since may be up again with new request ids,
+    // the answer must not reach it
+    if (d->s->status != BB_SESSION_ESTABLISHED || d->s->generation != d->generation) return -1;
+
+    if (bb_session_send(d->s, BB_FRAME_RESPONSE, d->channel, d->id, resp, len) < 0) {
+        bb_server_disconnect(srv, d->s);
+        return -1;
+    }
+    return 0;
+}
+
+void bb_server_close(bb_server* srv)
+{
+    for (int i = 0; i < BB_MAX_SESSIONS; i++) {
+        bb_session_release(&srv->sessions.slots[i]);
+    }
+    if (srv->listen_fd >= 0) {
+        close(srv->listen_fd);
+        srv->listen_fd = -1;
+    }
+    if (srv->epfd >= 0) {
+        close(srv->epfd);
+        srv->epfd = -1;
+    }
+}
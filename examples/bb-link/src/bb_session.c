@@ -0,0 +1,643 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "bb_session.h"
+#include "bb_kdf.h"
+
+uint64_t bb_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t bb_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void bb_session_table_init(bb_session_table* table)
+{
+    memset(table, 0, sizeof(*table));
+    for (int i = 0; i < BB_MAX_SESSIONS; i++) {
+        table->slots[i].status = BB_SESSION_FREE;
+        table->slots[i].fd = -1;
+    }
+}
+
+bb_session* bb_session_table_find(bb_session_table* table, const char* peer)
+{
+    for (int i = 0; i < BB_MAX_SESSIONS; i++) {
+        bb_session* s = &table->slots[i];
+        if (s->status != BB_SESSION_FREE && strcmp(s->peer, peer) == 0) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+bb_session* bb_session_table_add(bb_session_table* table, const char* peer)
+{
+    bb_session* s = bb_session_table_find(table, peer);
+    if (s) return s;
+
+    for (int i = 0; i < BB_MAX_SESSIONS; i++) {
+        s = &table->slots[i];
+        if (s->status == BB_SESSION_FREE) {
+            // The generation survives, the slot is a new session to deferred responses
+            uint32_t generation = s->generation;
+            memset(s, 0, sizeof(*s));
+            s->generation = generation + 1;
+            s->status = BB_SESSION_IDLE;
+            s->fd = -1;
+            strncpy(s->peer, peer, sizeof(s->peer) - 1);
+            s->peer[sizeof(s->peer) - 1] = '\0';
+            return s;
+        }
+    }
+    return NULL;
+}
+
+int bb_session_table_established(const bb_session_table* table)
+{
+    int count = 0;
+    for (int i = 0; i < BB_MAX_SESSIONS; i++) {
+        if (table->slots[i].status == BB_SESSION_ESTABLISHED) count++;
+    }
+    return count;
+}
+
+void bb_session_close(bb_session* s)
+{
+    bb_session_fail_pending(s);
+    s->next_id = 0;
+    s->rx_len = 0;
+    s->io.rx_len = 0;
+    s->io.tx_len = 0;
+    s->tx_watched = 0;
+    s->bundle_len = 0;
+    s->bundle_count = 0;
+    s->bulk_credits = 0;
+    s->bulk_granted = 0;
+    s->subscriptions = 0;
+    s->generation++;
+    memset(&s->peer_caps, 0, sizeof(s->peer_caps));
+
+    if (s->fd >= 0) {
+        close(s->fd);
+        s->fd = -1;
+    }
+    // Wipe the session keys, a reconnect always negotiates a new key
+    memset(&s->state, 0, sizeof(s->state));
+    memset(s->tx_key, 0, sizeof(s->tx_key));
+    memset(s->rx_key, 0, sizeof(s->rx_key));
+    memset(s->rx_prev_key, 0, sizeof(s->rx_prev_key));
+    s->tx_seq = 0;
+    s->rx_top = 0;
+    s->rx_window = 0;
+    memset(s->resume_rms, 0, sizeof(s->resume_rms));
+    s->resumed = 0;
+    s->status = BB_SESSION_IDLE;
+}
+
+void bb_session_release(bb_session* s)
+{
+    bb_session_close(s);
+    s->status = BB_SESSION_FREE;
+}
+
+void bb_session_set_keys(bb_session* s)
+{
+    // The central sends under the C2P key, the peripheral under P2C
+    bb_kdf(s->tx_key, s->state.key, s->outgoing ? BB_KDF_KEY_C2P : BB_KDF_KEY_P2C, NULL, 0);
+    bb_kdf(s->rx_key, s->state.key, s->outgoing ? BB_KDF_KEY_P2C : BB_KDF_KEY_C2P, NULL, 0);
+    bb_kdf(s->resume_rms, s->state.key, BB_KDF_RESUMPTION, NULL, 0);
+
+    // Nothing needs the root or the handshake secrets any more; with them
+    // gone, the ratchet cannot be replayed from what the session holds
+    explicit_bzero(&s->state, sizeof(s->state));
+    memset(s->rx_prev_key, 0, sizeof(s->rx_prev_key));
+    memset(&s->peer_caps, 0, sizeof(s->peer_caps));
+    s->tx_seq = 0;
+    s->rx_top = 0;
+    s->rx_window = 0;
+    s->rx_phase_seq = 0;
+    s->rx_phase = 0;
+    s->tx_phase = 0;
+    s->tx_phase_msgs = 0;
+    s->tx_ratchets = 0;
+    s->rx_ratchets = 0;
+    s->last_rx_ms = s->last_tx_ms = s->tx_phase_ms = bb_now_ms();
+}
+
+static void put_frame_hdr(uint8_t* hdr, uint8_t type, uint8_t channel, uint32_t id,
+                          uint64_t seq)
+{
+    hdr[0] = type;
+    hdr[1] = channel;
+    hdr[2] = (uint8_t)(id >> 24);
+    hdr[3] = (uint8_t)(id >> 16);
+    hdr[4] = (uint8_t)(id >> 8);
+    hdr[5] = (uint8_t)id;
+    for (int i = 13; i >= 6; i--) {
+        hdr[i] = (uint8_t)seq;
+        seq >>= 8;
+    }
+}
+
+/**
+ * Check a received counter against the replay window
+ *
+ * @return 1 if a message with this counter may be accepted, 0 if it was
+ *         received before or is too old to tell
+ */
+static int replay_check(const bb_session* s, uint64_t seq)
+{
+    if (seq >= s->rx_top) return 1;
+
+    uint64_t behind = s->rx_top - 1 - seq;
+    if (behind >= BB_REPLAY_WINDOW) return 0;
+    return !(s->rx_window & ((uint64_t)1 << behind));
+}
+
+/**
+ * Mark a counter received, once its message passed authentication
+ */
+static void replay_accept(bb_session* s, uint64_t seq)
+{
+    if (seq >= s->rx_top) {
+        uint64_t shift = seq + 1 - s->rx_top;
+        s->rx_window = shift >= BB_REPLAY_WINDOW ? 0 : s->rx_window << shift;
+        s->rx_window |= 1;
+        s->rx_top = seq + 1;
+    } else {
+        s->rx_window |= (uint64_t)1 << (s->rx_top - 1 - seq);
+    }
+}
+
+/**
+ * Encrypt a message in place and send it as one frame, or as fragments
+ * if it does not fit the transport MTU
+ */
+static ssize_t session_send_frame(bb_session* s, uint8_t type, uint8_t channel, uint32_t id,
+                                  bb_buf* buf, size_t len)
+{
+    size_t mtu = s->transport->mtu < BB_MAX_FRAME ? s->transport->mtu : BB_MAX_FRAME;
+    uint8_t* payload = BB_BUF_PAYLOAD(buf);
+
+    if (s->peer_caps.max_frame > BB_FRAME_HDR_LEN && s->peer_caps.max_frame < mtu) {
+        mtu = s->peer_caps.max_frame;
+    }
+
+    // Never wraps in practice, a new handshake starts over at 0
+    if (s->tx_seq == UINT64_MAX) return -1;
+
+    uint64_t now = bb_now_ms();
+    if ((s->peer_caps.features & BB_CAP_RATCHET) &&
+        ((s->ratchet_msgs && s->tx_phase_msgs >= s->ratchet_msgs) ||
+         (s->ratchet_ms && now - s->tx_phase_ms >= s->ratchet_ms))) {
+        // The successor is a one-way hash of the old key, never keystream
+        // of it; the old key is gone once replaced and the root it came
+        // from was wiped at establishment, so later compromise of the
+        // session does not expose what was sent under it
+        bb_kdf(s->tx_key, s->tx_key, BB_KDF_RATCHET, NULL, 0);
+        s->tx_phase ^= BB_FRAME_PHASE;
+        s->tx_phase_msgs = 0;
+        s->tx_phase_ms = now;
+        s->tx_ratchets++;
+    }
+    s->tx_phase_msgs++;
+
+    uint64_t seq = s->tx_seq++;
+    put_frame_hdr(buf->frame, type | s->tx_phase, channel, id, seq);
+
+    size_t enc_len = aead_encrypt(payload, s->tx_key, seq,
+                                  buf->frame, BB_FRAME_HDR_LEN, payload, len);
+
+    // Header and ciphertext are already adjacent, one frame goes out as is;
+    // a longer message goes in MTU-sized pieces behind a copy of the header,
+    // all but the last with BB_FRAME_MORE
+    size_t chunk = mtu - BB_FRAME_HDR_LEN;
+    ssize_t total = 0;
+
+    for (size_t off = 0; off < enc_len; off += chunk) {
+        size_t n = enc_len - off < chunk ? enc_len - off : chunk;
+        uint8_t hdr[BB_FRAME_HDR_LEN];
+        struct iovec iov[2];
+
+        memcpy(hdr, buf->frame, BB_FRAME_HDR_LEN);
+        hdr[0] |= off + n < enc_len ? BB_FRAME_MORE : 0;
+        iov[0].iov_base = hdr;
+        iov[0].iov_len = sizeof(hdr);
+        iov[1].iov_base = payload + off;
+        iov[1].iov_len = n;
+
+        ssize_t sent = s->transport->sendv(s->fd, &s->io, iov, 2);
+        if (sent <= 0) return -1;
+        total += sent;
+    }
+
+    s->tx_frames++;
+    s->last_tx_ms = now;
+    return total;
+}
+
+int bb_session_flush(bb_session* s, int force)
+{
+    uint8_t* payload = BB_BUF_PAYLOAD(&s->bundle);
+    size_t len = s->bundle_len;
+
+    if (len == 0 || (!force && bb_now_us() < s->bundle_deadline_us)) return 0;
+    s->bundle_len = 0;
+
+    if (s->bundle_count == 1) {
+        // Nothing joined the message, send it as it is
+        uint8_t type = payload[0];
+        uint32_t id = ((uint32_t)payload[1] << 24) | ((uint32_t)payload[2] << 16) |
+                      ((uint32_t)payload[3] << 8) | payload[4];
+        memmove(payload, payload + BB_BUNDLE_ITEM_HDR, len - BB_BUNDLE_ITEM_HDR);
+        return session_send_frame(s, type, s->bundle_channel, id, &s->bundle,
+                                  len - BB_BUNDLE_ITEM_HDR) < 0 ? -1 : 0;
+    }
+
+    s->tx_bundles++;
+    s->tx_bundled += s->bundle_count;
+    return session_send_frame(s, BB_FRAME_BUNDLE, s->bundle_channel, 0, &s->bundle,
+                              len) < 0 ? -1 : 0;
+}
+
+ssize_t bb_session_send_buf(bb_session* s, uint8_t type, uint8_t channel, uint32_t id,
+                            bb_buf* buf, size_t len)
+{
+    if (len > BB_MAX_MESSAGE || channel >= BB_CHANNELS) return -1;
+    if (s->peer_caps.max_message && len > s->peer_caps.max_message) return -1;
+
+    int coalesce = (type == BB_FRAME_REQUEST || type == BB_FRAME_RESPONSE ||
+                    type == BB_FRAME_NOTIFY) &&
+                   (s->peer_caps.features & BB_CAP_BUNDLE) &&
+                   s->coalesce_us[channel] > 0 && len <= BB_COALESCE_MAX;
+    uint64_t now = coalesce || s->bundle_len > 0 ? bb_now_us() : 0;
+
+    // Whatever is sent next goes behind the bundle, so no channel sees its
+    // messages reordered
+    if (s->bundle_len > 0 &&
+        (!coalesce || channel != s->bundle_channel || now >= s->bundle_deadline_us ||
+         s->bundle_len + BB_BUNDLE_ITEM_HDR + len > BB_MAX_MESSAGE) &&
+        bb_session_flush(s, 1) < 0) {
+        return -1;
+    }
+    if (!coalesce) return session_send_frame(s, type, channel, id, buf, len);
+
+    if (s->bundle_len == 0) {
+        s->bundle_count = 0;
+        s->bundle_channel = channel;
+        s->bundle_deadline_us = now + s->coalesce_us[channel];
+    }
+    uint8_t* item = BB_BUF_PAYLOAD(&s->bundle) + s->bundle_len;
+    item[0] = type;
+    item[1] = (uint8_t)(id >> 24);
+    item[2] = (uint8_t)(id >> 16);
+    item[3] = (uint8_t)(id >> 8);
+    item[4] = (uint8_t)id;
+    item[5] = (uint8_t)(len >> 8);
+    item[6] = (uint8_t)len;
+    memcpy(item + BB_BUNDLE_ITEM_HDR, BB_BUF_PAYLOAD(buf), len);
+    s->bundle_len += BB_BUNDLE_ITEM_HDR + len;
+    s->bundle_count++;
+    return len;
+}
+
+ssize_t bb_session_notify(bb_session* s, uint32_t topic, const void* msg, size_t len)
+{
+    if (topic >= BB_TOPICS || !(s->peer_caps.features & BB_CAP_NOTIFY)) return -1;
+    return bb_session_send(s, BB_FRAME_NOTIFY, BB_CHANNEL_INTERACTIVE, topic, msg, len);
+}
+
+int bb_session_send_caps(bb_session* s, const uint8_t* app, size_t app_len)
+{
+    uint8_t caps[BB_CAPS_LEN + BB_CAPS_APP_MAX];
+    size_t max_frame = s->transport->mtu < BB_MAX_FRAME ? s->transport->mtu : BB_MAX_FRAME;
+
+    if (app_len > BB_CAPS_APP_MAX) return -1;
+
+    caps[0] = BB_LINK_VERSION;
+    caps[1] = BB_CAPS_LOCAL;
+    caps[2] = (uint8_t)(max_frame >> 8);
+    caps[3] = (uint8_t)max_frame;
+    caps[4] = (uint8_t)(BB_MAX_MESSAGE >> 8);
+    caps[5] = (uint8_t)BB_MAX_MESSAGE;
+    if (app_len > 0) memcpy(caps + BB_CAPS_LEN, app, app_len);
+
+    return bb_session_send(s, BB_FRAME_CAPS, BB_CHANNEL_CONTROL, 0, caps,
+                           BB_CAPS_LEN + app_len) < 0 ? -1 : 0;
+}
+
+/**
+ * Take in the capabilities announced by the peer
+ * Features of later versions are masked to those we know, so each side
+ * uses what both support
+ */
+static void session_apply_caps(bb_session* s, const uint8_t* caps, size_t len)
+{
+    if (len < BB_CAPS_LEN || caps[0] == 0) return;
+
+    s->peer_caps.version = caps[0] < BB_LINK_VERSION ? caps[0] : BB_LINK_VERSION;
+    s->peer_caps.features = caps[1] & BB_CAPS_LOCAL;
+    s->peer_caps.max_frame = (uint16_t)((caps[2] << 8) | caps[3]);
+    s->peer_caps.max_message = (uint16_t)((caps[4] << 8) | caps[5]);
+    s->peer_caps.app_len = len - BB_CAPS_LEN;
+    if (s->peer_caps.app_len > BB_CAPS_APP_MAX) s->peer_caps.app_len = BB_CAPS_APP_MAX;
+    memcpy(s->peer_caps.app, caps + BB_CAPS_LEN, s->peer_caps.app_len);
+}
+
+int bb_bundle_next(const uint8_t* bundle, size_t len, size_t* pos, uint8_t* type,
+                   uint32_t* id, const uint8_t** msg, size_t* msg_len)
+{
+    if (*pos == len) return 0;
+    if (*pos + BB_BUNDLE_ITEM_HDR > len) return -1;
+
+    const uint8_t* item = bundle + *pos;
+    *type = item[0];
+    *id = ((uint32_t)item[1] << 24) | ((uint32_t)item[2] << 16) |
+          ((uint32_t)item[3] << 8) | item[4];
+    *msg_len = ((size_t)item[5] << 8) | item[6];
+    if (*pos + BB_BUNDLE_ITEM_HDR + *msg_len > len) return -1;
+
+    *msg = item + BB_BUNDLE_ITEM_HDR;
+    *pos += BB_BUNDLE_ITEM_HDR + *msg_len;
+    return 1;
+}
+
+ssize_t bb_session_recv_buf(bb_session* s, uint8_t* type, uint32_t* id,
+                            const uint8_t** msg)
+{
+    uint8_t hdr[BB_FRAME_HDR_LEN];
+    uint8_t* payload = BB_BUF_PAYLOAD(&s->rx);
+    size_t room = sizeof(s->rx.frame) - BB_FRAME_HDR_LEN - s->rx_len;
+    struct iovec iov[2];
+
+    // The header lands aside, the ciphertext right behind what was
+    // reassembled so far
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = payload + s->rx_len;
+    iov[1].iov_len = room;
+
+    ssize_t recv_len = s->transport->recvv(s->fd, &s->io, iov, 2);
+    if (recv_len < 0 && errno == EAGAIN) {
+        // The rest of the frame is still on its way
+        *type = BB_FRAME_INCOMPLETE;
+        return 0;
+    }
+    if (recv_len <= 0) return -1;
+
+    int more = hdr[0] & BB_FRAME_MORE;
+    hdr[0] &= ~BB_FRAME_MORE;
+    *type = hdr[0] & ~BB_FRAME_PHASE;
+    if (recv_len < BB_FRAME_HDR_LEN) {
+        s->rx_len = 0;
+        return 0;
+    }
+
+    size_t chunk = recv_len - BB_FRAME_HDR_LEN;
+    if (s->rx_len > 0 && memcmp(s->rx.frame, hdr, BB_FRAME_HDR_LEN) != 0) {
+        // Fragments of one message arrive back to back; anything else
+        // means the partial message is lost
+        memmove(payload, payload + s->rx_len, chunk);
+        s->rx_len = 0;
+    }
+    memcpy(s->rx.frame, hdr, BB_FRAME_HDR_LEN);
+    s->rx_len += chunk;
+
+    if (more) {
+        if (chunk == room) {
+            // Longer than BB_MAX_MESSAGE, the rest was cut off
+            s->rx_len = 0;
+            return 0;
+        }
+        *type = BB_FRAME_INCOMPLETE;
+        return 0;
+    }
+
+    size_t enc_len = s->rx_len;
+    s->rx_len = 0;
+    if (enc_len < TAG_LEN) return 0;
+
+    *id = ((uint32_t)hdr[2] << 24) | ((uint32_t)hdr[3] << 16) |
+          ((uint32_t)hdr[4] << 8) | hdr[5];
+    if (*type != BB_FRAME_REQUEST && *type != BB_FRAME_RESPONSE &&
+        !(*type == BB_FRAME_NOTIFY && *id < BB_TOPICS) &&
+        !((*type == BB_FRAME_TICKET || *type == BB_FRAME_CREDIT ||
+           *type == BB_FRAME_HEARTBEAT || *type == BB_FRAME_BUNDLE ||
+           *type == BB_FRAME_CAPS) && *id == 0)) {
+        return 0;
+    }
+    if (hdr[1] >= BB_CHANNELS) return 0;
+    s->rx_channel = hdr[1];
+
+    uint64_t seq = 0;
+    for (int i = 6; i < BB_FRAME_HDR_LEN; i++) {
+        seq = (seq << 8) | hdr[i];
+    }
+    if (!replay_check(s, seq)) return 0;
+
+    // A flipped phase is either a late message under the previous key or
+    // the first of the next key; the counter tells which
+    uint8_t phase = hdr[0] & BB_FRAME_PHASE;
+    uint8_t next_key[KEY_LEN];
+    const uint8_t* key = s->rx_key;
+    if (phase != s->rx_phase) {
+        if (seq < s->rx_phase_seq) {
+            key = s->rx_prev_key;
+        } else {
+            bb_kdf(next_key, s->rx_key, BB_KDF_RATCHET, NULL, 0);
+            key = next_key;
+        }
+    }
+
+    s->rx_frames++;
+    *msg = payload;
+    ssize_t len = aead_decrypt(payload, (uint8_t*)key, seq,
+                               s->rx.frame, BB_FRAME_HDR_LEN, payload, enc_len);
+    // Only an authentic message may move the window or the key, or show
+    // the peer is alive
+    if (len > 0) {
+        replay_accept(s, seq);
+        s->last_rx_ms = bb_now_ms();
+        if (key == next_key) {
+            memcpy(s->rx_prev_key, s->rx_key, KEY_LEN);
+            memcpy(s->rx_key, next_key, KEY_LEN);
+            s->rx_phase = phase;
+            s->rx_phase_seq = seq;
+            s->rx_ratchets++;
+        }
+    }
+    if (key == next_key) memset(next_key, 0, sizeof(next_key));
+    if (len == 2 && *type == BB_FRAME_CREDIT) {
+        s->bulk_credits += (payload[0] << 8) | payload[1];
+        if (s->bulk_credits > 0xffff) s->bulk_credits = 0xffff;
+    }
+    if (len > 0 && *type == BB_FRAME_CAPS) {
+        session_apply_caps(s, payload, len);
+    }
+    return len;
+}
+
+ssize_t bb_session_send(bb_session* s, uint8_t type, uint8_t channel, uint32_t id,
+                        const void* msg, size_t len)
+{
+    if (len > BB_MAX_MESSAGE) return -1;
+
+    memcpy(BB_BUF_PAYLOAD(&s->tx), msg, len);
+    return bb_session_send_buf(s, type, channel, id, &s->tx, len);
+}
+
+ssize_t bb_session_recv(bb_session* s, uint8_t* type, uint32_t* id,
+                        void* out, size_t cap)
+{
+    const uint8_t* msg;
+
+    ssize_t len = bb_session_recv_buf(s, type, id, &msg);
+    if (len <= 0) return len;
+    if ((size_t)len > cap) return 0;
+
+    memcpy(out, msg, len);
+    return len;
+}
+
+int bb_session_window_open(const bb_session* s, uint8_t channel)
+{
+    if (s->status != BB_SESSION_ESTABLISHED || s->inflight >= BB_WINDOW) return 0;
+    return channel != BB_CHANNEL_BULK ||
+           (s->bulk_inflight < BB_BULK_WINDOW && s->bulk_credits > 0);
+}
+
+uint32_t bb_session_send_request_buf(bb_session* s, uint8_t channel, bb_buf* buf, size_t len,
+                                     bb_response_cb cb, void* arg)
+{
+    if (!bb_session_window_open(s, channel)) return 0;
+
+    // Ids only match responses to requests, they may wrap but skip 0
+    uint32_t id = ++s->next_id;
+    if (id == 0) id = s->next_id = 1;
+
+    bb_pending* p = NULL;
+    for (int i = 0; i < BB_WINDOW && !p; i++) {
+        if (s->pending[i].id == 0) p = &s->pending[i];
+    }
+
+    if (bb_session_send_buf(s, BB_FRAME_REQUEST, channel, id, buf, len) < 0) return 0;
+
+    p->id = id;
+    p->channel = channel;
+    p->cb = cb;
+    p->arg = arg;
+    p->sent_ms = bb_now_ms();
+    p->deadline_ms = s->request_timeout_ms ? p->sent_ms + s->request_timeout_ms : 0;
+    s->inflight++;
+    if (channel == BB_CHANNEL_BULK) {
+        s->bulk_inflight++;
+        s->bulk_credits--;
+    }
+    return id;
+}
+
+uint32_t bb_session_send_request(bb_session* s, uint8_t channel, const void* req, size_t len,
+                                 bb_response_cb cb, void* arg)
+{
+    if (len > BB_MAX_MESSAGE) return 0;
+
+    memcpy(BB_BUF_PAYLOAD(&s->tx), req, len);
+    return bb_session_send_request_buf(s, channel, &s->tx, len, cb, arg);
+}
+
+int bb_session_grant(bb_session* s, int n)
+{
+    uint8_t msg[2] = {(uint8_t)(n >> 8), (uint8_t)n};
+
+    if (n <= 0 || n > 0xffff) return -1;
+    if (bb_session_send(s, BB_FRAME_CREDIT, BB_CHANNEL_CONTROL, 0, msg, sizeof(msg)) < 0) return -1;
+    s->bulk_granted += n;
+    return 0;
+}
+
+int bb_session_set_deadline(bb_session* s, uint32_t id, uint32_t timeout_ms)
+{
+    for (int i = 0; i < BB_WINDOW; i++) {
+        bb_pending* p = &s->pending[i];
+        if (id != 0 && p->id == id) {
+            p->deadline_ms = timeout_ms ? bb_now_ms() + timeout_ms : 0;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int bb_session_expire(bb_session* s, uint64_t now_ms)
+{
+    int count = 0;
+
+    for (int i = 0; i < BB_WINDOW; i++) {
+        bb_pending* p = &s->pending[i];
+        if (p->id == 0 || p->deadline_ms == 0 || now_ms < p->deadline_ms) continue;
+
+        // A late response finds no request and is dropped
+        bb_pending done = *p;
+        memset(p, 0, sizeof(*p));
+        s->inflight--;
+        if (done.channel == BB_CHANNEL_BULK) s->bulk_inflight--;
+        if (done.cb) done.cb(s, done.id, done.arg, NULL, -1);
+        count++;
+    }
+    return count;
+}
+
+int bb_session_heartbeat(bb_session* s)
+{
+    static const uint8_t beat = 0;
+
+    return bb_session_send(s, BB_FRAME_HEARTBEAT, BB_CHANNEL_CONTROL, 0, &beat, 1) < 0 ? -1 : 0;
+}
+
+int bb_session_complete(bb_session* s, uint32_t id, const uint8_t* resp, size_t len)
+{
+    for (int i = 0; i < BB_WINDOW; i++) {
+        bb_pending* p = &s->pending[i];
+        if (id != 0 && p->id == id) {
+            bb_pending done = *p;
+            memset(p, 0, sizeof(*p));
+            s->inflight--;
+            if (done.channel == BB_CHANNEL_BULK) s->bulk_inflight--;
+
+            // Moving average over about 8 responses, kept across reconnects
+            uint32_t sample = (uint32_t)(bb_now_ms() - done.sent_ms);
+            s->latency_ms = s->latency_ms ? (s->latency_ms * 7 + sample) / 8 : sample;
+
+            if (done.cb) done.cb(s, id, done.arg, resp, len);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+uint64_t bb_session_load_ms(const bb_session* s)
+{
+    return (uint64_t)(s->inflight + 1) * s->latency_ms;
+}
+
+void bb_session_fail_pending(bb_session* s)
+{
+    for (int i = 0; i < BB_WINDOW; i++) {
+        bb_pending done = s->pending[i];
+        if (done.id == 0) continue;
+
+        memset(&s->pending[i], 0, sizeof(s->pending[i]));
+        s->inflight--;
+        if (done.channel == BB_CHANNEL_BULK) s->bulk_inflight--;
+        if (done.cb) done.cb(s, done.id, done.arg, NULL, -1);
+    }
+}
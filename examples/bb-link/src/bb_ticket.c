@@ -0,0 +1,146 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "bb_ticket.h"
+
+// Magic and version at the start of a ticket file
+static const uint8_t ticket_file_magic[4] = {'B', 'B', 'T', 1};
+
+static void put_u64(uint8_t* out, uint64_t v)
+{
+    for (int i = 7; i >= 0; i--) {
+        out[i] = (uint8_t)v;
+        v >>= 8;
+    }
+}
+
+static uint64_t get_u64(const uint8_t* in)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) {
+        v = (v << 8) | in[i];
+    }
+    return v;
+}
+
+int bb_ticket_issuer_init(bb_ticket_issuer* issuer)
+{
+    issuer->seq = 1;
+    return bb_random(issuer->key, sizeof(issuer->key));
+}
+
+void bb_ticket_issue(bb_ticket_issuer* issuer, const uint8_t* rms, uint8_t* ticket)
+{
+    uint8_t plain[KEY_LEN + 8];
+
+    memcpy(plain, rms, KEY_LEN);
+    put_u64(plain + KEY_LEN, (uint64_t)time(NULL) + BB_TICKET_LIFETIME_S);
+
+    // The sequence number is both the nonce and the authenticated header
+    uint64_t seq = issuer->seq++;
+    put_u64(ticket, seq);
+    aead_encrypt(ticket + 8, issuer->key, seq, ticket, 8, plain, sizeof(plain));
+    memset(plain, 0, sizeof(plain));
+}
+
+int bb_ticket_open(bb_ticket_issuer* issuer, const uint8_t* ticket, uint8_t* rms)
+{
+    uint8_t plain[KEY_LEN + 8];
+
+    if (aead_decrypt(plain, issuer->key, get_u64(ticket), ticket, 8,
+                     ticket + 8, BB_TICKET_LEN - 8) != sizeof(plain)) {
+        return -1;
+    }
+    if (get_u64(plain + KEY_LEN) < (uint64_t)time(NULL)) {
+        memset(plain, 0, sizeof(plain));
+        return -1;
+    }
+
+    memcpy(rms, plain, KEY_LEN);
+    memset(plain, 0, sizeof(plain));
+    return 0;
+}
+
+void bb_ticket_store_put(bb_ticket_store* store, const char* peer, const uint8_t* ticket,
+                         const uint8_t* rms)
+{
+    bb_ticket_entry* slot = NULL;
+
+    // Reuse the peer's entry, else a free one, else the oldest
+    for (int i = 0; i < BB_MAX_SESSIONS; i++) {
+        bb_ticket_entry* e = &store->entries[i];
+        if (strcmp(e->peer, peer) == 0) {
+            slot = e;
+            break;
+        }
+        if (!slot || (slot->peer[0] && (!e->peer[0] || e->received < slot->received))) {
+            slot = e;
+        }
+    }
+
+    memset(slot, 0, sizeof(*slot));
+    strncpy(slot->peer, peer, sizeof(slot->peer) - 1);
+    memcpy(slot->ticket, ticket, BB_TICKET_LEN);
+    memcpy(slot->rms, rms, KEY_LEN);
+    slot->received = time(NULL);
+}
+
+bb_ticket_entry* bb_ticket_store_get(bb_ticket_store* store, const char* peer)
+{
+    bb_ticket_entry* newest = NULL;
+    time_t oldest_valid = time(NULL) - BB_TICKET_LIFETIME_S;
+
+    for (int i = 0; i < BB_MAX_SESSIONS; i++) {
+        bb_ticket_entry* e = &store->entries[i];
+        if (!e->peer[0] || e->received < oldest_valid) continue;
+
+        if (strcmp(e->peer, peer) == 0) return e;
+        if (!newest || e->received > newest->received) newest = e;
+    }
+    return newest;
+}
+
+void bb_ticket_store_drop(bb_ticket_entry* entry)
+{
+    memset(entry, 0, sizeof(*entry));
+}
+
+int bb_ticket_store_load(bb_ticket_store* store, const char* path)
+{
+    uint8_t magic[sizeof(ticket_file_magic)];
+
+    FILE* f = fopen(path, "rb");
+    if (!f) return -1;
+
+    int ok = fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+             memcmp(magic, ticket_file_magic, sizeof(magic)) == 0 &&
+             fread(store->entries, sizeof(store->entries), 1, f) == 1;
+    fclose(f);
+
+    if (!ok) {
+        memset(store, 0, sizeof(*store));
+        return -1;
+    }
+    for (int i = 0; i < BB_MAX_SESSIONS; i++) {
+        store->entries[i].peer[BB_ADDR_STRLEN - 1] = '\0';
+    }
+    return 0;
+}
+
+int bb_ticket_store_save(const bb_ticket_store* store, const char* path)
+{
+    // Resumption secrets are keys, keep them away from other users
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) return -1;
+
+    FILE* f = fdopen(fd, "wb");
+    if (!f) {
+        close(fd);
+        return -1;
+    }
+
+    int ok = fwrite(ticket_file_magic, sizeof(ticket_file_magic), 1, f) == 1 &&
+             fwrite(store->entries, sizeof(store->entries), 1, f) == 1;
+    return fclose(f) == 0 && ok ? 0 : -1;
+}
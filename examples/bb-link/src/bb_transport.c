@@ -0,0 +1,587 @@
+#define _GNU_SOURCE // struct ucred
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/l2cap.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+#include "bb_transport.h"
+
+/* ------------------------------------------------------------------------ */
+/* Frame I/O shared by the SOCK_SEQPACKET transports (L2CAP and AF_UNIX)     */
+/* ------------------------------------------------------------------------ */
+
+static size_t iov_total(const struct iovec* iov, int iovcnt)
+{
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+    }
+    return total;
+}
+
+/**
+ * Queue a frame behind its length prefix, leaving out the first skip bytes
+ * of the two (those already reached the socket)
+ *
+ * @return Frame length, -1 if the queue has no room left
+ */
+static ssize_t io_queue(bb_io* io, const struct iovec* iov, int iovcnt, size_t skip)
+{
+    size_t len = iov_total(iov, iovcnt);
+    uint8_t prefix[BB_FRAME_PREFIX] = {(uint8_t)(len >> 8), (uint8_t)len};
+
+    if (len > 0xffff) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (io->tx_len + BB_FRAME_PREFIX + len - skip > sizeof(io->tx)) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    for (int i = -1; i < iovcnt; i++) {
+        const uint8_t* p = i < 0 ? prefix : iov[i].iov_base;
+        size_t n = i < 0 ? sizeof(prefix) : iov[i].iov_len;
+        size_t drop = skip < n ? skip : n;
+
+        skip -= drop;
+        memcpy(io->tx + io->tx_len, p + drop, n - drop);
+        io->tx_len += n - drop;
+    }
+    return len;
+}
+
+static int seqpacket_flush(int fd, bb_io* io)
+{
+    size_t off = 0;
+
+    // One queued frame per sendmsg, they keep their boundaries
+    while (off < io->tx_len) {
+        size_t len = ((size_t)io->tx[off] << 8) | io->tx[off + 1];
+        ssize_t sent = send(fd, io->tx + off + BB_FRAME_PREFIX, len, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent < 0 && errno == EAGAIN) break;
+        if (sent != (ssize_t)len) return -1;
+        off += BB_FRAME_PREFIX + len;
+    }
+
+    memmove(io->tx, io->tx + off, io->tx_len - off);
+    io->tx_len -= off;
+    return io->tx_len > 0;
+}
+
+static ssize_t seqpacket_sendv(int fd, bb_io* io, const struct iovec* iov, int iovcnt)
+{
+    struct msghdr mh = {0};
+
+    // Frames leave in order, a new one waits behind those still queued
+    if (io->tx_len > 0 && seqpacket_flush(fd, io) < 0) return -1;
+    if (io->tx_len > 0) return io_queue(io, iov, iovcnt, 0);
+
+    mh.msg_iov = (struct iovec*)iov;
+    mh.msg_iovlen = iovcnt;
+    ssize_t sent = sendmsg(fd, &mh, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EAGAIN) return io_queue(io, iov, iovcnt, 0);
+    return sent == (ssize_t)iov_total(iov, iovcnt) ? sent : -1;
+}
+
+static ssize_t seqpacket_recvv(int fd, bb_io* io, const struct iovec* iov, int iovcnt)
+{
+    struct msghdr mh = {0};
+
+    // A datagram is read whole, nothing is ever left in io->rx
+    (void)io;
+    mh.msg_iov = (struct iovec*)iov;
+    mh.msg_iovlen = iovcnt;
+    ssize_t n = recvmsg(fd, &mh, 0);
+
+    // The kernel drops what did not fit, so an oversized frame is lost
+    if (n >= 0 && (mh.msg_flags & MSG_TRUNC)) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    return n;
+}
+
+static ssize_t seqpacket_send(int fd, bb_io* io, const void* buf, size_t len)
+{
+    struct iovec iov = {(void*)buf, len};
+    return seqpacket_sendv(fd, io, &iov, 1);
+}
+
+static ssize_t seqpacket_recv(int fd, bb_io* io, void* buf, size_t cap)
+{
+    struct iovec iov = {buf, cap};
+    return seqpacket_recvv(fd, io, &iov, 1);
+}
+
+/* ------------------------------------------------------------------------ */
+/* Bluetooth L2CAP                                                           */
+/* ------------------------------------------------------------------------ */
+
+/**
+ * Split "[AA:BB:CC:DD:EE:FF][@hciN][#psm]" into its parts
+ * Missing parts keep the values the caller initialized them with
+ */
+static void l2cap_parse(const char* addr, char* bdaddr, size_t bdaddr_len,
+                        int* dev_id, uint16_t* psm)
+{
+    char tmp[64];
+    char* sep;
+
+    strncpy(tmp, addr, sizeof(tmp) - 1);
+    tmp[sizeof(tmp) - 1] = '\0';
+
+    if ((sep = strchr(tmp, '#')) != NULL) {
+        *psm = (uint16_t)strtol(sep + 1, NULL, 0);
+        *sep = '\0';
+    }
+
+    // "hciN" alone (listen) or after '@' (connect) selects the adapter
+    sep = strchr(tmp, '@');
+    char* dev = sep ? sep + 1 : (strncmp(tmp, "hci", 3) == 0 ? tmp : NULL);
+    if (dev && strncmp(dev, "hci", 3) == 0) {
+        *dev_id = atoi(dev + 3);
+    }
+    if (sep || dev == tmp) {
+        (sep ? sep : tmp)[0] = '\0';
+    }
+
+    strncpy(bdaddr, tmp, bdaddr_len - 1);
+    bdaddr[bdaddr_len - 1] = '\0';
+}
+
+static int l2cap_listen(const char* addr, int backlog, char* local, size_t local_len)
+{
+    struct sockaddr_l2 loc_addr = {0};
+    bdaddr_t local_bdaddr = {0};
+    char bdaddr[18];
+    int dev_id = 0;
+    uint16_t psm = BB_L2CAP_PSM;
+
+    l2cap_parse(addr, bdaddr, sizeof(bdaddr), &dev_id, &psm);
+
+    // Get the local Bluetooth address of the adapter
+    int hci_sock = hci_open_dev(dev_id);
+    if (hci_sock < 0) return -1;
+
+    if (hci_read_bd_addr(hci_sock, &local_bdaddr, 0) < 0) {
+        close(hci_sock);
+        return -1;
+    }
+
+    char local_addr_str[18];
+    ba2str(&local_bdaddr, local_addr_str);
+    snprintf(local, local_len, "hci%d (%s), PSM 0x%04x", dev_id, local_addr_str, psm);
+
+    // Enable device discoverability by setting scan mode
+    // This allows the central device to find and connect to this peripheral
+    uint8_t param = (SCAN_PAGE | SCAN_INQUIRY);
+    if (hci_send_cmd(hci_sock, OGF_HOST_CTL, OCF_WRITE_SCAN_ENABLE, 1, &param) < 0) {
+        close(hci_sock);
+        return -1;
+    }
+    close(hci_sock);
+
+    int fd = socket(AF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
+    if (fd < 0) return -1;
+
+    // Bind socket to local Bluetooth adapter and specified port
+    loc_addr.l2_family = AF_BLUETOOTH;
+    bacpy(&loc_addr.l2_bdaddr, &local_bdaddr);
+    loc_addr.l2_psm = htobs(psm);
+
+    if (bind(fd, (struct sockaddr*)&loc_addr, sizeof(loc_addr)) < 0 || listen(fd, backlog) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int l2cap_accept(int listen_fd, char* peer, size_t peer_len)
+{
+    struct sockaddr_l2 rem_addr = {0};
+    socklen_t opt = sizeof(rem_addr);
+    char buf[18];
+
+    int fd = accept4(listen_fd, (struct sockaddr*)&rem_addr, &opt, SOCK_NONBLOCK);
+    if (fd < 0) return -1;
+
+    ba2str(&rem_addr.l2_bdaddr, buf);
+    snprintf(peer, peer_len, "%s", buf);
+    return fd;
+}
+
+static int l2cap_connect(const char* addr)
+{
+    struct sockaddr_l2 local_addr = {0};
+    struct sockaddr_l2 rem_addr = {0};
+    char bdaddr[18];
+    int dev_id = 0;
+    uint16_t psm = BB_L2CAP_PSM;
+
+    l2cap_parse(addr, bdaddr, sizeof(bdaddr), &dev_id, &psm);
+    if (str2ba(bdaddr, &rem_addr.l2_bdaddr) < 0 || bachk(bdaddr) < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int fd = socket(AF_BLUETOOTH, SOCK_SEQPACKET | SOCK_NONBLOCK, BTPROTO_L2CAP);
+    if (fd < 0) return -1;
+
+    // Bind socket to the selected local adapter
+    local_addr.l2_family = AF_BLUETOOTH;
+    if (hci_devba(dev_id, &local_addr.l2_bdaddr) < 0) {
+        bacpy(&local_addr.l2_bdaddr, BDADDR_ANY);
+    }
+    if (bind(fd, (struct sockaddr*)&local_addr, sizeof(local_addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    rem_addr.l2_family = AF_BLUETOOTH;
+    rem_addr.l2_psm = htobs(psm);
+    if (connect(fd, (struct sockaddr*)&rem_addr, sizeof(rem_addr)) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+const bb_transport bb_transport_l2cap = {
+    .name = "l2cap",
+    .mtu = BB_L2CAP_MTU,
+    .listen = l2cap_listen,
+    .accept = l2cap_accept,
+    .connect = l2cap_connect,
+    .send = seqpacket_send,
+    .recv = seqpacket_recv,
+    .sendv = seqpacket_sendv,
+    .recvv = seqpacket_recvv,
+    .flush = seqpacket_flush,
+};
+
+/* ------------------------------------------------------------------------ */
+/* AF_UNIX SOCK_SEQPACKET                                                    */
+/* ------------------------------------------------------------------------ */
+
+static int unix_address(const char* path, struct sockaddr_un* sun)
+{
+    memset(sun, 0, sizeof(*sun));
+    sun->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sun->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(sun->sun_path, path);
+    return 0;
+}
+
+static int unix_listen(const char* addr, int backlog, char* local, size_t local_len)
+{
+    struct sockaddr_un sun;
+
+    if (unix_address(addr, &sun) < 0) return -1;
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd < 0) return -1;
+
+    // Remove a socket file left over by a previous run
+    unlink(addr);
+    if (bind(fd, (struct sockaddr*)&sun, sizeof(sun)) < 0 || listen(fd, backlog) < 0) {
+        close(fd);
+        return -1;
+    }
+    snprintf(local, local_len, "%s", addr);
+    return fd;
+}
+
+static int unix_accept(int listen_fd, char* peer, size_t peer_len)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK);
+    if (fd < 0) return -1;
+
+    // Local peers have no address, the peer process identifies the session
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0) {
+        snprintf(peer, peer_len, "unix:pid%d", (int)cred.pid);
+    } else {
+        snprintf(peer, peer_len, "unix:fd%d", fd);
+    }
+    return fd;
+}
+
+static int unix_connect(const char* addr)
+{
+    struct sockaddr_un sun;
+
+    if (unix_address(addr, &sun) < 0) return -1;
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0);
+    if (fd < 0) return -1;
+
+    if (connect(fd, (struct sockaddr*)&sun, sizeof(sun)) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+const bb_transport bb_transport_unix = {
+    .name = "unix",
+    .mtu = BB_MAX_FRAME,
+    .listen = unix_listen,
+    .accept = unix_accept,
+    .connect = unix_connect,
+    .send = seqpacket_send,
+    .recv = seqpacket_recv,
+    .sendv = seqpacket_sendv,
+    .recvv = seqpacket_recvv,
+    .flush = seqpacket_flush,
+};
+
+/* ------------------------------------------------------------------------ */
+/* TCP, frames carry a 2-byte big-endian length prefix                       */
+/* ------------------------------------------------------------------------ */
+
+static struct addrinfo* tcp_resolve(const char* addr, int passive)
+{
+    struct addrinfo hints = {0};
+    struct addrinfo* res = NULL;
+    char host[64];
+
+    // Split "host:port" at the last colon
+    const char* colon = strrchr(addr, ':');
+    if (!colon || (size_t)(colon - addr) >= sizeof(host)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    memcpy(host, addr, colon - addr);
+    host[colon - addr] = '\0';
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    if (getaddrinfo(host[0] ? host : NULL, colon + 1, &hints, &res) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return res;
+}
+
+static void tcp_nodelay(int fd)
+{
+    // Frames are small and latency bound, never wait for Nagle
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+static int tcp_listen(const char* addr, int backlog, char* local, size_t local_len)
+{
+    int one = 1;
+    struct addrinfo* res = tcp_resolve(addr, 1);
+    if (!res) return -1;
+
+    int fd = socket(res->ai_family, SOCK_STREAM, 0);
+    if (fd < 0) {
+        freeaddrinfo(res);
+        return -1;
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, res->ai_addr, res->ai_addrlen) < 0 || listen(fd, backlog) < 0) {
+        freeaddrinfo(res);
+        close(fd);
+        return -1;
+    }
+    freeaddrinfo(res);
+    snprintf(local, local_len, "%s", addr);
+    return fd;
+}
+
+static int tcp_accept(int listen_fd, char* peer, size_t peer_len)
+{
+    struct sockaddr_storage ss;
+    socklen_t len = sizeof(ss);
+    char host[NI_MAXHOST], port[NI_MAXSERV];
+
+    int fd = accept4(listen_fd, (struct sockaddr*)&ss, &len, SOCK_NONBLOCK);
+    if (fd < 0) return -1;
+
+    tcp_nodelay(fd);
+    if (getnameinfo((struct sockaddr*)&ss, len, host, sizeof(host), port, sizeof(port),
+                    NI_NUMERICHOST | NI_NUMERICSERV) == 0) {
+        snprintf(peer, peer_len, "tcp:%s:%s", host, port);
+    } else {
+        snprintf(peer, peer_len, "tcp:fd%d", fd);
+    }
+    return fd;
+}
+
+static int tcp_connect(const char* addr)
+{
+    struct addrinfo* res = tcp_resolve(addr, 0);
+    if (!res) return -1;
+
+    int fd = socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        freeaddrinfo(res);
+        return -1;
+    }
+
+    tcp_nodelay(fd);
+    if (connect(fd, res->ai_addr, res->ai_addrlen) < 0 && errno != EINPROGRESS) {
+        freeaddrinfo(res);
+        close(fd);
+        return -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+static int tcp_flush(int fd, bb_io* io)
+{
+    // The queue is the stream itself, prefixes included
+    while (io->tx_len > 0) {
+        ssize_t sent = send(fd, io->tx, io->tx_len, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent < 0 && errno == EAGAIN) return 1;
+        if (sent <= 0) return -1;
+        memmove(io->tx, io->tx + sent, io->tx_len - sent);
+        io->tx_len -= sent;
+    }
+    return 0;
+}
+
+static ssize_t tcp_sendv(int fd, bb_io* io, const struct iovec* iov, int iovcnt)
+{
+    struct iovec all[BB_MAX_IOV + 1];
+    struct msghdr mh = {0};
+    uint8_t hdr[BB_FRAME_PREFIX];
+    size_t len = iov_total(iov, iovcnt);
+
+    if (len > 0xffff || iovcnt > BB_MAX_IOV) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    // Bytes must not overtake those still queued
+    if (io->tx_len > 0 && tcp_flush(fd, io) < 0) return -1;
+    if (io->tx_len > 0) return io_queue(io, iov, iovcnt, 0);
+
+    hdr[0] = (uint8_t)(len >> 8);
+    hdr[1] = (uint8_t)len;
+
+    // Length prefix and frame leave in one sendmsg, so in one segment;
+    // whatever the socket did not take waits in the queue
+    all[0].iov_base = hdr;
+    all[0].iov_len = sizeof(hdr);
+    memcpy(all + 1, iov, iovcnt * sizeof(*iov));
+    mh.msg_iov = all;
+    mh.msg_iovlen = iovcnt + 1;
+    ssize_t sent;
+    do {
+        sent = sendmsg(fd, &mh, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    if (sent < 0 && errno != EAGAIN) return -1;
+    if (sent == (ssize_t)(sizeof(hdr) + len)) return len;
+    return io_queue(io, iov, iovcnt, sent < 0 ? 0 : sent);
+}
+
+static ssize_t tcp_recvv(int fd, bb_io* io, const struct iovec* iov, int iovcnt)
+{
+    size_t want = BB_FRAME_PREFIX;
+
+    // Read the length prefix, then exactly the frame it announces: the
+    // next frame stays in the socket, so epoll still reports it
+    for (;;) {
+        if (io->rx_len >= BB_FRAME_PREFIX) {
+            size_t len = ((size_t)io->rx[0] << 8) | io->rx[1];
+            if (len > BB_MAX_FRAME || len > iov_total(iov, iovcnt)) {
+                // Cannot resynchronize a stream after an oversized frame
+                errno = EMSGSIZE;
+                return -1;
+            }
+            want = BB_FRAME_PREFIX + len;
+        }
+        if (io->rx_len == want) break;
+
+        ssize_t n = recv(fd, io->rx + io->rx_len, want - io->rx_len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return n;
+        io->rx_len += n;
+    }
+
+    // Scatter the frame into the buffers in order
+    const uint8_t* frame = io->rx + BB_FRAME_PREFIX;
+    size_t left = want - BB_FRAME_PREFIX;
+    for (int i = 0; i < iovcnt && left > 0; i++) {
+        size_t n = iov[i].iov_len < left ? iov[i].iov_len : left;
+        memcpy(iov[i].iov_base, frame, n);
+        frame += n;
+        left -= n;
+    }
+    io->rx_len = 0;
+    return want - BB_FRAME_PREFIX;
+}
+
+static ssize_t tcp_send(int fd, bb_io* io, const void* buf, size_t len)
+{
+    struct iovec iov = {(void*)buf, len};
+    return tcp_sendv(fd, io, &iov, 1);
+}
+
+static ssize_t tcp_recv(int fd, bb_io* io, void* buf, size_t cap)
+{
+    struct iovec iov = {buf, cap};
+    return tcp_recvv(fd, io, &iov, 1);
+}
+
+const bb_transport bb_transport_tcp = {
+    .name = "tcp",
+    .mtu = BB_MAX_FRAME,
+    .listen = tcp_listen,
+    .accept = tcp_accept,
+    .connect = tcp_connect,
+    .send = tcp_send,
+    .recv = tcp_recv,
+    .sendv = tcp_sendv,
+    .recvv = tcp_recvv,
+    .flush = tcp_flush,
+};
+
+const bb_transport* bb_transport_lookup(const char* spec, const char** addr)
+{
+    static const bb_transport* const transports[] = {
+        &bb_transport_l2cap, &bb_transport_unix, &bb_transport_tcp,
+    };
+
+    for (size_t i = 0; i < sizeof(transports) / sizeof(transports[0]); i++) {
+        size_t n = strlen(transports[i]->name);
+        if (strncmp(spec, transports[i]->name, n) == 0 && spec[n] == ':') {
+            *addr = spec + n + 1;
+            return transports[i];
+        }
+    }
+
+    // A bare Bluetooth address keeps working as before
+    if (strlen(spec) >= 17 && spec[2] == ':') {
+        *addr = spec;
+        return &bb_transport_l2cap;
+    }
+    return NULL;
+}